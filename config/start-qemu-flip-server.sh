@@ -0,0 +1,12 @@
+#!/bin/sh
+# two TCG guests sharing one flip_server, build it in tools/ first
+sock=/tmp/flip.sock
+
+../tools/flip_server -n 2 -c 0 $sock &
+sleep 1
+
+for i in 0 1; do
+ ~/qemu/build/x86_64-softmmu/qemu-system-x86_64 -m 1024 -drive file=debian$i.img,format=raw -device pci-flip,server=$sock -device e1000,netdev=net0 -netdev user,id=net0,hostfwd=tcp:127.0.0.1:556$i-:22 &
+done
+
+wait
@@ -0,0 +1,1003 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "flipd.h"
+
+#define FLIP_CONF_UP   0x0
+#define FLIP_CONF_LOW  0x1
+#define FLIP_CONF_LUT  0x2
+#define FLIP_CONF_UTF8_UP  0x3
+#define FLIP_CONF_UTF8_LOW 0x4
+
+#define FLIP_LUT_LEN   256
+
+#define FLIP_IO  0xF4
+#define FLIP_CMD_DIR  _IOW(FLIP_IO, 1, int)
+#define FLIP_CMD_LUT  _IOW(FLIP_IO, 2, unsigned char[FLIP_LUT_LEN])
+#define FLIP_CMD_CRC  _IOW(FLIP_IO, 3, int)
+#define FLIP_CMD_GET_CRC  _IOR(FLIP_IO, 4, unsigned int)
+#define FLIP_CMD_CLASS  _IOW(FLIP_IO, 5, int)
+#define FLIP_CMD_PROGRESS  _IOW(FLIP_IO, 6, int)
+#define FLIP_URING_CONVERT  _IOWR(FLIP_IO, 7, struct flip_uring_cmd)
+#define FLIP_CMD_BUSY_POLL  _IOW(FLIP_IO, 8, int)
+
+/* io_uring passthrough command, in the sqe */
+struct flip_uring_cmd {
+	uint64_t addr;
+	uint32_t len;
+	uint32_t rsvd;
+};
+
+#define FLIP_DEV "/dev/flip0"
+#define FLIP_SYSFS "/sys/bus/pci/drivers/pci-flip/*/"
+
+#define MAX_SIZES 32
+#define READ_TIMEOUT_NS 5000000000LL   /* give up on a missing reply after 5 s */
+
+static char sysfs_dir[256];
+static unsigned char lut[FLIP_LUT_LEN];   /* table used by -d 2, rot13 */
+static int use_crc;                       /* -c: device checksums the output */
+static int depth = 1;                     /* -q: writes in flight before reading back */
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* locate the pci-flip device directory in sysfs */
+static int sysfs_find(void)
+{
+	glob_t g;
+	char *p;
+
+	if (glob(FLIP_SYSFS "dev_reqs", 0, NULL, &g) || !g.gl_pathc)
+		return -1;
+
+	strncpy(sysfs_dir, g.gl_pathv[0], sizeof(sysfs_dir) - 1);
+	p = strrchr(sysfs_dir, '/');
+	if (p)
+		p[1] = 0;
+	globfree(&g);
+
+	return 0;
+}
+
+static long long sysfs_read(const char *name)
+{
+	char path[512];
+	long long val = 0;
+	FILE *fp;
+
+	if (!sysfs_dir[0])
+		return 0;
+
+	snprintf(path, sizeof(path), "%s%s", sysfs_dir, name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%lld", &val) != 1)
+		val = 0;
+	fclose(fp);
+
+	return val;
+}
+
+/* counters sampled around each run */
+struct counters {
+	long long pool_reqs;
+	long long pool_setup_ns;
+	long long sg_reqs;
+	long long sg_setup_ns;
+	long long cpu_reqs;
+};
+
+static void counters_read(struct counters *c)
+{
+	c->pool_reqs = sysfs_read("pool_reqs");
+	c->pool_setup_ns = sysfs_read("pool_setup_ns");
+	c->sg_reqs = sysfs_read("sg_reqs");
+	c->sg_setup_ns = sysfs_read("sg_setup_ns");
+	c->cpu_reqs = sysfs_read("cpu_reqs");
+}
+
+/* read back exactly len bytes, the port path delivers them asynchronously */
+static int read_full(int fd, char *buf, size_t len)
+{
+	long long deadline = now_ns() + READ_TIMEOUT_NS;
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		n = read(fd, buf + got, len - got);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			if (now_ns() > deadline)
+				return -1;
+			usleep(100);
+			continue;
+		}
+		got += n;
+	}
+
+	return 0;
+}
+
+/* bitwise crc32c, only used to check the device */
+static unsigned int crc32c(const char *buf, size_t len)
+{
+	unsigned int crc = ~0u;
+	int k;
+
+	while (len--) {
+		crc ^= (unsigned char)*buf++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+	}
+
+	return ~crc;
+}
+
+static int check(const char *in, const char *out, size_t len, int dir)
+{
+	size_t i;
+	char c;
+
+	for (i = 0; i < len; i++) {
+		c = in[i];
+		if (dir == FLIP_CONF_LUT)
+			c = lut[(unsigned char)c];
+		else if ((dir == FLIP_CONF_UP || dir == FLIP_CONF_UTF8_UP) && c >= 'a' && c <= 'z')
+			c -= 32;
+		else if ((dir == FLIP_CONF_LOW || dir == FLIP_CONF_UTF8_LOW) && c >= 'A' && c <= 'Z')
+			c += 32;
+		if (out[i] != c) {
+			printf("mismatch at %zu: 0x%02x != 0x%02x\n", i, out[i] & 0xff, c & 0xff);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(int fd, size_t size, int iters, int dir, int verify)
+{
+	struct counters c0, c1;
+	long long start, elapsed, *lat;
+	unsigned int crc;
+	char *in, *out;
+	size_t i;
+	int n, k, j, err = 0;
+
+	in = malloc(size);
+	out = malloc(size);
+	lat = malloc(sizeof(*lat) * (iters ? iters : 1));
+	if (!in || !out || !lat) {
+		printf("out of memory!\n");
+		exit(0);
+	}
+
+	/* printable, no zero bytes: the port path treats zero as padding */
+	for (i = 0; i < size; i++)
+		in[i] = "aBcDeFgHiJkLmNoPqRsTuVwXyZ0123456789 "[i % 37];
+
+	counters_read(&c0);
+	start = now_ns();
+
+	for (n = 0; n < iters && !err; ) {
+		/* up to depth requests in flight, their output comes back in order */
+		for (k = 0; k < depth && n + k < iters; k++) {
+			lat[n + k] = now_ns();
+			if (write(fd, in, size) != (ssize_t)size) {
+				perror("write");
+				err = 1;
+				break;
+			}
+		}
+		for (j = 0; j < k; j++, n++) {
+			if (read_full(fd, out, size) < 0) {
+				printf("short read at size %zu\n", size);
+				err = 1;
+				break;
+			}
+			lat[n] = now_ns() - lat[n];
+			if (verify && check(in, out, size, dir) < 0) {
+				err = 1;
+				break;
+			}
+			/* one request per write below the driver's 8 MiB split */
+			if (verify && use_crc && ioctl(fd, FLIP_CMD_GET_CRC, &crc) == 0
+			    && crc != crc32c(out, size)) {
+				printf("crc mismatch at size %zu: 0x%08x\n", size, crc);
+				err = 1;
+				break;
+			}
+		}
+	}
+
+	elapsed = now_ns() - start;
+	counters_read(&c1);
+
+	printf("%10zu %8d %10.2f %10.2f", size, n,
+	       n ? elapsed / 1000.0 / n : 0.0,
+	       elapsed ? (double)size * n * 1000.0 / elapsed : 0.0);
+
+	/* round trip latency percentiles */
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf(" %10.2f %10.2f", n ? lat[n / 2] / 1000.0 : 0.0,
+	       n ? lat[(n - 1) * 99 / 100] / 1000.0 : 0.0);
+
+	/* setup cost per request of the two bus-master paths */
+	if (c1.pool_reqs > c0.pool_reqs)
+		printf(" %10lld", (c1.pool_setup_ns - c0.pool_setup_ns) / (c1.pool_reqs - c0.pool_reqs));
+	else
+		printf(" %10s", "-");
+	if (c1.sg_reqs > c0.sg_reqs)
+		printf(" %10lld", (c1.sg_setup_ns - c0.sg_setup_ns) / (c1.sg_reqs - c0.sg_reqs));
+	else
+		printf(" %10s", "-");
+	printf(" %8lld\n", c1.cpu_reqs - c0.cpu_reqs);
+
+	free(in);
+	free(out);
+	free(lat);
+}
+
+/* stress: several threads on different cpus hammering the device at once */
+
+#define STRESS_PATTERN "fLiP"
+
+struct stress_arg {
+	int cpu;
+	size_t size;
+	int iters;
+	pthread_t tid;
+	long long sent;
+	long long bad;
+};
+
+static long long stress_expected;
+static long long stress_received;
+static const char *stress_daemon;      /* go through flipd listening here */
+
+/*
+ * through flipd every thread gets its own answers back, so the output
+ * is checked byte for byte.  flipd must run in upper case mode.
+ */
+static void stress_daemon_loop(struct stress_arg *a, const char *in, char *out)
+{
+	ssize_t n;
+	size_t i;
+	int fd, k;
+
+	fd = flipd_connect(stress_daemon);
+	if (fd < 0) {
+		printf("stress thread %d: can not connect to flipd at '%s'\n", a->cpu, stress_daemon);
+		return;
+	}
+
+	for (k = 0; k < a->iters; k++) {
+		n = flipd_convert(fd, in, out, a->size);
+		if (n < 0) {
+			perror("flipd");
+			break;
+		}
+		a->sent += a->size;
+		for (i = 0; i < (size_t)n; i++)
+			if (out[i] != toupper((unsigned char)in[i]))
+				a->bad++;
+		__sync_fetch_and_add(&stress_received, n);
+	}
+
+	flipd_close(fd);
+}
+
+/*
+ * the port path funnels all threads through one output fifo, so a
+ * thread may read another's bytes: check the totals and that every byte
+ * is a converted pattern byte rather than per thread contents.
+ */
+static void *stress_thread(void *opaque)
+{
+	struct stress_arg *a = opaque;
+	long long deadline;
+	cpu_set_t set;
+	char *in, *out;
+	size_t i;
+	ssize_t n;
+	int fd, k;
+
+	CPU_ZERO(&set);
+	CPU_SET(a->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	in = malloc(a->size);
+	out = malloc(a->size);
+	if (!in || !out) {
+		printf("stress thread %d: setup failed\n", a->cpu);
+		return NULL;
+	}
+
+	for (i = 0; i < a->size; i++)
+		in[i] = STRESS_PATTERN[i % 4];
+
+	if (stress_daemon) {
+		stress_daemon_loop(a, in, out);
+		free(in);
+		free(out);
+		return NULL;
+	}
+
+	fd = open(FLIP_DEV, O_RDWR);
+	if (fd < 0) {
+		printf("stress thread %d: setup failed\n", a->cpu);
+		return NULL;
+	}
+
+	for (k = 0; k < a->iters; k++) {
+		n = write(fd, in, a->size);
+		if (n > 0)
+			a->sent += n;
+		n = read(fd, out, a->size);
+		for (i = 0; n > 0 && i < (size_t)n; i++)
+			if (!strchr("FLIP", out[i]))
+				a->bad++;
+		if (n > 0)
+			__sync_fetch_and_add(&stress_received, n);
+	}
+
+	/* drain until every thread's data is back */
+	deadline = now_ns() + READ_TIMEOUT_NS;
+	while (__sync_fetch_and_add(&stress_received, 0) < stress_expected && now_ns() < deadline) {
+		n = read(fd, out, a->size);
+		if (n <= 0) {
+			usleep(100);
+			continue;
+		}
+		for (i = 0; i < (size_t)n; i++)
+			if (!strchr("FLIP", out[i]))
+				a->bad++;
+		__sync_fetch_and_add(&stress_received, n);
+	}
+
+	close(fd);
+	free(in);
+	free(out);
+	return NULL;
+}
+
+static void stress(int threads, size_t size, int iters)
+{
+	struct stress_arg *args;
+	long long start, elapsed, sent = 0, bad = 0;
+	long long local, remote;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	args = calloc(threads, sizeof(*args));
+	if (!args) {
+		printf("out of memory!\n");
+		exit(0);
+	}
+
+	stress_expected = (long long)threads * iters * size;
+	stress_received = 0;
+
+	local = sysfs_read("local_compl");
+	remote = sysfs_read("remote_compl");
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		args[i].cpu = i % (ncpu > 0 ? ncpu : 1);
+		args[i].size = size;
+		args[i].iters = iters;
+		pthread_create(&args[i].tid, NULL, stress_thread, &args[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(args[i].tid, NULL);
+		sent += args[i].sent;
+		bad += args[i].bad;
+	}
+	elapsed = now_ns() - start;
+
+	printf("stress: %d threads, %zu bytes x %d\n", threads, size, iters);
+	printf("  sent %lld, received %lld, lost %lld, corrupt %lld\n",
+	       sent, stress_received, sent - stress_received, bad);
+	printf("  %.2f MB/s, %.0f ops/s\n",
+	       elapsed ? (double)stress_received * 1000.0 / elapsed : 0.0,
+	       elapsed ? (double)threads * iters * 1e9 / elapsed : 0.0);
+
+	/* where the driver reaped the completions, with completion queues per cpu */
+	local = sysfs_read("local_compl") - local;
+	remote = sysfs_read("remote_compl") - remote;
+	if (local + remote)
+		printf("  completions: %lld on the submitting cpu, %lld on another\n",
+		       local, remote);
+
+	free(args);
+}
+
+/*
+ * file mode: convert a file into <file>.rw with a read/write loop, then
+ * into <file>.splice through pipes, where the data never reaches user
+ * memory.  Use a large one, say 1 GB, and drop caches in between if the
+ * first pass should not warm the page cache for the second.
+ */
+
+#define FILE_CHUNK (1 << 20)
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* move len bytes from fd_in to fd_out, one side a pipe */
+static int splice_all(int fd_in, int fd_out, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = splice(fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE);
+		if (n <= 0)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static long long file_rw(int fd, int fin, int fout)
+{
+	long long total = 0;
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(FILE_CHUNK);
+	if (!buf)
+		return -1;
+
+	while ((n = read(fin, buf, FILE_CHUNK)) > 0) {
+		if (write_all(fd, buf, n) < 0 || read_full(fd, buf, n) < 0
+		    || write_all(fout, buf, n) < 0) {
+			total = -1;
+			break;
+		}
+		total += n;
+	}
+
+	free(buf);
+	return n < 0 ? -1 : total;
+}
+
+static long long file_splice(int fd, int fin, int fout)
+{
+	long long total = 0;
+	int p[2], q[2];
+	size_t got;
+	ssize_t n, m;
+
+	if (pipe(p) < 0 || pipe(q) < 0)
+		return -1;
+	/* fewer, larger requests; the default 64K pipe still works */
+	fcntl(p[1], F_SETPIPE_SZ, FILE_CHUNK);
+	fcntl(q[1], F_SETPIPE_SZ, FILE_CHUNK);
+
+	while ((n = splice(fin, NULL, p[1], NULL, FILE_CHUNK, SPLICE_F_MOVE)) > 0) {
+		if (splice_all(p[0], fd, n) < 0)
+			goto fail;
+		for (got = 0; got < (size_t)n; got += m) {
+			m = splice(fd, NULL, q[1], NULL, n - got, SPLICE_F_MOVE);
+			if (m <= 0 || splice_all(q[0], fout, m) < 0)
+				goto fail;
+		}
+		total += n;
+	}
+	if (n < 0)
+		goto fail;
+
+	close(p[0]); close(p[1]);
+	close(q[0]); close(q[1]);
+	return total;
+
+fail:
+	perror("splice");
+	close(p[0]); close(p[1]);
+	close(q[0]); close(q[1]);
+	return -1;
+}
+
+static long long cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* compare an output file with the input converted by dir */
+static int file_check(const char *path, const char *out_path, int dir)
+{
+	char *in, *out;
+	ssize_t n;
+	int fin, fout, ret = 0;
+
+	in = malloc(FILE_CHUNK);
+	out = malloc(FILE_CHUNK);
+	fin = open(path, O_RDONLY);
+	fout = open(out_path, O_RDONLY);
+	if (!in || !out || fin < 0 || fout < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	while ((n = read(fin, in, FILE_CHUNK)) > 0) {
+		if (read(fout, out, n) != n || check(in, out, n, dir) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+out:
+	if (fin >= 0)
+		close(fin);
+	if (fout >= 0)
+		close(fout);
+	free(in);
+	free(out);
+	return ret;
+}
+
+static void file_run(int fd, const char *path, int dir, int verify)
+{
+	static const char *const name[] = { "read/write", "splice" };
+	char out_path[PATH_MAX];
+	long long start, cpu, elapsed, total;
+	int fin, fout, k;
+
+	printf("%12s %14s %10s %10s\n", "", "bytes", "MB/s", "cpu ms");
+	for (k = 0; k < 2; k++) {
+		snprintf(out_path, sizeof(out_path), "%s.%s", path, k ? "splice" : "rw");
+		fin = open(path, O_RDONLY);
+		fout = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fin < 0 || fout < 0) {
+			printf("can not open '%s' or '%s'\n", path, out_path);
+			exit(0);
+		}
+
+		start = now_ns();
+		cpu = cpu_ns();
+		total = k ? file_splice(fd, fin, fout) : file_rw(fd, fin, fout);
+		fsync(fout);
+		cpu = cpu_ns() - cpu;
+		elapsed = now_ns() - start;
+		close(fin);
+		close(fout);
+
+		if (total < 0) {
+			printf("%12s failed\n", name[k]);
+			continue;
+		}
+		printf("%12s %14lld %10.2f %10.2f\n", name[k], total,
+		       elapsed ? (double)total * 1000.0 / elapsed : 0.0, cpu / 1e6);
+		if (verify && file_check(path, out_path, dir) < 0)
+			printf("%12s output does not match\n", name[k]);
+	}
+}
+
+/*
+ * progress mode: a thread writes one large request while this one polls
+ * and reads it back.  With progress completions the first byte comes
+ * back after an interval instead of after the whole request.
+ */
+
+struct ttfb_arg {
+	int fd;
+	const char *buf;
+	size_t size;
+	int ret;
+};
+
+static void *ttfb_writer(void *opaque)
+{
+	struct ttfb_arg *a = opaque;
+
+	a->ret = write_all(a->fd, a->buf, a->size);
+	return NULL;
+}
+
+static void ttfb_run(int fd, size_t size, int iters, int dir, int verify)
+{
+	struct ttfb_arg a;
+	struct pollfd pfd;
+	pthread_t tid;
+	long long t0, *first, *total;
+	char *in, *out;
+	size_t got, i;
+	ssize_t r;
+	int n;
+
+	in = malloc(size);
+	out = malloc(size);
+	first = malloc(sizeof(*first) * (iters ? iters : 1));
+	total = malloc(sizeof(*total) * (iters ? iters : 1));
+	if (!in || !out || !first || !total) {
+		printf("out of memory!\n");
+		exit(0);
+	}
+	for (i = 0; i < size; i++)
+		in[i] = "aBcDeFgHiJkLmNoPqRsTuVwXyZ0123456789 "[i % 37];
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (n = 0; n < iters; n++) {
+		a.fd = fd;
+		a.buf = in;
+		a.size = size;
+		first[n] = 0;
+		got = 0;
+
+		t0 = now_ns();
+		pthread_create(&tid, NULL, ttfb_writer, &a);
+		while (got < size) {
+			if (poll(&pfd, 1, READ_TIMEOUT_NS / 1000000) <= 0)
+				break;
+			r = read(fd, out + got, size - got);
+			if (r < 0)
+				break;
+			if (r > 0 && !got)
+				first[n] = now_ns() - t0;
+			got += r;
+		}
+		total[n] = now_ns() - t0;
+		pthread_join(tid, NULL);
+
+		if (a.ret < 0 || got < size) {
+			printf("short read at size %zu\n", size);
+			break;
+		}
+		if (verify && check(in, out, size, dir) < 0)
+			break;
+	}
+
+	qsort(first, n, sizeof(*first), cmp_ll);
+	qsort(total, n, sizeof(*total), cmp_ll);
+	printf("%10zu %8d %12.2f %12.2f\n", size, n,
+	       n ? first[n / 2] / 1000.0 : 0.0, n ? total[n / 2] / 1000.0 : 0.0);
+
+	free(in);
+	free(out);
+	free(first);
+	free(total);
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * -u: round trips through write() and read(), woken by the completion
+ * interrupt, against IORING_OP_URING_CMD converting the buffer in place,
+ * once waiting for the interrupt and once on an IORING_SETUP_IOPOLL ring
+ * the driver polls for the completion.
+ */
+
+static int lat_rw(int fd, const char *in, char *out, size_t size, int iters,
+		  int dir, int verify, long long *lat)
+{
+	long long t0;
+	int n;
+
+	for (n = 0; n < iters; n++) {
+		t0 = now_ns();
+		if (write(fd, in, size) != (ssize_t)size || read_full(fd, out, size) < 0) {
+			printf("read() path failed at size %zu\n", size);
+			break;
+		}
+		lat[n] = now_ns() - t0;
+		if (verify && check(in, out, size, dir) < 0)
+			break;
+	}
+
+	return n;
+}
+
+static int lat_uring(int fd, const char *in, char *buf, size_t size, int iters,
+		     int dir, int verify, int iopoll, long long *lat)
+{
+	struct io_uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct flip_uring_cmd *cmd;
+	long long t0;
+	int n, ret, res;
+
+	ret = io_uring_queue_init(8, &ring, iopoll ? IORING_SETUP_IOPOLL : 0);
+	if (ret < 0) {
+		printf("io_uring%s: %s\n", iopoll ? " iopoll" : "", strerror(-ret));
+		return 0;
+	}
+
+	for (n = 0; n < iters; n++) {
+		/* converted in place, start over from the input */
+		memcpy(buf, in, size);
+
+		t0 = now_ns();
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_rw(IORING_OP_URING_CMD, sqe, fd, NULL, 0, 0);
+		sqe->cmd_op = FLIP_URING_CONVERT;
+		cmd = (struct flip_uring_cmd *)sqe->cmd;
+		cmd->addr = (uintptr_t)buf;
+		cmd->len = size;
+		cmd->rsvd = 0;
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret >= 0)
+			ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret < 0) {
+			printf("io_uring: %s\n", strerror(-ret));
+			break;
+		}
+		res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		lat[n] = now_ns() - t0;
+
+		if (res != (int)size) {
+			printf("uring_cmd at size %zu: %s\n", size, res < 0 ? strerror(-res) : "short");
+			break;
+		}
+		if (verify && check(in, buf, size, dir) < 0)
+			break;
+	}
+
+	io_uring_queue_exit(&ring);
+	return n;
+}
+
+static void lat_print(long long *lat, int n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf(" %10.2f %10.2f", n ? lat[n / 2] / 1000.0 : 0.0,
+	       n ? lat[(n - 1) * 99 / 100] / 1000.0 : 0.0);
+}
+
+static void uring_run(int fd, size_t size, int iters, int dir, int verify)
+{
+	long long *lat;
+	char *in, *out;
+	size_t i;
+	int n;
+
+	in = malloc(size);
+	out = malloc(size);
+	lat = malloc(sizeof(*lat) * (iters ? iters : 1));
+	if (!in || !out || !lat) {
+		printf("out of memory!\n");
+		exit(0);
+	}
+	for (i = 0; i < size; i++)
+		in[i] = "aBcDeFgHiJkLmNoPqRsTuVwXyZ0123456789 "[i % 37];
+
+	printf("%10zu %8d", size, iters);
+	n = lat_rw(fd, in, out, size, iters, dir, verify, lat);
+	lat_print(lat, n);
+	n = lat_uring(fd, in, out, size, iters, dir, verify, 0, lat);
+	lat_print(lat, n);
+	n = lat_uring(fd, in, out, size, iters, dir, verify, 1, lat);
+	lat_print(lat, n);
+	printf("\n");
+
+	free(in);
+	free(out);
+	free(lat);
+}
+#endif
+
+static void usage(void)
+{
+	printf("usage: flip_bench [-s size[,size...]] [-n iterations] [-d 0-4] [-v] [-c] [-C class] [-j threads] [-D socket] [-f file] [-p kib] [-u] [-b us] [-q depth]\n");
+	printf("       -s: request sizes in bytes, default 16,256,4096,65536,1048576\n");
+	printf("       -n: requests per size, default 1000\n");
+	printf("       -d: '0' upper case, '1' lower case, '2' rot13 through the table,\n");
+	printf("           '3' and '4' upper and lower case in the UTF-8 modes, ASCII data\n");
+	printf("       -v: verify the converted data\n");
+	printf("       -c: have the device return crc32c of the output, checked with -v\n");
+	printf("       -C: service class, '0' normal, '1' latency, '2' batch\n");
+	printf("       -j: stress with this many threads, one per cpu, first size only\n");
+	printf("       -D: stress through flipd listening at socket, '-' for " FLIPD_SOCK "\n");
+	printf("       -f: convert file with read/write and with splice, compare\n");
+	printf("       -p: progress every kib KiB, time the first byte of each size, '0' for none\n");
+	printf("       -b: spin up to us in read() before sleeping, '0' never\n");
+	printf("       -q: writes in flight before their output is read, default 1,\n");
+	printf("           at most the driver's pool buffers, 32 per pool chunk\n");
+#ifdef HAVE_LIBURING
+	printf("       -u: latency of read() against io_uring passthrough, with and without iopoll\n");
+#endif
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sizes[MAX_SIZES] = { 16, 256, 4096, 65536, 1048576 };
+	int nr_sizes = 5;
+	int iters = 1000;
+	int dir = FLIP_CONF_UP;
+	int verify = 0;
+	int threads = 0;
+	int class = -1;
+	const char *file = NULL;
+	int progress = -1;
+	int busy = -1;
+#ifdef HAVE_LIBURING
+	int uring = 0;
+#endif
+	char *p, *tok;
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "s:n:d:vcC:j:D:f:p:ub:q:h")) != -1) {
+		switch (opt) {
+		case 's':
+			nr_sizes = 0;
+			for (tok = strtok(optarg, ","); tok && nr_sizes < MAX_SIZES; tok = strtok(NULL, ","))
+				sizes[nr_sizes++] = strtoul(tok, &p, 0);
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 'd':
+			dir = atoi(optarg);
+			if (dir < FLIP_CONF_UP || dir > FLIP_CONF_UTF8_LOW)
+				usage();
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		case 'c':
+			use_crc = 1;
+			break;
+		case 'C':
+			class = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'D':
+			stress_daemon = strcmp(optarg, "-") ? optarg : FLIPD_SOCK;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			progress = atoi(optarg);
+			break;
+		case 'b':
+			busy = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth < 1)
+				usage();
+			break;
+#ifdef HAVE_LIBURING
+		case 'u':
+			uring = 1;
+			break;
+#endif
+		default:
+			usage();
+		}
+	}
+
+	/* the daemon owns the device */
+	if (stress_daemon) {
+		stress(threads > 0 ? threads : 1, sizes[0], iters);
+		return 0;
+	}
+
+	if ((fd = open(FLIP_DEV, O_RDWR)) < 0) {
+		printf("can not open '/dev/flip0', make sure it exist!\n");
+		exit(0);
+	}
+
+	for (i = 0; i < FLIP_LUT_LEN; i++) {
+		lut[i] = i;
+		if (i >= 'a' && i <= 'z')
+			lut[i] = 'a' + (i - 'a' + 13) % 26;
+		else if (i >= 'A' && i <= 'Z')
+			lut[i] = 'A' + (i - 'A' + 13) % 26;
+	}
+	if (dir == FLIP_CONF_LUT && ioctl(fd, FLIP_CMD_LUT, lut) < 0)
+		perror("table load failed!\n");
+
+	if (ioctl(fd, FLIP_CMD_DIR, &dir) < 0)
+		perror("ioctl failed!\n");
+
+	if (class >= 0 && ioctl(fd, FLIP_CMD_CLASS, &class) < 0)
+		perror("class not supported");
+
+	if (busy >= 0 && ioctl(fd, FLIP_CMD_BUSY_POLL, &busy) < 0)
+		perror("busy-poll not supported");
+
+	if (use_crc && ioctl(fd, FLIP_CMD_CRC, &use_crc) < 0) {
+		perror("crc not supported");
+		use_crc = 0;
+	}
+
+	if (sysfs_find() < 0)
+		printf("pci-flip sysfs attributes not found, no setup cost\n");
+
+	if (threads > 0) {
+		/* stress always converts to upper case */
+		dir = FLIP_CONF_UP;
+		ioctl(fd, FLIP_CMD_DIR, &dir);
+		stress(threads, sizes[0], iters);
+		close(fd);
+		return 0;
+	}
+
+	if (file) {
+		file_run(fd, file, dir, verify);
+		close(fd);
+		return 0;
+	}
+
+	if (progress >= 0) {
+		if (ioctl(fd, FLIP_CMD_PROGRESS, &progress) < 0)
+			perror("progress not supported");
+		printf("%10s %8s %12s %12s\n", "size", "reqs", "p50 first us", "p50 all us");
+		for (i = 0; i < nr_sizes; i++)
+			ttfb_run(fd, sizes[i], iters, dir, verify);
+		close(fd);
+		return 0;
+	}
+
+#ifdef HAVE_LIBURING
+	if (uring) {
+		printf("%10s %8s %10s %10s %10s %10s %10s %10s\n", "size", "reqs",
+		       "read p50", "read p99", "uring p50", "uring p99", "iopoll p50", "iopoll p99");
+		for (i = 0; i < nr_sizes; i++)
+			uring_run(fd, sizes[i], iters, dir, verify);
+		close(fd);
+		return 0;
+	}
+#endif
+
+	printf("%10s %8s %10s %10s %10s %10s %10s %10s %8s\n",
+	       "size", "reqs", "us/req", "MB/s", "p50 us", "p99 us", "pool ns", "sg ns", "cpu");
+	for (i = 0; i < nr_sizes; i++)
+		run(fd, sizes[i], iters, dir, verify);
+
+	close(fd);
+	return 0;
+}
@@ -6,8 +6,45 @@
 #include <linux/interrupt.h>
 #include <linux/ioctl.h>
 #include <linux/delay.h>
-#include <linux/semaphore.h>
 #include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/crc32c.h>
+#include <linux/bitops.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/highmem.h>
+#include <linux/version.h>
+#include <linux/kfifo.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+
+#define CREATE_TRACE_POINTS
+#include "flip_trace.h"
+
+/* io_uring passthrough, its driver interface settled in 6.3 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define FLIP_URING
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
 
 #define KOBJ_NAME_LEN 20
 #define FLIP_REG_LEN 4
@@ -19,223 +56,2804 @@
 #define FLIP_REG_STATE 0x1
 #define FLIP_REG_IN    0x2
 #define FLIP_REG_OUT   0x2 + FLIP_REG_LEN
+#define FLIP_REG_ROOM  0xa                 /* 16 bits, bytes free in the input fifo, revision 7 */
+#define FLIP_REG_AVAIL 0xc                 /* 16 bits, bytes ready in the output fifo, revision 7 */
 
 #define FLIP_CONF_UP   0x0
 #define FLIP_CONF_LOW  0x1
+#define FLIP_CONF_LUT  0x2                 /* translate through the loaded table, revision 3 */
+#define FLIP_CONF_UTF8_UP  0x3             /* unicode case of UTF-8 text, revision 10 */
+#define FLIP_CONF_UTF8_LOW 0x4
+#define FLIP_UTF8_GROWTH   3               /* UTF-8 output is at most this times the input */
 #define FLIP_IN_EMPTY  (0x1 << 1) 
 #define FLIP_OUT_EMPTY (0x1 << 2)
 
 #define FLIP_IO  0xF4
+#define FLIP_LUT_LEN   256                 /* one table entry per byte value */
+
 #define FLIP_CMD_DIR  _IOW(FLIP_IO, 1, int)
+#define FLIP_CMD_LUT  _IOW(FLIP_IO, 2, unsigned char[FLIP_LUT_LEN])
+#define FLIP_CMD_CRC  _IOW(FLIP_IO, 3, int)
+#define FLIP_CMD_GET_CRC  _IOR(FLIP_IO, 4, __u32)
+#define FLIP_CMD_CLASS  _IOW(FLIP_IO, 5, int)
+#define FLIP_CMD_PROGRESS  _IOW(FLIP_IO, 6, int)
+#define FLIP_CMD_BUSY_POLL  _IOW(FLIP_IO, 8, int)
+
+/*
+ * IORING_OP_URING_CMD with this cmd_op converts the buffer in place,
+ * the cqe carries the bytes converted and, in a big cqe, the crc
+ */
+#define FLIP_URING_CONVERT  _IOWR(FLIP_IO, 7, struct flip_uring_cmd)
+
+struct flip_uring_cmd {
+	__u64 addr;                  /* user buffer */
+	__u32 len;                   /* at most FLIP_SG_MAX_LEN */
+	__u32 rsvd;                  /* must be 0 */
+};
+
+/* service classes, each has its own submission queue on a revision 4 device */
+#define FLIP_CLASS_NORMAL   0
+#define FLIP_CLASS_LATENCY  1              /* strict priority over the others */
+#define FLIP_CLASS_BATCH    2              /* meant to be throttled by the host */
+#define FLIP_NR_CLASSES     3
+
+/* requests smaller than this are converted on the cpu, see flip_cpu_write() */
+#define FLIP_CPU_THRESHOLD 64
+
+#define FLIP_BUSY_POLL_MAX 10000           /* us, longest spin in read() */
+
+#define FLIP_HIST_BUCKETS  32              /* log2 of ns, the last one takes 2 s and up */
+
+/* bus-master registers, BAR 1 of a revision 2 device */
+#define FLIP_DMA_CTRL      0x00
+#define FLIP_DMA_ISR       0x04
+#define FLIP_DMA_RING_SIZE 0x08
+#define FLIP_DMA_SQ_BASE   0x10
+#define FLIP_DMA_CQ_BASE   0x18
+#define FLIP_DMA_SQ_TAIL   0x20
+#define FLIP_DMA_SQ_HEAD   0x24
+#define FLIP_DMA_CQ_TAIL   0x28
+#define FLIP_DMA_CQ_HEAD   0x2c
+#define FLIP_DMA_STATS     0x30
+#define FLIP_DMA_LUT       0x38            /* writing hi at 0x3c loads the table */
+#define FLIP_DMA_QUEUES    0x40            /* submission queues, 0 before revision 4 */
+#define FLIP_DMA_SHM_KICK  0x44            /* server mode doorbell, revision 5 */
+#define FLIP_DMA_CQS       0x48            /* completion queues, 0 before revision 6 */
+#define FLIP_DMA_QUEUE     0x200           /* queue n registers at 0x200 + n * 0x20 */
+#define FLIP_DMA_QUEUE_SIZE 0x20
+#define FLIP_DMA_CQ        0x400           /* completion queue n registers at 0x400 + n * 0x20 */
+#define FLIP_DMA_CQ_SIZE   0x20
+
+#define FLIP_SQ_BASE       0x00
+#define FLIP_SQ_TAIL       0x08
+#define FLIP_SQ_PRIO       0x10
+#define FLIP_PRIO_HIGH     1
+
+#define FLIP_CQ_BASE       0x00
+#define FLIP_CQ_TAIL       0x08
+#define FLIP_CQ_HEAD       0x0c
+#define FLIP_CQ_FLAGS      0x10            /* revision 9 */
+#define FLIP_CQ_POLLED     (0x1 << 0)      /* no interrupt, reaped by io_uring iopoll */
+#define FLIP_MAX_CQS       16              /* msi-x vector n for queue n */
+
+#define FLIP_CTRL_ENABLE   (0x1 << 0)
+#define FLIP_ISR_DMA       (0x1 << 0)
+#define FLIP_ISR_SHM       (0x1 << 1)      /* the server posted completions in BAR 3 */
+#define FLIP_DESC_SG       (0x1 << 4)
+#define FLIP_DESC_CRC      (0x1 << 5)
+#define FLIP_DESC_INPLACE  (0x1 << 6)
+#define FLIP_STS_OK        0x0
+#define FLIP_STS_PROGRESS  0x2             /* len bytes converted so far, revision 8 */
+
+#define FLIP_RING_SIZE 256                 /* descriptors per ring */
+
+#define FLIP_POOL_CHUNK  (2UL << 20)       /* pool memory comes in huge page sized chunks */
+#define FLIP_POOL_BUF    (64UL << 10)      /* requests up to this size use a pool buffer */
+#define FLIP_POOL_MAX_CHUNKS 16
+
+/* a pool buffer holds both sg tables of a pinned request */
+#define FLIP_SG_MAX      (FLIP_POOL_BUF / 2 / sizeof(struct flip_sge))
+#define FLIP_SG_MAX_LEN  ((FLIP_SG_MAX - 1) * PAGE_SIZE)
+
+struct flip_desc {
+	__le64 src;
+	__le64 dst;
+	__le32 len;
+	__le16 flags;
+	__le16 tag;
+	__le16 src_nsg;
+	__le16 dst_nsg;
+	__le16 cq;                   /* completion queue, the submitting cpu's */
+	__le16 progress;             /* KiB between progress completions, revision 8 */
+};
+
+/* server mode, see hw/flip-shm.h */
+#define FLIP_SHM_BAR       3
+#define FLIP_SHM_MAGIC     0x504c4946
+#define FLIP_SHM_MAX_BUFS  127
+
+struct flip_shm_ring {
+	__le32 magic;
+	__le32 version;
+	__le32 entries;
+	__le32 nbufs;
+	__le32 buf_size;
+	__le32 sq_off;
+	__le32 cq_off;
+	__le32 data_off;
+	__le32 slot;
+	__le32 rsvd[7];
+	__le32 sq_tail;              /* ours */
+	__le32 pad0[15];
+	__le32 sq_head;
+	__le32 pad1[15];
+	__le32 cq_tail;
+	__le32 pad2[15];
+	__le32 cq_head;              /* ours */
+	__le32 pad3[15];
+	__le64 descs;
+	__le64 bytes;
+	__le64 batches;
+	__le64 rsvd2[5];
+	u8 lut[FLIP_LUT_LEN];
+};
+
+struct flip_shm_desc {
+	__le32 buf;
+	__le32 len;
+	__le16 flags;
+	__le16 tag;
+	__le32 rsvd;
+};
+
+struct flip_sge {
+	__le64 addr;
+	__le32 len;
+	__le32 rsvd;
+};
+
+/* written by the device, read without an exit */
+struct flip_stats {
+	__le32 sq_head;
+	__le32 cq_tail;
+	__le32 state;
+	__le32 host_node;            /* host NUMA node + 1, 0 unknown, revision 11 */
+	__le64 fliped_nr;
+	__le64 full_nr;
+	__le64 irq_nr;
+	__le32 cqn_tail[FLIP_MAX_CQS];  /* revision 6 */
+};
+
+struct flip_compl {
+	__le16 tag;
+	__le16 status;
+	__le32 len;
+	__le32 crc;
+	__le32 rsvd;
+};
+
+/* pre-allocated, pre-mapped dma buffer */
+struct flip_buf {
+	struct flip_buf *next;       /* free list link */
+	void *vaddr;
+	dma_addr_t dma;
+};
+
+struct flip_pool {
+	spinlock_t lock;
+	struct flip_buf *free;       /* slab-like free list */
+	struct flip_buf *bufs;       /* all buffer headers */
+	int nr_bufs;
+	int nr_chunks;
+	void *chunk[FLIP_POOL_MAX_CHUNKS];
+	dma_addr_t chunk_dma[FLIP_POOL_MAX_CHUNKS];
+	wait_queue_head_t wq;        /* woken when a buffer is returned */
+};
+
+/* submission queue of one class */
+struct flip_sq {
+	struct flip_desc *ring;
+	dma_addr_t dma;
+	unsigned int tail;
+};
+
+/*
+ * completion queue of the cpus n, n + nr_cq, ...  With msi-x its vector
+ * is pointed at those cpus, so completions are reaped and readers woken
+ * where the requests were submitted.
+ */
+struct flip_cq {
+	struct flip_compl *ring;
+	dma_addr_t dma;
+	unsigned int head;
+	spinlock_t lock;             /* protects head and the counters */
+	wait_queue_head_t wq;        /* readers of requests completing here */
+	void __iomem *tail_reg, *head_reg;
+	int n;
+	int irq;                     /* msi-x vector, 0 on the shared line */
+	struct cpumask mask;         /* affinity hint */
+	u64 local_nr;                /* reaped on the submitting cpu */
+	u64 remote_nr;               /* reaped elsewhere */
+};
+
+/* tags are global, every submission queue can complete on every completion queue */
+struct flip_ring {
+	struct flip_sq sq[FLIP_NR_CLASSES];
+	int nr_sq;                   /* classes past this use queue 0 */
+	struct flip_cq cq[FLIP_MAX_CQS];
+	int nr_cq;
+	int poll_cq;                 /* queue after them without interrupt, -1 for none */
+	int msix;                    /* the queues have vectors of their own */
+	spinlock_t lock;
+	struct flip_req *reqs[FLIP_RING_SIZE];  /* in flight, indexed by tag */
+	unsigned int nr_inflight;
+	unsigned int next_tag;
+};
+
+/*
+ * server mode: rings and data live in BAR 3, a slot of the memory the
+ * host's flip_server shares with every VM.  A data buffer per tag, its
+ * index is the tag.
+ */
+struct flip_shm {
+	struct flip_shm_ring *r;     /* NULL unless in server mode */
+	void __iomem *base;
+	struct flip_shm_desc *sq;
+	struct flip_compl *cq;       /* same layout as the device's */
+	u8 *data;
+	unsigned int entries, nbufs, buf_size;
+	unsigned int sq_tail, cq_head;
+	spinlock_t lock;             /* protects the indices and reqs */
+	unsigned long busy[BITS_TO_LONGS(FLIP_SHM_MAX_BUFS)];
+	struct flip_req *reqs[FLIP_SHM_MAX_BUFS];
+};
+
+/* one write() worth of data on the bus-master path */
+struct flip_req {
+	struct list_head list;       /* per-file submission order */
+	atomic_t ref;
+	int done;                    /* set once the output is valid */
+	int status;
+	size_t len;                  /* bytes submitted */
+	size_t out_len;              /* bytes produced */
+	size_t avail;                /* converted so far, from progress completions */
+	size_t rd_off;               /* bytes already returned by read() */
+	u32 crc;                     /* crc32c of the output, if the file asked for it */
+	void *data;                  /* output of the pool and cpu paths */
+	struct flip_buf *buf;        /* pool buffer: the data, or the sg tables */
+	int shm_buf;                 /* server mode data buffer + 1, 0 for none */
+	int cpu;                     /* submitted on */
+	wait_queue_head_t *wq;       /* of its completion queue, read_wq if none */
+	s64 start_ns;                /* handed to the device */
+	s64 lat_ns;                  /* until its completion was reaped */
+	s64 done_ns;                 /* when that was */
+	struct io_uring_cmd *ucmd;   /* io_uring command converting user pages in place */
+	int polled;                  /* completes on the polled queue */
+
+	/* pinned user pages in, freshly allocated pages out */
+	struct page **src_pages;
+	int nr_src;
+	struct sg_table src_sgt;
+	int src_nents;
+	struct page **dst_pages;
+	int nr_dst;
+	struct sg_table dst_sgt;
+	int dst_nents;
+};
+
+/* per open file */
+struct flip_file {
+	struct flip_char *dev;
+	struct list_head reqs;       /* flip_req in submission order */
+	spinlock_t lock;             /* protects reqs */
+	struct mutex rd_mutex;       /* serializes readers */
+	int crc;                     /* FLIP_CMD_CRC: checksum every request */
+	int class;                   /* FLIP_CMD_CLASS: submission queue */
+	unsigned int progress;       /* FLIP_CMD_PROGRESS: KiB between progress completions */
+	unsigned int busy_poll;      /* FLIP_CMD_BUSY_POLL: us to spin in read() before sleeping */
+	s64 lat_ewma;                /* device latency of its requests, ns, under rd_mutex */
+	u32 last_crc;                /* crc of the last request fully read */
+};
+
+static unsigned int pool_chunks = 4;
+module_param(pool_chunks, uint, 0444);
+MODULE_PARM_DESC(pool_chunks, "huge page sized chunks in the dma buffer pool");
+
+static unsigned int busy_poll;
+module_param(busy_poll, uint, 0644);
+MODULE_PARM_DESC(busy_poll, "us read() spins for a completion before sleeping, default of new files");
+
+#define FLIP_FIFO_OUT_LEN  (1 << 20)       /* port output waiting for read(), power of 2 */
+#define FLIP_PORT_BURST    1024            /* words per rep insl, a page */
+
+/* per-cpu counters and latency histograms, in debugfs */
+struct flip_pcpu {
+	u64 submits;
+	u64 irqs;
+	u64 completions;
+	u64 read_wakes;
+	u64 fifo_drops;
+	u64 compl_lat[FLIP_HIST_BUCKETS];  /* submit to complete */
+	u64 wake_lat[FLIP_HIST_BUCKETS];   /* completion reaped to read() awake */
+};
+
+struct flip_char {
+
+	struct kfifo fifo_out;       /* port output, filled by the irq handler and the cpu path */
+	void *fifo_buf;              /* its FLIP_FIFO_OUT_LEN bytes */
+	spinlock_t fifo_lock;        /* serializes the two producers and the reader */
+	u32 port_buf[FLIP_PORT_BURST];  /* irq handler bounce buffer */
+	struct cdev cdev;
+
+	int conf;                    /* shadow of FLIP_REG_CONF for the cpu path */
+	unsigned int cpu_threshold;  /* cpu path size threshold, tunable in sysfs */
+	atomic_t inflight;           /* words written to the device, not yet read */
+	wait_queue_head_t drain_wq;  /* woken when a word comes back from the device */
+
+	/* per-path counters, exported in sysfs */
+	atomic64_t cpu_reqs;
+	atomic64_t cpu_bytes;
+	atomic64_t dev_reqs;
+	atomic64_t dev_bytes;
+	atomic64_t full_reqs;
+
+	/* bus-master path, only with a revision 2 device */
+	struct pci_dev *pdev;
+	void __iomem *mmio;
+	struct flip_pool pool;
+	struct flip_ring ring;
+	wait_queue_head_t read_wq;   /* woken on completions outside the ring, and ring room */
+	struct flip_stats *stats;    /* device stats page */
+	dma_addr_t stats_dma;
+	struct dentry *debugfs;
+	struct flip_shm shm;         /* server mode, revision 5 */
+
+	/* setup cost of the bus-master paths, exported in sysfs */
+	atomic64_t pool_reqs;
+	atomic64_t pool_setup_ns;
+	atomic64_t sg_reqs;
+	atomic64_t sg_setup_ns;
+
+	struct flip_pcpu __percpu *pcpu;
+
+	/* read() busy-polling, exported in sysfs */
+	atomic64_t busy_hits;        /* the completion came while spinning */
+	atomic64_t busy_misses;      /* spun and slept anyway */
+
+	/* FLIP_CONF_LUT table, the cpu path converts with this copy */
+	u8 lut[FLIP_LUT_LEN];
+	struct mutex lut_mutex;      /* keeps lut and the device copy in step */
+	struct mutex port_mutex;     /* one port writer between the room check and outsl */
+};
+
+struct flip_char *flip_char_dev;
+
+static struct pci_device_id ids[] = {
+	{PCI_DEVICE(PCI_VENDOR_ID_REDHAT_QUMRANET, PCI_FLIP_DEVICE_ID),},
+	{0,},
+};
+
+u64 ioport;
+u32 io_len;
+int flip_char_major = 0;
+int flip_char_minor = 1;
+
+/*
+ * queue port output for read(), dropping the zeros that pad the last
+ * word of a write.  Compacts buf in place.
+ */
+static void flip_fifo_put(struct flip_char *dev, u8 *buf, unsigned int len)
+{
+	unsigned int i, n;
+
+	for (i = n = 0; i < len; i++)
+		if (buf[i])
+			buf[n++] = buf[i];
+
+	i = kfifo_in_spinlocked(&dev->fifo_out, buf, n, &dev->fifo_lock);
+	if (i < n) {
+		this_cpu_inc(dev->pcpu->fifo_drops);
+		trace_flip_fifo_overflow(n, n - i);
+	}
+}
+
+static int flip_hist_bucket(s64 ns)
+{
+	return ns <= 1 ? 0 : min_t(int, ilog2(ns), FLIP_HIST_BUCKETS - 1);
+}
+
+/* dma buffer pool */
+
+static int flip_pool_init(struct flip_pool *pool, struct device *dev)
+{
+	int per_chunk = FLIP_POOL_CHUNK / FLIP_POOL_BUF;
+	int want = min_t(int, pool_chunks, FLIP_POOL_MAX_CHUNKS);
+	struct flip_buf *b;
+	int i, j;
+
+	spin_lock_init(&pool->lock);
+	init_waitqueue_head(&pool->wq);
+
+	pool->bufs = kcalloc(want * per_chunk, sizeof(*b), GFP_KERNEL);
+	if (!pool->bufs)
+		return -ENOMEM;
+
+	/* carve each coherent chunk into buffers, a failed chunk just shrinks the pool */
+	for (i = 0; i < want; i++) {
+		pool->chunk[i] = dma_alloc_coherent(dev, FLIP_POOL_CHUNK, &pool->chunk_dma[i],
+						    GFP_KERNEL | __GFP_NOWARN);
+		if (!pool->chunk[i])
+			break;
+
+		for (j = 0; j < per_chunk; j++) {
+			b = &pool->bufs[pool->nr_bufs++];
+			b->vaddr = (char *)pool->chunk[i] + j * FLIP_POOL_BUF;
+			b->dma = pool->chunk_dma[i] + j * FLIP_POOL_BUF;
+			b->next = pool->free;
+			pool->free = b;
+		}
+	}
+	pool->nr_chunks = i;
+
+	if (!pool->nr_chunks) {
+		kfree(pool->bufs);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void flip_pool_destroy(struct flip_pool *pool, struct device *dev)
+{
+	int i;
+
+	for (i = 0; i < pool->nr_chunks; i++)
+		dma_free_coherent(dev, FLIP_POOL_CHUNK, pool->chunk[i], pool->chunk_dma[i]);
+	kfree(pool->bufs);
+	memset(pool, 0, sizeof(*pool));
+}
+
+static struct flip_buf *flip_pool_try_get(struct flip_pool *pool)
+{
+	struct flip_buf *b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	b = pool->free;
+	if (b)
+		pool->free = b->next;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	return b;
+}
+
+/* sleeps until a buffer is free, NULL on a signal */
+static struct flip_buf *flip_pool_get(struct flip_pool *pool)
+{
+	struct flip_buf *b;
+
+	while (!(b = flip_pool_try_get(pool))) {
+		if (wait_event_interruptible(pool->wq, pool->free != NULL))
+			return NULL;
+	}
+
+	return b;
+}
+
+static void flip_pool_put(struct flip_pool *pool, struct flip_buf *b)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	b->next = pool->free;
+	pool->free = b;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	wake_up(&pool->wq);
+}
+
+/* requests */
+
+static struct flip_req *flip_req_alloc(void)
+{
+	struct flip_req *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	INIT_LIST_HEAD(&req->list);
+	atomic_set(&req->ref, 1);
+
+	return req;
+}
+
+/* drop the source side of a pinned request, the device is done with it */
+static void flip_req_unmap(struct flip_char *dev, struct flip_req *req)
+{
+	int i;
+
+	if (req->src_nents) {
+		dma_unmap_sg(&dev->pdev->dev, req->src_sgt.sgl, req->nr_src,
+			     req->ucmd ? DMA_BIDIRECTIONAL : DMA_TO_DEVICE);
+		req->src_nents = 0;
+	}
+	if (req->dst_nents) {
+		dma_unmap_sg(&dev->pdev->dev, req->dst_sgt.sgl, req->nr_dst, DMA_FROM_DEVICE);
+		req->dst_nents = 0;
+	}
+	/* written pages are dirtied in task context, see flip_req_unpin() */
+	if (req->src_pages && !req->ucmd) {
+		for (i = 0; i < req->nr_src; i++)
+			put_page(req->src_pages[i]);
+		sg_free_table(&req->src_sgt);
+		kfree(req->src_pages);
+		req->src_pages = NULL;
+	}
+}
+
+/* release the user pages of an io_uring command, the device wrote them */
+static void flip_req_unpin(struct flip_req *req)
+{
+	int i;
+
+	if (!req->src_pages)
+		return;
+
+	for (i = 0; i < req->nr_src; i++) {
+		set_page_dirty_lock(req->src_pages[i]);
+		put_page(req->src_pages[i]);
+	}
+	sg_free_table(&req->src_sgt);
+	kfree(req->src_pages);
+	req->src_pages = NULL;
+}
+
+static void flip_shm_put(struct flip_char *dev, int buf);
+
+/* called from irq context as well, except for io_uring commands */
+static void flip_req_put(struct flip_char *dev, struct flip_req *req)
+{
+	int i;
+
+	if (!atomic_dec_and_test(&req->ref))
+		return;
+
+	flip_req_unmap(dev, req);
+	flip_req_unpin(req);
+
+	if (req->dst_pages) {
+		for (i = 0; i < req->nr_dst; i++)
+			if (req->dst_pages[i])
+				__free_page(req->dst_pages[i]);
+		sg_free_table(&req->dst_sgt);
+		kfree(req->dst_pages);
+	}
+
+	if (req->buf)
+		flip_pool_put(&dev->pool, req->buf);
+	else if (req->shm_buf)
+		flip_shm_put(dev, req->shm_buf - 1);
+	else
+		kfree(req->data);
+
+	kfree(req);
+}
+
+/* device state, from the stats page when there is one */
+static u8 flip_state(struct flip_char *dev)
+{
+	if (dev->stats)
+		return le32_to_cpu(READ_ONCE(dev->stats->state));
+
+	return inb(ioport + FLIP_REG_STATE);
+}
+
+/*
+ * port interface, in whole words: what the input fifo can take and
+ * what the output fifo holds.  Before revision 7 both are one word.
+ */
+static unsigned int flip_port_room(struct flip_char *dev)
+{
+	if (dev->pdev->revision < 7)
+		return flip_state(dev) & FLIP_IN_EMPTY ? FLIP_REG_LEN : 0;
+
+	return inw(ioport + FLIP_REG_ROOM) & ~(FLIP_REG_LEN - 1);
+}
+
+static unsigned int flip_port_avail(struct flip_char *dev)
+{
+	if (dev->pdev->revision < 7)
+		return flip_state(dev) & FLIP_OUT_EMPTY ? 0 : FLIP_REG_LEN;
+
+	return inw(ioport + FLIP_REG_AVAIL) & ~(FLIP_REG_LEN - 1);
+}
+
+/*
+ * take what the port converted, a rep insl per page.  The line stays
+ * up while the output fifo holds data, so drain it even when fifo_out
+ * is full.  Only the irq handler calls this, port_buf is its own.
+ */
+static void flip_port_drain(struct flip_char *dev)
+{
+	unsigned int words, got = 0;
+
+	while ((words = flip_port_avail(dev) / FLIP_REG_LEN)) {
+		words = min_t(unsigned int, words, FLIP_PORT_BURST);
+		insl(ioport + FLIP_REG_OUT, dev->port_buf, words);
+		flip_fifo_put(dev, (u8 *)dev->port_buf, words * FLIP_REG_LEN);
+		got += words;
+	}
+
+	if (!got)
+		return;
+
+	/* poll() on the port path */
+	wake_up(&dev->read_wq);
+	if (atomic_sub_return(got, &dev->inflight) <= 0) {
+		atomic_set(&dev->inflight, 0);
+		wake_up(&dev->drain_wq);
+	}
+}
+
+/* completions the device has posted; entries below it are valid after this */
+static unsigned int flip_cq_tail(struct flip_char *dev, struct flip_cq *cq)
+{
+	unsigned int tail;
+
+	if (!dev->stats)
+		return readl(cq->tail_reg);
+
+	if (cq->n)
+		tail = le32_to_cpu(READ_ONCE(dev->stats->cqn_tail[cq->n]));
+	else
+		tail = le32_to_cpu(READ_ONCE(dev->stats->cq_tail));
+	rmb();
+
+	return tail;
+}
+
+/* requests wait for completion on their queue's wq */
+static wait_queue_head_t *flip_req_wq(struct flip_char *dev, struct flip_req *req)
+{
+	return req->wq ? req->wq : &dev->read_wq;
+}
+
+/* descriptor ring */
+
+static void flip_ring_free(struct flip_char *dev)
+{
+	struct flip_ring *ring = &dev->ring;
+	int i;
+
+	for (i = 0; i < ring->nr_sq; i++)
+		if (ring->sq[i].ring)
+			dma_free_coherent(&dev->pdev->dev, FLIP_RING_SIZE * sizeof(struct flip_desc),
+					  ring->sq[i].ring, ring->sq[i].dma);
+	for (i = 0; i < ring->nr_cq + (ring->poll_cq >= 0); i++)
+		if (ring->cq[i].ring)
+			dma_free_coherent(&dev->pdev->dev, FLIP_RING_SIZE * sizeof(struct flip_compl),
+					  ring->cq[i].ring, ring->cq[i].dma);
+}
+
+/*
+ * one completion queue per cpu as far as the device and the vectors
+ * go, cpus beyond share them round robin.  Without msi-x a single one,
+ * the handler runs wherever the line is routed anyway.  With poll one
+ * more that never interrupts, for io_uring commands reaped by iopoll.
+ */
+static int flip_ring_init_cq(struct flip_char *dev, int nr_cq, int poll)
+{
+	struct flip_ring *ring = &dev->ring;
+	struct flip_cq *cq;
+	void __iomem *q;
+	int i;
+
+	ring->nr_cq = nr_cq;
+	ring->poll_cq = poll ? nr_cq : -1;
+	for (i = 0; i < nr_cq + !!poll; i++) {
+		cq = &ring->cq[i];
+		cq->n = i;
+		spin_lock_init(&cq->lock);
+		init_waitqueue_head(&cq->wq);
+		cq->ring = dma_alloc_coherent(&dev->pdev->dev,
+					      FLIP_RING_SIZE * sizeof(struct flip_compl),
+					      &cq->dma, GFP_KERNEL);
+		if (!cq->ring)
+			return -ENOMEM;
+
+		if (i) {
+			q = dev->mmio + FLIP_DMA_CQ + i * FLIP_DMA_CQ_SIZE;
+			writel(lower_32_bits(cq->dma), q + FLIP_CQ_BASE);
+			writel(upper_32_bits(cq->dma), q + FLIP_CQ_BASE + 4);
+			cq->tail_reg = q + FLIP_CQ_TAIL;
+			cq->head_reg = q + FLIP_CQ_HEAD;
+			if (dev->pdev->revision >= 9)
+				writel(i == ring->poll_cq ? FLIP_CQ_POLLED : 0, q + FLIP_CQ_FLAGS);
+		} else {
+			writel(lower_32_bits(cq->dma), dev->mmio + FLIP_DMA_CQ_BASE);
+			writel(upper_32_bits(cq->dma), dev->mmio + FLIP_DMA_CQ_BASE + 4);
+			cq->tail_reg = dev->mmio + FLIP_DMA_CQ_TAIL;
+			cq->head_reg = dev->mmio + FLIP_DMA_CQ_HEAD;
+		}
+	}
+
+	return 0;
+}
+
+static int flip_ring_init(struct flip_char *dev, int nr_cq, int poll)
+{
+	struct flip_ring *ring = &dev->ring;
+	struct device *d = &dev->pdev->dev;
+	void __iomem *q;
+	int i;
+
+	memset(ring, 0, sizeof(*ring));
+	spin_lock_init(&ring->lock);
+	ring->poll_cq = -1;
+
+	/* one queue per class as far as the device has them */
+	ring->nr_sq = clamp_t(int, readl(dev->mmio + FLIP_DMA_QUEUES), 1, FLIP_NR_CLASSES);
+
+	for (i = 0; i < ring->nr_sq; i++) {
+		ring->sq[i].ring = dma_alloc_coherent(d, FLIP_RING_SIZE * sizeof(struct flip_desc),
+						      &ring->sq[i].dma, GFP_KERNEL);
+		if (!ring->sq[i].ring) {
+			flip_ring_free(dev);
+			return -ENOMEM;
+		}
+	}
+
+	if (flip_ring_init_cq(dev, nr_cq, poll) < 0) {
+		flip_ring_free(dev);
+		return -ENOMEM;
+	}
+
+	writel(FLIP_RING_SIZE, dev->mmio + FLIP_DMA_RING_SIZE);
+	writel(lower_32_bits(ring->sq[0].dma), dev->mmio + FLIP_DMA_SQ_BASE);
+	writel(upper_32_bits(ring->sq[0].dma), dev->mmio + FLIP_DMA_SQ_BASE + 4);
+	for (i = 1; i < ring->nr_sq; i++) {
+		q = dev->mmio + FLIP_DMA_QUEUE + i * FLIP_DMA_QUEUE_SIZE;
+		writel(lower_32_bits(ring->sq[i].dma), q + FLIP_SQ_BASE);
+		writel(upper_32_bits(ring->sq[i].dma), q + FLIP_SQ_BASE + 4);
+		if (i == FLIP_CLASS_LATENCY)
+			writel(FLIP_PRIO_HIGH, q + FLIP_SQ_PRIO);
+	}
+	writel(FLIP_CTRL_ENABLE, dev->mmio + FLIP_DMA_CTRL);
+
+	return 0;
+}
+
+static void flip_ring_destroy(struct flip_char *dev)
+{
+	writel(0, dev->mmio + FLIP_DMA_CTRL);
+	flip_ring_free(dev);
+}
+
+/*
+ * the device converted the first off bytes of a request that is still
+ * running: make them visible to the cpu and to readers
+ */
+static void flip_req_progress(struct flip_char *dev, struct flip_req *req, size_t off)
+{
+	struct scatterlist *sg;
+	size_t pos = 0, len;
+	int i;
+
+	if (off <= req->avail || off > req->len || !req->dst_pages)
+		return;
+
+	for_each_sg(req->dst_sgt.sgl, sg, req->dst_nents, i) {
+		len = sg_dma_len(sg);
+		if (pos + len > req->avail)
+			dma_sync_single_for_cpu(&dev->pdev->dev, sg_dma_address(sg), len,
+						DMA_FROM_DEVICE);
+		pos += len;
+		if (pos >= off)
+			break;
+	}
+
+	smp_wmb();
+	req->avail = off;
+}
+
+#ifdef FLIP_URING
+struct flip_uring_pdu {
+	struct flip_req *req;
+};
+
+static struct flip_uring_pdu *flip_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	return (struct flip_uring_pdu *)ioucmd->pdu;
+}
+
+/* post the cqe of a finished command, in task context */
+static void flip_uring_done(struct flip_req *req, unsigned int issue_flags)
+{
+	struct io_uring_cmd *ioucmd = req->ucmd;
+	ssize_t ret = req->status == FLIP_STS_OK ? req->out_len : -EIO;
+	u32 crc = req->crc;
+
+	/* the pages are dirty before userspace hears about it */
+	flip_req_unpin(req);
+	/* the ring's reference */
+	flip_req_put(flip_char_dev, req);
+
+	io_uring_cmd_done(ioucmd, ret, crc, issue_flags);
+}
+
+static void flip_uring_task_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	flip_uring_done(flip_uring_pdu(ioucmd)->req, issue_flags);
+}
+
+/*
+ * commands flip_cq_complete reaped.  iopoll runs in the task that owns
+ * the ring, anything else hands over to it.
+ */
+static void flip_uring_complete(struct list_head *done)
+{
+	struct flip_req *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, done, list) {
+		list_del_init(&req->list);
+		if (in_task() && (req->ucmd->flags & IORING_URING_CMD_POLLED))
+			flip_uring_done(req, IO_URING_F_UNLOCKED);
+		else
+			io_uring_cmd_complete_in_task(req->ucmd, flip_uring_task_done);
+	}
+}
+#else
+static void flip_uring_complete(struct list_head *done)
+{
+}
+#endif
+
+/* reap completions, matched to requests by tag, returns the entries consumed */
+static int flip_cq_complete(struct flip_char *dev, struct flip_cq *cq)
+{
+	struct flip_ring *ring = &dev->ring;
+	struct flip_compl *c;
+	struct flip_req *req;
+	unsigned long flags;
+	unsigned int tail, tag;
+	int cpu = raw_smp_processor_id();    /* for the counters, iopoll is preemptible */
+	int n = 0;
+	LIST_HEAD(uring);
+
+	spin_lock_irqsave(&cq->lock, flags);
+
+	tail = flip_cq_tail(dev, cq);
+	while (cq->head != tail) {
+		c = &cq->ring[cq->head];
+		tag = le16_to_cpu(c->tag) % FLIP_RING_SIZE;
+
+		/* the request keeps its tag, the final completion comes later on this queue */
+		if (le16_to_cpu(c->status) == FLIP_STS_PROGRESS) {
+			spin_lock(&ring->lock);
+			req = ring->reqs[tag];
+			spin_unlock(&ring->lock);
+			trace_flip_complete(tag, cq->n, FLIP_STS_PROGRESS, le32_to_cpu(c->len), 0);
+			if (req)
+				flip_req_progress(dev, req, le32_to_cpu(c->len));
+			cq->head = (cq->head + 1) & (FLIP_RING_SIZE - 1);
+			n++;
+			continue;
+		}
+
+		spin_lock(&ring->lock);
+		req = ring->reqs[tag];
+		ring->reqs[tag] = NULL;
+		if (req)
+			ring->nr_inflight--;
+		spin_unlock(&ring->lock);
+
+		if (req) {
+			if (req->cpu == cpu)
+				cq->local_nr++;
+			else
+				cq->remote_nr++;
+			flip_req_unmap(dev, req);
+			req->status = le16_to_cpu(c->status);
+			/* a failed request still has what progress reported */
+			req->out_len = req->status == FLIP_STS_OK ? le32_to_cpu(c->len) : req->avail;
+			req->crc = le32_to_cpu(c->crc);
+			req->done_ns = ktime_to_ns(ktime_get());
+			req->lat_ns = max_t(s64, req->done_ns - req->start_ns, 1);
+			this_cpu_inc(dev->pcpu->completions);
+			this_cpu_inc(dev->pcpu->compl_lat[flip_hist_bucket(req->lat_ns)]);
+			trace_flip_complete(tag, cq->n, req->status, req->out_len, req->lat_ns);
+			smp_wmb();
+			req->done = 1;
+			/* io_uring commands are on no file's list */
+			if (req->ucmd)
+				list_add_tail(&req->list, &uring);
+			else
+				/* the ring's reference */
+				flip_req_put(dev, req);
+		}
+
+		cq->head = (cq->head + 1) & (FLIP_RING_SIZE - 1);
+		n++;
+	}
+
+	if (n)
+		writel(cq->head, cq->head_reg);
+
+	spin_unlock_irqrestore(&cq->lock, flags);
+
+	if (!n)
+		return 0;
+
+	flip_uring_complete(&uring);
+
+	wake_up_all(&cq->wq);
+	/* writers waiting for a free tag, rare enough to check first */
+	smp_mb();
+	if (waitqueue_active(&dev->read_wq))
+		wake_up_all(&dev->read_wq);
+
+	return n;
+}
+
+static int flip_ring_complete(struct flip_char *dev)
+{
+	int i, n = 0;
+
+	for (i = 0; i < dev->ring.nr_cq; i++)
+		n += flip_cq_complete(dev, &dev->ring.cq[i]);
+
+	return n;
+}
+
+/* server mode */
+
+static int flip_shm_init(struct flip_char *dev, struct pci_dev *pdev)
+{
+	struct flip_shm *shm = &dev->shm;
+	resource_size_t len = pci_resource_len(pdev, FLIP_SHM_BAR);
+	struct flip_shm_ring *r;
+	u32 sq_off, cq_off, data_off;
+
+	if (!len || pdev->revision < 5)
+		return -ENODEV;
+
+	/* plain memory on the host side, map it cached */
+	shm->base = ioremap_cache(pci_resource_start(pdev, FLIP_SHM_BAR), len);
+	if (!shm->base)
+		return -ENOMEM;
+	r = (struct flip_shm_ring __force *)shm->base;
+
+	shm->entries = le32_to_cpu(r->entries);
+	shm->nbufs = le32_to_cpu(r->nbufs);
+	shm->buf_size = le32_to_cpu(r->buf_size);
+	sq_off = le32_to_cpu(r->sq_off);
+	cq_off = le32_to_cpu(r->cq_off);
+	data_off = le32_to_cpu(r->data_off);
+
+	if (le32_to_cpu(r->magic) != FLIP_SHM_MAGIC || !is_power_of_2(shm->entries)
+	    || !shm->nbufs || shm->nbufs >= shm->entries || shm->nbufs > FLIP_SHM_MAX_BUFS
+	    || sq_off < sizeof(*r) || cq_off < sq_off + shm->entries * sizeof(struct flip_shm_desc)
+	    || data_off < cq_off + shm->entries * sizeof(struct flip_compl)
+	    || data_off + (u64)shm->nbufs * shm->buf_size > len) {
+		iounmap(shm->base);
+		return -EIO;
+	}
+
+	shm->sq = (void *)r + sq_off;
+	shm->cq = (void *)r + cq_off;
+	shm->data = (u8 *)r + data_off;
+	spin_lock_init(&shm->lock);
+
+	/* go on from the indices the device left at reset */
+	shm->sq_tail = le32_to_cpu(READ_ONCE(r->sq_tail)) & (shm->entries - 1);
+	shm->cq_head = le32_to_cpu(READ_ONCE(r->cq_head)) & (shm->entries - 1);
+	memcpy(r->lut, dev->lut, FLIP_LUT_LEN);
+	shm->r = r;
+
+	return 0;
+}
+
+static void flip_shm_destroy(struct flip_char *dev)
+{
+	if (!dev->shm.r)
+		return;
+
+	dev->shm.r = NULL;
+	iounmap(dev->shm.base);
+}
+
+/* a free data buffer, -1 when all are in flight */
+static int flip_shm_get(struct flip_shm *shm)
+{
+	int buf;
+
+	do {
+		buf = find_first_zero_bit(shm->busy, shm->nbufs);
+		if (buf >= shm->nbufs)
+			return -1;
+	} while (test_and_set_bit(buf, shm->busy));
+
+	return buf;
+}
+
+static void flip_shm_put(struct flip_char *dev, int buf)
+{
+	clear_bit(buf, dev->shm.busy);
+	wake_up_all(&dev->read_wq);
+}
+
+/* reap what the server posted, the tag is the data buffer */
+static void flip_shm_complete(struct flip_char *dev)
+{
+	struct flip_shm *shm = &dev->shm;
+	struct flip_compl *c;
+	struct flip_req *req;
+	unsigned long flags;
+	unsigned int tail, buf;
+	int n = 0;
+
+	spin_lock_irqsave(&shm->lock, flags);
+
+	tail = le32_to_cpu(READ_ONCE(shm->r->cq_tail)) & (shm->entries - 1);
+	rmb();
+	while (shm->cq_head != tail) {
+		c = &shm->cq[shm->cq_head];
+		buf = le16_to_cpu(c->tag);
+
+		req = buf < shm->nbufs ? shm->reqs[buf] : NULL;
+		if (req) {
+			shm->reqs[buf] = NULL;
+			req->status = le16_to_cpu(c->status);
+			req->out_len = req->status == FLIP_STS_OK ? le32_to_cpu(c->len) : 0;
+			req->crc = le32_to_cpu(c->crc);
+			smp_wmb();
+			req->done = 1;
+			/* the server's reference */
+			flip_req_put(dev, req);
+		}
+
+		shm->cq_head = (shm->cq_head + 1) & (shm->entries - 1);
+		n++;
+	}
+
+	if (n) {
+		/* done with the entries before the server reuses them */
+		mb();
+		WRITE_ONCE(shm->r->cq_head, cpu_to_le32(shm->cq_head));
+	}
+
+	spin_unlock_irqrestore(&shm->lock, flags);
+
+	if (n)
+		wake_up_all(&dev->read_wq);
+}
+
+static irqreturn_t flip_handler(int irq, void *dev_id)
+{
+	u16 device_id;
+	u16 vendor_id;
+	struct pci_dev *dev;
+	u32 in, isr;
+
+
+	dev = (struct pci_dev *)dev_id;
+	pci_read_config_word(dev, PCI_DEVICE_ID, &device_id);
+
+	pci_read_config_word(dev, PCI_VENDOR_ID, &vendor_id);
+
+	if (!(vendor_id == PCI_VENDOR_ID_REDHAT_QUMRANET && device_id == PCI_FLIP_DEVICE_ID))
+		return IRQ_NONE;
+
+	this_cpu_inc(flip_char_dev->pcpu->irqs);
+	trace_flip_irq(irq, 0);
+
+	/*
+	 * bus-master completions share the line with the port interface.
+	 * With the stats page the device drops the line once cq_head
+	 * catches up, so there is no isr to read, except for the server's.
+	 */
+	isr = 0;
+	if (flip_char_dev->mmio && (flip_char_dev->shm.r || !flip_char_dev->stats))
+		isr = readl(flip_char_dev->mmio + FLIP_DMA_ISR);
+	/* with msi-x this is vector 0, the other queues have their own */
+	if (flip_char_dev->ring.msix)
+		flip_cq_complete(flip_char_dev, &flip_char_dev->ring.cq[0]);
+	else if (flip_char_dev->stats || (isr & FLIP_ISR_DMA))
+		flip_ring_complete(flip_char_dev);
+	if (isr & FLIP_ISR_SHM)
+		flip_shm_complete(flip_char_dev);
+
+	in = flip_state(flip_char_dev);
+	if ( in & FLIP_OUT_EMPTY)
+		return IRQ_HANDLED;
+
+	flip_port_drain(flip_char_dev);
+
+	return IRQ_HANDLED;
+}
+
+/* sysfs: cpu path threshold and per-path counters */
+
+static ssize_t cpu_threshold_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", flip_char_dev->cpu_threshold);
+}
+
+static ssize_t cpu_threshold_store(struct device *d, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 0, &val))
+		return -EINVAL;
+
+	flip_char_dev->cpu_threshold = val;
+
+	return count;
+}
+
+static DEVICE_ATTR(cpu_threshold, 0644, cpu_threshold_show, cpu_threshold_store);
+
+#define FLIP_COUNTER_ATTR(name)							\
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf) \
+{										\
+	return sprintf(buf, "%lld\n",						\
+		       (long long)atomic64_read(&flip_char_dev->name));	\
+}										\
+static DEVICE_ATTR(name, 0444, name##_show, NULL)
+
+FLIP_COUNTER_ATTR(cpu_reqs);
+FLIP_COUNTER_ATTR(cpu_bytes);
+FLIP_COUNTER_ATTR(dev_reqs);
+FLIP_COUNTER_ATTR(dev_bytes);
+FLIP_COUNTER_ATTR(full_reqs);
+FLIP_COUNTER_ATTR(pool_reqs);
+FLIP_COUNTER_ATTR(pool_setup_ns);
+FLIP_COUNTER_ATTR(sg_reqs);
+FLIP_COUNTER_ATTR(sg_setup_ns);
+FLIP_COUNTER_ATTR(busy_hits);
+FLIP_COUNTER_ATTR(busy_misses);
+
+/* completions reaped on the cpu that submitted them, and elsewhere */
+static ssize_t flip_compl_show(char *buf, int remote)
+{
+	struct flip_ring *ring = &flip_char_dev->ring;
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < ring->nr_cq; i++)
+		sum += remote ? READ_ONCE(ring->cq[i].remote_nr) : READ_ONCE(ring->cq[i].local_nr);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)sum);
+}
+
+static ssize_t local_compl_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return flip_compl_show(buf, 0);
+}
+static DEVICE_ATTR(local_compl, 0444, local_compl_show, NULL);
+
+static ssize_t remote_compl_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return flip_compl_show(buf, 1);
+}
+static DEVICE_ATTR(remote_compl, 0444, remote_compl_show, NULL);
+
+static struct attribute *flip_attrs[] = {
+	&dev_attr_cpu_threshold.attr,
+	&dev_attr_cpu_reqs.attr,
+	&dev_attr_cpu_bytes.attr,
+	&dev_attr_dev_reqs.attr,
+	&dev_attr_dev_bytes.attr,
+	&dev_attr_full_reqs.attr,
+	&dev_attr_pool_reqs.attr,
+	&dev_attr_pool_setup_ns.attr,
+	&dev_attr_sg_reqs.attr,
+	&dev_attr_sg_setup_ns.attr,
+	&dev_attr_busy_hits.attr,
+	&dev_attr_busy_misses.attr,
+	&dev_attr_local_compl.attr,
+	&dev_attr_remote_compl.attr,
+	NULL,
+};
+
+static struct attribute_group flip_attr_group = {
+	.attrs = flip_attrs,
+};
+
+/* stats page: the device keeps it current, nothing here touches the device */
+
+static int flip_stats_init(struct flip_char *dev)
+{
+	dev->stats = dma_alloc_coherent(&dev->pdev->dev, PAGE_SIZE, &dev->stats_dma,
+					GFP_KERNEL | __GFP_ZERO);
+	if (!dev->stats)
+		return -ENOMEM;
+
+	writel(lower_32_bits(dev->stats_dma), dev->mmio + FLIP_DMA_STATS);
+	writel(upper_32_bits(dev->stats_dma), dev->mmio + FLIP_DMA_STATS + 4);
+
+	return 0;
+}
+
+static void flip_stats_destroy(struct flip_char *dev)
+{
+	struct flip_stats *stats = dev->stats;
+
+	if (!stats)
+		return;
+
+	dev->stats = NULL;
+	writel(0, dev->mmio + FLIP_DMA_STATS);
+	writel(0, dev->mmio + FLIP_DMA_STATS + 4);
+	dma_free_coherent(&dev->pdev->dev, PAGE_SIZE, stats, dev->stats_dma);
+}
+
+static int flip_debugfs_stats_show(struct seq_file *m, void *v)
+{
+	struct flip_char *dev = m->private;
+	struct flip_stats *st = dev->stats;
+	int i;
+
+	if (st) {
+		seq_printf(m, "sq_head:    %u\n", le32_to_cpu(READ_ONCE(st->sq_head)));
+		seq_printf(m, "cq_tail:    %u\n", le32_to_cpu(READ_ONCE(st->cq_tail)));
+		seq_printf(m, "state:      0x%x\n", le32_to_cpu(READ_ONCE(st->state)));
+		seq_printf(m, "fliped_nr:  %llu\n", (unsigned long long)le64_to_cpu(READ_ONCE(st->fliped_nr)));
+		seq_printf(m, "full_nr:    %llu\n", (unsigned long long)le64_to_cpu(READ_ONCE(st->full_nr)));
+		seq_printf(m, "irq_nr:     %llu\n", (unsigned long long)le64_to_cpu(READ_ONCE(st->irq_nr)));
+		if (dev->pdev->revision >= 11)
+			seq_printf(m, "host_node:  %d\n", (int)le32_to_cpu(READ_ONCE(st->host_node)) - 1);
+	}
+
+	if (dev->mmio) {
+		for (i = 0; i < dev->ring.nr_sq; i++)
+			seq_printf(m, "sq%d_tail:   %u\n", i, dev->ring.sq[i].tail);
+		for (i = 0; i < dev->ring.nr_cq; i++)
+			seq_printf(m, "cq%d_head:   %u, irq %d, %llu local, %llu remote\n", i,
+				   dev->ring.cq[i].head, dev->ring.cq[i].irq,
+				   (unsigned long long)dev->ring.cq[i].local_nr,
+				   (unsigned long long)dev->ring.cq[i].remote_nr);
+		seq_printf(m, "inflight:   %u\n", dev->ring.nr_inflight);
+	}
+
+	if (dev->shm.r) {
+		seq_printf(m, "shm_slot:   %u\n", le32_to_cpu(dev->shm.r->slot));
+		seq_printf(m, "shm_sq:     %u/%u\n", dev->shm.sq_tail,
+			   le32_to_cpu(READ_ONCE(dev->shm.r->sq_head)));
+		seq_printf(m, "shm_cq:     %u/%u\n", dev->shm.cq_head,
+			   le32_to_cpu(READ_ONCE(dev->shm.r->cq_tail)));
+		seq_printf(m, "shm_descs:  %llu\n", (unsigned long long)le64_to_cpu(READ_ONCE(dev->shm.r->descs)));
+	}
+
+	return 0;
+}
+
+static int flip_debugfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, flip_debugfs_stats_show, inode->i_private);
+}
+
+static const struct file_operations flip_debugfs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = flip_debugfs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int flip_debugfs_counters_show(struct seq_file *m, void *v)
+{
+	struct flip_char *dev = m->private;
+	struct flip_pcpu *pc;
+	int cpu;
+
+	seq_printf(m, "%4s %12s %12s %12s %12s %12s\n",
+		   "cpu", "submits", "irqs", "completions", "read_wakes", "fifo_drops");
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(dev->pcpu, cpu);
+		if (!pc->submits && !pc->irqs && !pc->completions && !pc->read_wakes
+		    && !pc->fifo_drops)
+			continue;
+		seq_printf(m, "%4d %12llu %12llu %12llu %12llu %12llu\n", cpu,
+			   (unsigned long long)pc->submits, (unsigned long long)pc->irqs,
+			   (unsigned long long)pc->completions, (unsigned long long)pc->read_wakes,
+			   (unsigned long long)pc->fifo_drops);
+	}
+
+	return 0;
+}
+
+/* the buckets of all cpus added up, empty ones left out */
+static void flip_debugfs_hist(struct seq_file *m, struct flip_char *dev, const char *name,
+			      size_t off)
+{
+	u64 sum[FLIP_HIST_BUCKETS] = { 0 };
+	u64 *hist;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		hist = (u64 *)((char *)per_cpu_ptr(dev->pcpu, cpu) + off);
+		for (i = 0; i < FLIP_HIST_BUCKETS; i++)
+			sum[i] += READ_ONCE(hist[i]);
+	}
+
+	seq_printf(m, "%s, ns\n", name);
+	for (i = 0; i < FLIP_HIST_BUCKETS - 1; i++)
+		if (sum[i])
+			seq_printf(m, "  %10llu - %-10llu %12llu\n", i ? 1ULL << i : 0ULL,
+				   (2ULL << i) - 1, (unsigned long long)sum[i]);
+	if (sum[i])
+		seq_printf(m, "  %10llu and up     %12llu\n", 1ULL << i, (unsigned long long)sum[i]);
+}
+
+static int flip_debugfs_latency_show(struct seq_file *m, void *v)
+{
+	struct flip_char *dev = m->private;
+
+	flip_debugfs_hist(m, dev, "submit to complete", offsetof(struct flip_pcpu, compl_lat));
+	flip_debugfs_hist(m, dev, "complete to read() awake", offsetof(struct flip_pcpu, wake_lat));
+
+	return 0;
+}
+
+static int flip_debugfs_counters_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, flip_debugfs_counters_show, inode->i_private);
+}
+
+static int flip_debugfs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, flip_debugfs_latency_show, inode->i_private);
+}
+
+static const struct file_operations flip_debugfs_counters_fops = {
+	.owner = THIS_MODULE,
+	.open = flip_debugfs_counters_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations flip_debugfs_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = flip_debugfs_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* interrupts: a vector per completion queue with msi-x, else the shared line */
+
+static irqreturn_t flip_cq_handler(int irq, void *data)
+{
+	struct flip_cq *cq = data;
+
+	this_cpu_inc(flip_char_dev->pcpu->irqs);
+	trace_flip_irq(irq, cq->n);
+	flip_cq_complete(flip_char_dev, cq);
+
+	return IRQ_HANDLED;
+}
+
+static int flip_msix_enable(struct pci_dev *dev, int nvec, int *irqs)
+{
+	int i;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	struct msix_entry ent[FLIP_MAX_CQS];
+
+	for (i = 0; i < nvec; i++)
+		ent[i].entry = i;
+	if (pci_enable_msix(dev, ent, nvec))
+		return -ENODEV;
+	for (i = 0; i < nvec; i++)
+		irqs[i] = ent[i].vector;
+#else
+	if (pci_alloc_irq_vectors(dev, nvec, nvec, PCI_IRQ_MSIX) < 0)
+		return -ENODEV;
+	for (i = 0; i < nvec; i++)
+		irqs[i] = pci_irq_vector(dev, i);
+#endif
+
+	return 0;
+}
+
+static void flip_msix_disable(struct pci_dev *dev)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	pci_disable_msix(dev);
+#else
+	pci_free_irq_vectors(dev);
+#endif
+}
+
+static int flip_irq_setup(struct flip_char *fc, struct pci_dev *dev)
+{
+	struct flip_ring *ring = &fc->ring;
+	struct flip_cq *cq;
+	int i, cpu;
+
+	if (!ring->msix) {
+		if (dev->irq && request_irq(dev->irq, flip_handler, IRQF_SHARED, "pci-flip", dev)) {
+			printk(KERN_ERR "pci-flip: IRQ %d not free\n", dev->irq);
+			return -EIO;
+		}
+		if (dev->irq)
+			printk(KERN_INFO "pci-flip: IRQ = %d\n", dev->irq);
+		else
+			printk(KERN_INFO "pci-flip: no irq required!\n");
+		return 0;
+	}
+
+	/* vector 0 also carries the port interface and the server's completions */
+	for (i = 0; i < ring->nr_cq; i++) {
+		cq = &ring->cq[i];
+		if (request_irq(cq->irq, i ? flip_cq_handler : flip_handler, 0, "pci-flip",
+				i ? (void *)cq : (void *)dev)) {
+			printk(KERN_ERR "pci-flip: vector %d not free\n", cq->irq);
+			while (i--)
+				free_irq(ring->cq[i].irq, i ? (void *)&ring->cq[i] : (void *)dev);
+			return -EIO;
+		}
+		cpumask_clear(&cq->mask);
+		for_each_online_cpu(cpu)
+			if (cpu % ring->nr_cq == i)
+				cpumask_set_cpu(cpu, &cq->mask);
+		irq_set_affinity_hint(cq->irq, &cq->mask);
+	}
+	printk(KERN_INFO "pci-flip: %d completion queues on msi-x\n", ring->nr_cq);
+
+	return 0;
+}
+
+static void flip_irq_teardown(struct flip_char *fc, struct pci_dev *dev)
+{
+	struct flip_ring *ring = &fc->ring;
+	int i;
+
+	if (!ring->msix) {
+		if (dev->irq)
+			free_irq(dev->irq, dev);
+		return;
+	}
+
+	for (i = 0; i < ring->nr_cq; i++) {
+		irq_set_affinity_hint(ring->cq[i].irq, NULL);
+		free_irq(ring->cq[i].irq, i ? (void *)&ring->cq[i] : (void *)dev);
+	}
+}
+
+/* bring up the bus-master path, the port interface keeps working without it */
+static int flip_dma_setup(struct flip_char *fc, struct pci_dev *dev)
+{
+	int irqs[FLIP_MAX_CQS];
+	int nr_cq = 1, max_cq = 1, poll = 0, i, ret;
+
+	if (!pci_resource_len(dev, 1))
+		return -ENODEV;
+
+	if (pci_set_dma_mask(dev, DMA_BIT_MASK(64))
+	    || pci_set_consistent_dma_mask(dev, DMA_BIT_MASK(64)))
+		return -EIO;
+
+	fc->pdev = dev;
+	fc->mmio = pci_iomap(dev, 1, 0);
+	if (!fc->mmio)
+		return -ENOMEM;
+
+	pci_set_master(dev);
+
+	ret = flip_pool_init(&fc->pool, &dev->dev);
+	if (ret)
+		goto fail_pool;
+
+	/* per-cpu completion queues only pay off with vectors to steer them */
+	if (dev->revision >= 6) {
+		max_cq = min_t(int, readl(fc->mmio + FLIP_DMA_CQS), FLIP_MAX_CQS);
+		nr_cq = min_t(int, max_cq, num_online_cpus());
+	}
+#ifdef FLIP_URING
+	/* io_uring iopoll reaps a queue of its own, after the interrupting ones */
+	if (dev->revision >= 9 && max_cq > 1) {
+		poll = 1;
+		nr_cq = min(nr_cq, max_cq - 1);
+	}
+#endif
+	if (nr_cq > 1 && flip_msix_enable(dev, nr_cq, irqs) < 0)
+		nr_cq = 1;
+
+	ret = flip_ring_init(fc, nr_cq, poll);
+	if (ret) {
+		if (nr_cq > 1)
+			flip_msix_disable(dev);
+		goto fail_ring;
+	}
+	if (nr_cq > 1) {
+		fc->ring.msix = 1;
+		for (i = 0; i < nr_cq; i++)
+			fc->ring.cq[i].irq = irqs[i];
+	}
+
+	/* without it the driver falls back to reading registers */
+	if (flip_stats_init(fc))
+		printk(KERN_WARNING "pci-flip: no stats page\n");
+
+	if (flip_shm_init(fc, dev) == 0)
+		printk(KERN_INFO "pci-flip: server mode, slot %u, %u buffers of %u bytes\n",
+		       le32_to_cpu(fc->shm.r->slot), fc->shm.nbufs, fc->shm.buf_size);
+
+	return 0;
+
+fail_ring:
+	flip_pool_destroy(&fc->pool, &dev->dev);
+fail_pool:
+	pci_clear_master(dev);
+	pci_iounmap(dev, fc->mmio);
+	fc->mmio = NULL;
+	return ret;
+}
+
+static void flip_dma_teardown(struct flip_char *fc, struct pci_dev *dev)
+{
+	if (!fc->mmio)
+		return;
+
+	flip_shm_destroy(fc);
+	flip_stats_destroy(fc);
+	flip_ring_destroy(fc);
+	if (fc->ring.msix) {
+		flip_msix_disable(dev);
+		fc->ring.msix = 0;
+	}
+	flip_pool_destroy(&fc->pool, &dev->dev);
+	pci_clear_master(dev);
+	pci_iounmap(dev, fc->mmio);
+	fc->mmio = NULL;
+}
+
+static int flip_pci_probe(struct pci_dev *dev, const struct pci_device_id *ent)
+{
+
+	int ret;
+
+	strncpy(dev->dev.kobj.name, "pci-flip", KOBJ_NAME_LEN);
+	
+	ret = pci_enable_device(dev);
+	if (ret)
+		return ret;
+
+	flip_char_dev->pdev = dev;
+	ioport = pci_resource_start(dev, 0);
+	io_len = pci_resource_len(dev, 0);
+	if (io_len && !request_region(ioport, io_len, dev->dev.kobj.name)) {
+		printk(KERN_ERR "can not get io_region for %s\n", dev->dev.kobj.name);
+		return -EIO;
+	}
+	if (io_len) 
+		printk(KERN_INFO "pci-flip: ioport len %d\n", io_len);
+	else
+		printk(KERN_INFO "pci-flip: ioport not needed!\n");
+
+	if (flip_dma_setup(flip_char_dev, dev) == 0)
+		printk(KERN_INFO "pci-flip: bus-master, %d pool buffers\n",
+		       flip_char_dev->pool.nr_bufs);
+	else
+		printk(KERN_INFO "pci-flip: port i/o only\n");
+
+	/* once the completion queues are known */
+	if (flip_irq_setup(flip_char_dev, dev))
+		goto cleanup_dma;
+
+	if (sysfs_create_group(&dev->dev.kobj, &flip_attr_group))
+		printk(KERN_WARNING "pci-flip: can not create sysfs attributes\n");
+
+	flip_char_dev->debugfs = debugfs_create_dir("pci-flip", NULL);
+	if (!IS_ERR_OR_NULL(flip_char_dev->debugfs)) {
+		debugfs_create_file("stats", 0444, flip_char_dev->debugfs, flip_char_dev,
+				    &flip_debugfs_stats_fops);
+		debugfs_create_file("counters", 0444, flip_char_dev->debugfs, flip_char_dev,
+				    &flip_debugfs_counters_fops);
+		debugfs_create_file("latency", 0444, flip_char_dev->debugfs, flip_char_dev,
+				    &flip_debugfs_latency_fops);
+	}
+	
+	return 0;
+
+cleanup_dma:
+	flip_dma_teardown(flip_char_dev, dev);
+	if (io_len)
+		release_region(ioport, io_len);
+
+	return -EIO;
+}
+
+
+static void flip_pci_remove(struct pci_dev *dev)
+{
+	debugfs_remove_recursive(flip_char_dev->debugfs);
+	sysfs_remove_group(&dev->dev.kobj, &flip_attr_group);
+	flip_irq_teardown(flip_char_dev, dev);
+	flip_dma_teardown(flip_char_dev, dev);
+	if (io_len)
+		release_region(ioport, io_len);
+}
+
+static struct pci_driver flip_pci_driver = {
+	.name = "pci-flip",
+	.id_table = ids,
+	.probe = flip_pci_probe,
+	.remove = flip_pci_remove,
+};
+
+/*
+ * UTF-8 modes: the output can be longer than the input and its length
+ * comes with the completion, so it is never converted in place or on
+ * the cpu
+ */
+static int flip_conf_utf8(int conf)
+{
+	return conf == FLIP_CONF_UTF8_UP || conf == FLIP_CONF_UTF8_LOW;
+}
+
+/* room the output of len input bytes may need */
+static size_t flip_out_max(struct flip_char *dev, size_t len)
+{
+	return flip_conf_utf8(dev->conf) ? len * FLIP_UTF8_GROWTH : len;
+}
+
+/* convert in place on the cpu, same rules as the device */
+static void flip_cpu_convert(char *data, size_t count, int conf)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (conf == FLIP_CONF_UP && data[i] >= 'a' && data[i] <= 'z')
+			data[i] -= 32;
+		else if (conf == FLIP_CONF_LOW && data[i] >= 'A' && data[i] <= 'Z')
+			data[i] += 32;
+		else if (conf == FLIP_CONF_LUT)
+			data[i] = flip_char_dev->lut[(u8)data[i]];
+	}
+}
+
+/* device is full when its input fifo can not take another word */
+static int flip_dev_full(void)
+{
+	return !flip_port_room(flip_char_dev);
+}
+
+/*
+ * cpu path: for a few bytes the port write, timer, irq and port read
+ * round trip costs far more than converting here.  Words still in the
+ * device belong to an earlier request, so let them land in fifo_out
+ * first to keep the output in order.
+ */
+static int flip_cpu_write(struct flip_char *dev, char *data, size_t count)
+{
+	flip_cpu_convert(data, count, dev->conf);
+
+	/* under port_mutex, no new device words can get in between */
+	if (mutex_lock_interruptible(&dev->port_mutex))
+		return -ERESTARTSYS;
+	if (wait_event_interruptible(dev->drain_wq, atomic_read(&dev->inflight) == 0)) {
+		mutex_unlock(&dev->port_mutex);
+		return -ERESTARTSYS;
+	}
+
+	/* zero is padding on the device path, dropped here as well */
+	flip_fifo_put(dev, (u8 *)data, count);
+	mutex_unlock(&dev->port_mutex);
+
+	atomic64_inc(&dev->cpu_reqs);
+	atomic64_add(count, &dev->cpu_bytes);
+
+	return 0;
+}
+
+/* bus-master char path */
+
+/* queue a descriptor on the class's queue, -EBUSY when every tag is in flight */
+static int flip_ring_submit(struct flip_char *dev, int class, struct flip_req *req,
+			    struct flip_desc *d)
+{
+	struct flip_ring *ring = &dev->ring;
+	struct flip_sq *sq;
+	unsigned long flags;
+	unsigned int tag;
+	int n = class < ring->nr_sq ? class : 0;
+	int cq;
+
+	spin_lock_irqsave(&ring->lock, flags);
+
+	/* one tag per descriptor, so no sq can overflow either */
+	if (ring->nr_inflight >= FLIP_RING_SIZE - 1) {
+		spin_unlock_irqrestore(&ring->lock, flags);
+		return -EBUSY;
+	}
+
+	for (tag = ring->next_tag; ring->reqs[tag]; tag = (tag + 1) % FLIP_RING_SIZE)
+		;
+	ring->next_tag = (tag + 1) % FLIP_RING_SIZE;
+	ring->reqs[tag] = req;
+	ring->nr_inflight++;
+	atomic_inc(&req->ref);
+
+	/* complete where we are, interrupts are off so we stay here */
+	req->cpu = smp_processor_id();
+	cq = req->polled && ring->poll_cq >= 0 ? ring->poll_cq : req->cpu % ring->nr_cq;
+	req->wq = &ring->cq[cq].wq;
+	d->cq = cpu_to_le16(cq);
+
+	d->tag = cpu_to_le16(tag);
+	d->flags |= cpu_to_le16(dev->conf);
+	req->start_ns = ktime_to_ns(ktime_get());
+	this_cpu_inc(dev->pcpu->submits);
+	trace_flip_submit(tag, n, cq, le32_to_cpu(d->len));
+	sq = &ring->sq[n];
+	sq->ring[sq->tail] = *d;
+	wmb();
+	sq->tail = (sq->tail + 1) & (FLIP_RING_SIZE - 1);
+	trace_flip_kick(n, sq->tail);
+	if (n)
+		writel(sq->tail, dev->mmio + FLIP_DMA_QUEUE + n * FLIP_DMA_QUEUE_SIZE + FLIP_SQ_TAIL);
+	else
+		writel(sq->tail, dev->mmio + FLIP_DMA_SQ_TAIL);
+
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return 0;
+}
+
+/* the cpu paths checksum like the device does */
+static void flip_cpu_crc(struct flip_file *ff, struct flip_req *req)
+{
+	if (ff->crc)
+		req->crc = ~crc32c(~0, req->data, req->out_len);
+}
+
+static void flip_file_queue(struct flip_file *ff, struct flip_req *req)
+{
+	spin_lock(&ff->lock);
+	list_add_tail(&req->list, &ff->reqs);
+	spin_unlock(&ff->lock);
+}
+
+/* no room on the device: convert on the cpu, output order is kept by the list */
+static int flip_submit_cpu(struct flip_file *ff, const char __user *buff, size_t len)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_req *req;
+
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
+
+	req->data = kmalloc(len, GFP_KERNEL);
+	if (!req->data) {
+		kfree(req);
+		return -ENOMEM;
+	}
+
+	if (copy_from_user(req->data, buff, len)) {
+		flip_req_put(dev, req);
+		return -EFAULT;
+	}
+
+	flip_cpu_convert(req->data, len, dev->conf);
+	req->len = req->out_len = len;
+	flip_cpu_crc(ff, req);
+	req->done = 1;
+	flip_file_queue(ff, req);
+
+	atomic64_inc(&dev->cpu_reqs);
+	atomic64_add(len, &dev->cpu_bytes);
+
+	return 0;
+}
+
+/* small request: copy into a pre-mapped pool buffer, converted in place */
+static int flip_submit_pool(struct flip_file *ff, const char __user *buff, size_t len)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_desc d;
+	struct flip_req *req;
+	ktime_t start = ktime_get();
+
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
+
+	req->buf = flip_pool_get(&dev->pool);
+	if (!req->buf) {
+		kfree(req);
+		return -ERESTARTSYS;
+	}
+	req->data = req->buf->vaddr;
+	req->len = len;
+
+	if (copy_from_user(req->data, buff, len)) {
+		flip_req_put(dev, req);
+		return -EFAULT;
+	}
+
+	/* one pass over the buffer on the device side */
+	memset(&d, 0, sizeof(d));
+	d.src = cpu_to_le64(req->buf->dma);
+	d.len = cpu_to_le32(len);
+	d.flags = cpu_to_le16(FLIP_DESC_INPLACE | (ff->crc ? FLIP_DESC_CRC : 0));
+
+	if (flip_ring_submit(dev, ff->class, req, &d) < 0) {
+		/* ring full, the data is already here */
+		atomic64_inc(&dev->full_reqs);
+		atomic64_inc(&dev->cpu_reqs);
+		atomic64_add(len, &dev->cpu_bytes);
+		flip_cpu_convert(req->data, len, dev->conf);
+		req->out_len = len;
+		flip_cpu_crc(ff, req);
+		req->done = 1;
+	} else {
+		atomic64_inc(&dev->dev_reqs);
+		atomic64_add(len, &dev->dev_bytes);
+		atomic64_inc(&dev->pool_reqs);
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &dev->pool_setup_ns);
+	}
+
+	flip_file_queue(ff, req);
+
+	return 0;
+}
+
+/* build the device's view of a mapped sg list */
+static int flip_sg_table(struct flip_sge *sge, struct sg_table *sgt, int nents)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(sgt->sgl, sg, nents, i) {
+		sge[i].addr = cpu_to_le64(sg_dma_address(sg));
+		sge[i].len = cpu_to_le32(sg_dma_len(sg));
+		sge[i].rsvd = 0;
+	}
+
+	return nents;
+}
+
+/* source sg list is set up: allocate pages for the output and map both sides */
+static int flip_req_map_dst(struct flip_char *dev, struct flip_req *req, size_t len)
+{
+	struct device *d = &dev->pdev->dev;
+	struct scatterlist *sg;
+	size_t left;
+	int i, n;
+
+	req->nr_dst = DIV_ROUND_UP(len, PAGE_SIZE);
+	req->dst_pages = kcalloc(req->nr_dst, sizeof(struct page *), GFP_KERNEL);
+	if (!req->dst_pages || sg_alloc_table(&req->dst_sgt, req->nr_dst, GFP_KERNEL)) {
+		kfree(req->dst_pages);
+		req->dst_pages = NULL;
+		return -ENOMEM;
+	}
+
+	left = len;
+	for_each_sg(req->dst_sgt.sgl, sg, req->nr_dst, i) {
+		req->dst_pages[i] = alloc_page(GFP_KERNEL);
+		if (!req->dst_pages[i])
+			return -ENOMEM;
+		n = min_t(size_t, left, PAGE_SIZE);
+		sg_set_page(sg, req->dst_pages[i], n, 0);
+		left -= n;
+	}
+
+	req->src_nents = dma_map_sg(d, req->src_sgt.sgl, req->nr_src, DMA_TO_DEVICE);
+	if (!req->src_nents)
+		return -EIO;
+
+	req->dst_nents = dma_map_sg(d, req->dst_sgt.sgl, req->nr_dst, DMA_FROM_DEVICE);
+	if (!req->dst_nents)
+		return -EIO;
+
+	return 0;
+}
+
+/* pin the user pages into the source sg list, FOLL_WRITE if the device writes them */
+static int flip_req_pin(struct flip_req *req, const char __user *buff, size_t len,
+			unsigned int gup_flags)
+{
+	unsigned long addr = (unsigned long)buff;
+	unsigned int off = addr & ~PAGE_MASK;
+	struct scatterlist *sg;
+	size_t left;
+	int i, n;
+
+	req->nr_src = DIV_ROUND_UP(off + len, PAGE_SIZE);
+	req->src_pages = kcalloc(req->nr_src, sizeof(struct page *), GFP_KERNEL);
+	if (!req->src_pages)
+		return -ENOMEM;
+
+	n = get_user_pages_fast(addr & PAGE_MASK, req->nr_src, gup_flags, req->src_pages);
+	if (n < req->nr_src) {
+		while (n > 0)
+			put_page(req->src_pages[--n]);
+		kfree(req->src_pages);
+		req->src_pages = NULL;
+		return -EFAULT;
+	}
+
+	if (sg_alloc_table(&req->src_sgt, req->nr_src, GFP_KERNEL)) {
+		for (i = 0; i < req->nr_src; i++)
+			put_page(req->src_pages[i]);
+		kfree(req->src_pages);
+		req->src_pages = NULL;
+		return -ENOMEM;
+	}
+
+	left = len;
+	for_each_sg(req->src_sgt.sgl, sg, req->nr_src, i) {
+		n = min_t(size_t, left, PAGE_SIZE - off);
+		sg_set_page(sg, req->src_pages[i], n, off);
+		left -= n;
+		off = 0;
+	}
+
+	return 0;
+}
+
+/* pin the user pages and allocate pages for the output */
+static int flip_req_map_sg(struct flip_char *dev, struct flip_req *req,
+			   const char __user *buff, size_t len)
+{
+	int ret;
+
+	ret = flip_req_pin(req, buff, len, 0);
+	if (ret < 0)
+		return ret;
+
+	return flip_req_map_dst(dev, req, flip_out_max(dev, len));
+}
+
+/* hand a mapped sg request to the device, waits for a free tag */
+static void flip_queue_sg(struct flip_file *ff, struct flip_req *req, ktime_t start)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_sge *sge;
+	struct flip_desc d;
+	size_t len = req->len;
+
+	sge = req->buf->vaddr;
+	memset(&d, 0, sizeof(d));
+	d.src = cpu_to_le64(req->buf->dma);
+	d.src_nsg = cpu_to_le16(flip_sg_table(sge, &req->src_sgt, req->src_nents));
+	d.dst = cpu_to_le64(req->buf->dma + FLIP_POOL_BUF / 2);
+	d.dst_nsg = cpu_to_le16(flip_sg_table(sge + FLIP_SG_MAX, &req->dst_sgt, req->dst_nents));
+	d.len = cpu_to_le32(len);
+	d.flags = cpu_to_le16(FLIP_DESC_SG | (ff->crc ? FLIP_DESC_CRC : 0));
+	if (dev->pdev->revision >= 8 && !flip_conf_utf8(dev->conf))
+		d.progress = cpu_to_le16(ff->progress);
+
+	while (flip_ring_submit(dev, ff->class, req, &d) < 0) {
+		atomic64_inc(&dev->full_reqs);
+		wait_event(dev->read_wq, dev->ring.nr_inflight < FLIP_RING_SIZE - 1);
+	}
+
+	atomic64_inc(&dev->dev_reqs);
+	atomic64_add(len, &dev->dev_bytes);
+	atomic64_inc(&dev->sg_reqs);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &dev->sg_setup_ns);
+}
+
+/* large request: device reads the pinned user pages, no copy in write() */
+static int flip_submit_sg(struct flip_file *ff, const char __user *buff, size_t len)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_req *req;
+	ktime_t start = ktime_get();
+	int ret;
+
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
+
+	/* the sg tables live in a pool buffer, already visible to the device */
+	req->buf = flip_pool_get(&dev->pool);
+	if (!req->buf) {
+		kfree(req);
+		return -ERESTARTSYS;
+	}
+	req->len = len;
+
+	ret = flip_req_map_sg(dev, req, buff, len);
+	if (ret < 0) {
+		flip_req_put(dev, req);
+		return ret;
+	}
+
+	flip_queue_sg(ff, req, start);
+
+	/* keep the user buffer stable until the device has read it */
+	atomic_inc(&req->ref);
+	flip_file_queue(ff, req);
+	wait_event(*flip_req_wq(dev, req), req->done);
+	flip_req_put(dev, req);
+
+	return 0;
+}
+
+/* UTF-8 modes, small request: the output goes after the input in the pool buffer */
+static int flip_submit_utf8(struct flip_file *ff, const char __user *buff, size_t len)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_desc d;
+	struct flip_req *req;
+	ktime_t start = ktime_get();
+
+	if (len > FLIP_POOL_BUF / (1 + FLIP_UTF8_GROWTH))
+		return flip_submit_sg(ff, buff, len);
+
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
+
+	req->buf = flip_pool_get(&dev->pool);
+	if (!req->buf) {
+		kfree(req);
+		return -ERESTARTSYS;
+	}
+	req->data = (char *)req->buf->vaddr + len;
+	req->len = len;
+
+	if (copy_from_user(req->buf->vaddr, buff, len)) {
+		flip_req_put(dev, req);
+		return -EFAULT;
+	}
+
+	memset(&d, 0, sizeof(d));
+	d.src = cpu_to_le64(req->buf->dma);
+	d.dst = cpu_to_le64(req->buf->dma + len);
+	d.len = cpu_to_le32(len);
+	d.flags = cpu_to_le16(ff->crc ? FLIP_DESC_CRC : 0);
+
+	while (flip_ring_submit(dev, ff->class, req, &d) < 0) {
+		atomic64_inc(&dev->full_reqs);
+		wait_event(dev->read_wq, dev->ring.nr_inflight < FLIP_RING_SIZE - 1);
+	}
+
+	atomic64_inc(&dev->dev_reqs);
+	atomic64_add(len, &dev->dev_bytes);
+	atomic64_inc(&dev->pool_reqs);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &dev->pool_setup_ns);
+
+	flip_file_queue(ff, req);
+
+	return 0;
+}
+
+/*
+ * end a UTF-8 chunk before a sequence rather than in it, the device
+ * leaves the two halves of a cut one as they are
+ */
+static size_t flip_utf8_cut(const char __user *buff, size_t n)
+{
+	size_t cut;
+	u8 c;
+
+	for (cut = n; cut > 0 && n - cut <= 3; cut--) {
+		if (get_user(c, (const u8 __user *)buff + cut))
+			return n;
+		if ((c & 0xc0) != 0x80)
+			return cut;
+	}
+
+	return n;
+}
+
+/* server mode: a request owning a data buffer of the slot, filled by the caller */
+static struct flip_req *flip_shm_req(struct flip_char *dev, size_t len)
+{
+	struct flip_shm *shm = &dev->shm;
+	struct flip_req *req;
+	int buf;
+
+	req = flip_req_alloc();
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	if (wait_event_interruptible(dev->read_wq, (buf = flip_shm_get(shm)) >= 0)) {
+		kfree(req);
+		return ERR_PTR(-ERESTARTSYS);
+	}
+	req->shm_buf = buf + 1;
+	req->data = shm->data + buf * shm->buf_size;
+	req->len = len;
+
+	return req;
+}
+
+/* the host's server converts the buffer in place */
+static void flip_queue_shm(struct flip_file *ff, struct flip_req *req)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_shm *shm = &dev->shm;
+	struct flip_shm_desc *d;
+	unsigned long flags;
+	int buf = req->shm_buf - 1;
+	size_t len = req->len;
+
+	/* no more buffers than entries, the rings can not overflow */
+	spin_lock_irqsave(&shm->lock, flags);
+	shm->reqs[buf] = req;
+	atomic_inc(&req->ref);
+	d = &shm->sq[shm->sq_tail];
+	d->buf = cpu_to_le32(buf);
+	d->len = cpu_to_le32(len);
+	d->flags = cpu_to_le16(dev->conf | (ff->crc ? FLIP_DESC_CRC : 0));
+	d->tag = cpu_to_le16(buf);
+	d->rsvd = 0;
+	shm->sq_tail = (shm->sq_tail + 1) & (shm->entries - 1);
+	/* the server runs on another host cpu even on a uniprocessor guest */
+	wmb();
+	WRITE_ONCE(shm->r->sq_tail, cpu_to_le32(shm->sq_tail));
+	spin_unlock_irqrestore(&shm->lock, flags);
+
+	/* the device turns this into the server's eventfd */
+	writel(1, dev->mmio + FLIP_DMA_SHM_KICK);
+
+	flip_file_queue(ff, req);
+
+	atomic64_inc(&dev->dev_reqs);
+	atomic64_add(len, &dev->dev_bytes);
+}
+
+static int flip_submit_shm(struct flip_file *ff, const char __user *buff, size_t len)
+{
+	struct flip_req *req;
+
+	req = flip_shm_req(ff->dev, len);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (copy_from_user(req->data, buff, len)) {
+		flip_req_put(ff->dev, req);
+		return -EFAULT;
+	}
+
+	flip_queue_shm(ff, req);
+
+	return 0;
+}
+
+static ssize_t flip_dma_write(struct flip_file *ff, const char __user *buff, size_t count)
+{
+	struct flip_char *dev = ff->dev;
+	size_t done, n;
+	int ret = 0;
+
+	for (done = 0; done < count; done += n) {
+		n = min_t(size_t, count - done, FLIP_SG_MAX_LEN);
+		if (dev->shm.r)
+			n = min_t(size_t, n, dev->shm.buf_size);
+
+		if (flip_conf_utf8(dev->conf)) {
+			/* the output pages must fit in the dst sg table */
+			n = min_t(size_t, n, FLIP_SG_MAX_LEN / FLIP_UTF8_GROWTH);
+			if (done + n < count)
+				n = flip_utf8_cut(buff + done, n);
+			ret = flip_submit_utf8(ff, buff + done, n);
+		} else if (n < dev->cpu_threshold)
+			ret = flip_submit_cpu(ff, buff + done, n);
+		else if (dev->shm.r)
+			ret = flip_submit_shm(ff, buff + done, n);
+		else if (n <= FLIP_POOL_BUF)
+			ret = flip_submit_pool(ff, buff + done, n);
+		else
+			ret = flip_submit_sg(ff, buff + done, n);
+
+		if (ret < 0)
+			break;
+	}
+
+	return done ? done : ret;
+}
 
-struct fifo_node {
-	unsigned char data;
-	struct fifo_node *next;
-};
+static int flip_req_copy_out(struct flip_req *req, char __user *buff, size_t off, size_t n)
+{
+	size_t done, c, po;
+	struct page *pg;
+
+	if (!req->dst_pages)
+		return copy_to_user(buff, (char *)req->data + off, n) ? -EFAULT : 0;
+
+	for (done = 0; done < n; done += c) {
+		pg = req->dst_pages[(off + done) >> PAGE_SHIFT];
+		po = (off + done) & ~PAGE_MASK;
+		c = min_t(size_t, n - done, PAGE_SIZE - po);
+		if (copy_to_user(buff + done, (char *)page_address(pg) + po, c))
+			return -EFAULT;
+	}
 
-struct flip_fifo {
-	struct fifo_node *front;
-	struct fifo_node *rear;
-};
+	return 0;
+}
 
-struct flip_char {
+static struct flip_req *flip_file_head(struct flip_file *ff)
+{
+	struct flip_req *req;
 
-	struct flip_fifo fifo_in;
-	struct flip_fifo fifo_out;
-	struct cdev cdev;
-	struct semaphore sem;
-};
+	spin_lock(&ff->lock);
+	req = list_empty(&ff->reqs) ? NULL : list_first_entry(&ff->reqs, struct flip_req, list);
+	spin_unlock(&ff->lock);
 
-struct flip_char *flip_char_dev;
+	return req;
+}
 
-static struct pci_device_id ids[] = {
-	{PCI_DEVICE(PCI_VENDOR_ID_REDHAT_QUMRANET, PCI_FLIP_DEVICE_ID),},
-	{0,},
-};
+/* the head request has been read out completely, rd_mutex held */
+static void flip_file_pop(struct flip_file *ff, struct flip_req *req)
+{
+	ff->last_crc = req->crc;
+	spin_lock(&ff->lock);
+	list_del(&req->list);
+	spin_unlock(&ff->lock);
+	flip_req_put(ff->dev, req);
+}
 
-u64 ioport;
-u32 io_len;
-int flip_char_major = 0;
-int flip_char_minor = 1;
+/* output that can be handed out: all of it once done, before that what progress reported */
+static size_t flip_req_ready(struct flip_req *req)
+{
+	int done = req->done;
 
+	smp_rmb();
+	return done ? req->out_len : req->avail;
+}
 
-static int flip_fifo_init(struct flip_fifo *fifo)
+static int flip_req_readable(struct flip_req *req)
 {
-	fifo->front = fifo->rear = (struct fifo_node *)kmalloc(sizeof(struct fifo_node), GFP_KERNEL);
-	if (fifo->rear == NULL)
-		return -1;
+	return req->done || flip_req_ready(req) > req->rd_off;
+}
 
-	fifo->rear->next = NULL;
+/*
+ * spin on the request's completion queue before sleeping in read().
+ * The file's average device latency says when the completion is due:
+ * poll until a quarter past that, within busy_poll, and go to sleep at
+ * once when it is due later, a slow device is not worth the cpu.
+ */
+static int flip_busy_poll(struct flip_file *ff, struct flip_req *req)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_cq *cq;
+	s64 now, end, due;
+
+	/* without the stats page every look at the tail is an exit */
+	if (!ff->busy_poll || !req->wq || !dev->stats)
+		return 0;
+
+	now = ktime_to_ns(ktime_get());
+	end = now + (s64)ff->busy_poll * NSEC_PER_USEC;
+	due = req->start_ns + ff->lat_ewma + ff->lat_ewma / 4;
+	if (due < end)
+		end = due;
+	if (now >= end)
+		return 0;
+
+	cq = container_of(req->wq, struct flip_cq, wq);
+	do {
+		if (flip_cq_tail(dev, cq) != READ_ONCE(cq->head))
+			flip_cq_complete(dev, cq);
+		if (flip_req_readable(req)) {
+			atomic64_inc(&dev->busy_hits);
+			return 1;
+		}
+		if (need_resched() || signal_pending(current))
+			break;
+		cpu_relax();
+	} while (ktime_to_ns(ktime_get()) < end);
 
+	atomic64_inc(&dev->busy_misses);
 	return 0;
 }
 
+/* read() slept until the request was readable, account the wakeup */
+static void flip_read_wake(struct flip_char *dev, struct flip_req *req)
+{
+	s64 wake_ns;
+
+	/* readable by progress, there was no completion to wake us */
+	if (!req->done)
+		return;
+	smp_rmb();
+	/* nor for what never went to the device */
+	if (!req->done_ns)
+		return;
+
+	wake_ns = max_t(s64, ktime_to_ns(ktime_get()) - req->done_ns, 0);
+	this_cpu_inc(dev->pcpu->read_wakes);
+	this_cpu_inc(dev->pcpu->wake_lat[flip_hist_bucket(wake_ns)]);
+	trace_flip_read_wake(flip_req_ready(req), wake_ns);
+}
+
+/* weight 1/8 as tcp's srtt, the first sample starts it */
+static void flip_busy_learn(struct flip_file *ff, struct flip_req *req)
+{
+	if (!req->lat_ns)
+		return;
+
+	if (ff->lat_ewma)
+		ff->lat_ewma += (req->lat_ns - ff->lat_ewma) / 8;
+	else
+		ff->lat_ewma = req->lat_ns;
+}
+
+/* hand out converted data in submission order, waits for the oldest request */
+static ssize_t flip_dma_read(struct flip_file *ff, char __user *buff, size_t count, int nonblock)
+{
+	struct flip_char *dev = ff->dev;
+	struct flip_req *req;
+	size_t copied = 0, n;
+	int ret = 0;
+
+	if (mutex_lock_interruptible(&ff->rd_mutex))
+		return -ERESTARTSYS;
+
+	while (copied < count) {
+		/* only readers remove entries, and we hold rd_mutex */
+		req = flip_file_head(ff);
+		if (!req)
+			break;
+
+		if (!flip_req_readable(req)) {
+			if (copied)
+				break;
+			if (nonblock) {
+				ret = -EAGAIN;
+				break;
+			}
+			if (!flip_busy_poll(ff, req)) {
+				ret = wait_event_interruptible(*flip_req_wq(dev, req),
+							       flip_req_readable(req));
+				if (ret)
+					break;
+				flip_read_wake(dev, req);
+			}
+		}
+
+		n = min_t(size_t, count - copied, flip_req_ready(req) - req->rd_off);
+		if (n) {
+			ret = flip_req_copy_out(req, buff + copied, req->rd_off, n);
+			if (ret)
+				break;
+		}
+		req->rd_off += n;
+		copied += n;
 
-static int flip_fifo_is_empty(struct flip_fifo *fifo) {
+		if (req->done && req->rd_off == req->out_len) {
+			flip_busy_learn(ff, req);
+			flip_file_pop(ff, req);
+		}
+	}
 
-	return fifo->front == fifo->rear;
+	mutex_unlock(&ff->rd_mutex);
 
+	return copied ? copied : ret;
 }
 
 /*
-static int flip_fifo_is_full(struct flip_fifo *fifo) {
-	return  (fifo->rear + 1) % DEFAULT_FIFO_SIZE == fifo->head;
+ * splice: file -> pipe -> flip -> pipe -> file without a user copy.
+ * On the way in the device reads the pipe's pages, held by a reference
+ * until the descriptor completes; on the way out the pipe gets
+ * references to the pages the device wrote.  Needs the bus-master
+ * interface.
+ */
+
+#define FLIP_SPLICE_PAGES  256             /* pipe-max-size worth, 1M by default */
+
+/* pipe pages gathered for one request */
+struct flip_splice {
+	struct flip_file *ff;
+	size_t max;                  /* bytes per request */
+	size_t len;
+	int nr;
+	struct page *pages[FLIP_SPLICE_PAGES];
+	unsigned int off[FLIP_SPLICE_PAGES];
+	unsigned int len_[FLIP_SPLICE_PAGES];
+};
+
+static void flip_splice_release(struct flip_splice *sp)
+{
+	while (sp->nr)
+		put_page(sp->pages[--sp->nr]);
+	sp->len = 0;
 }
-*/
 
-static int flip_fifo_get_data(struct flip_fifo *fifo, unsigned char *p)
+/* gather the pages into a kernel buffer, for the cpu and server paths */
+static void flip_splice_copy(struct flip_splice *sp, char *data)
 {
-	
-	struct fifo_node *n;
+	char *p;
+	int i;
+
+	for (i = 0; i < sp->nr; i++) {
+		p = kmap(sp->pages[i]);
+		memcpy(data, p + sp->off[i], sp->len_[i]);
+		kunmap(sp->pages[i]);
+		data += sp->len_[i];
+	}
+}
+
+/* the device reads the pipe's pages, the request owns our references */
+static int flip_splice_sg(struct flip_splice *sp)
+{
+	struct flip_file *ff = sp->ff;
+	struct flip_char *dev = ff->dev;
+	struct flip_req *req;
+	struct scatterlist *sg;
+	ktime_t start = ktime_get();
+	int i, ret;
 
-	if (flip_fifo_is_empty(fifo))
-		return  -1;
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
 
-	n = fifo->front->next;
-	*p = n->data;
-	fifo->front->next = n->next;
+	req->buf = flip_pool_get(&dev->pool);
+	req->src_pages = kmemdup(sp->pages, sp->nr * sizeof(struct page *), GFP_KERNEL);
+	if (!req->buf || !req->src_pages || sg_alloc_table(&req->src_sgt, sp->nr, GFP_KERNEL)) {
+		kfree(req->src_pages);
+		req->src_pages = NULL;
+		flip_req_put(dev, req);
+		return -ENOMEM;
+	}
+	req->nr_src = sp->nr;
+	req->len = sp->len;
+	for_each_sg(req->src_sgt.sgl, sg, sp->nr, i)
+		sg_set_page(sg, sp->pages[i], sp->len_[i], sp->off[i]);
+	sp->nr = 0;
+	sp->len = 0;
+
+	ret = flip_req_map_dst(dev, req, flip_out_max(dev, req->len));
+	if (ret < 0) {
+		flip_req_put(dev, req);
+		return ret;
+	}
 
-	if (n == fifo->rear)
-		fifo->rear = fifo->front;
-	kfree(n);
+	/* unlike write() nothing to wait for, the pages can not go away */
+	flip_queue_sg(ff, req, start);
+	flip_file_queue(ff, req);
 
 	return 0;
 }
 
-		    
-static int flip_fifo_put_data(struct flip_fifo *fifo, unsigned char ch)
+static int flip_splice_kernel(struct flip_splice *sp)
 {
-	struct fifo_node *new;
+	struct flip_file *ff = sp->ff;
+	struct flip_char *dev = ff->dev;
+	struct flip_req *req;
+
+	if (dev->shm.r) {
+		req = flip_shm_req(dev, sp->len);
+		if (IS_ERR(req))
+			return PTR_ERR(req);
+		flip_splice_copy(sp, req->data);
+		flip_queue_shm(ff, req);
+		return 0;
+	}
 
-	new = (struct fifo_node *)kmalloc(sizeof(struct fifo_node), GFP_ATOMIC);
-	if (! new)
-		return -1;
-	
-	new->data = ch;
-	new->next = NULL;
-	fifo->rear->next = new;
-	fifo->rear = new;
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
+	req->data = kmalloc(sp->len, GFP_KERNEL);
+	if (!req->data) {
+		kfree(req);
+		return -ENOMEM;
+	}
+
+	flip_splice_copy(sp, req->data);
+	flip_cpu_convert(req->data, sp->len, dev->conf);
+	req->len = req->out_len = sp->len;
+	flip_cpu_crc(ff, req);
+	req->done = 1;
+	flip_file_queue(ff, req);
+
+	atomic64_inc(&dev->cpu_reqs);
+	atomic64_add(sp->len, &dev->cpu_bytes);
 
 	return 0;
 }
 
-static void flip_fifo_destroy(struct flip_fifo *fifo)
+/* byte off of what was gathered */
+static u8 flip_splice_byte(struct flip_splice *sp, size_t off)
 {
-	unsigned char data;
-	while (flip_fifo_get_data(fifo, &data) != -1);
+	char *p;
+	int i;
+	u8 c;
 
+	for (i = 0; off >= sp->len_[i]; i++)
+		off -= sp->len_[i];
+	p = kmap(sp->pages[i]);
+	c = p[sp->off[i] + off];
+	kunmap(sp->pages[i]);
+
+	return c;
 }
 
-static irqreturn_t flip_handler(int irq, void *dev_id)
+/*
+ * UTF-8: take a sequence the flush would cut off the end of what was
+ * gathered, into a page of its own for the next request.  Returns its
+ * length, 0 when the data ends on a character.
+ */
+static int flip_splice_cut(struct flip_splice *sp, struct page **carry)
 {
-	u16 device_id;
-	u16 vendor_id;
-	struct pci_dev *dev;
-	u32 in;
-	char data;
-	int i,ret;
+	u8 tail[3], c;
+	size_t start, n, m, k, need;
+	char *p;
+	int i;
+
+	/* the last lead byte, at most 3 continuation bytes from the end */
+	for (start = sp->len; start > 0 && sp->len - start < 4; start--) {
+		c = flip_splice_byte(sp, start - 1);
+		if ((c & 0xc0) != 0x80)
+			break;
+	}
+	if (!start || sp->len - start >= 4)
+		return 0;
+	start--;
 
+	need = c < 0xc0 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+	n = sp->len - start;
+	if (n >= need)
+		return 0;
 
-	dev = (struct pci_dev *)dev_id;
-	pci_read_config_word(dev, PCI_DEVICE_ID, &device_id);
+	*carry = alloc_page(GFP_KERNEL);
+	if (!*carry)
+		return -ENOMEM;
+	for (k = 0; k < n; k++)
+		tail[k] = flip_splice_byte(sp, start + k);
+	p = kmap(*carry);
+	memcpy(p, tail, n);
+	kunmap(*carry);
+
+	for (m = n; m; ) {
+		i = sp->nr - 1;
+		k = min_t(size_t, m, sp->len_[i]);
+		sp->len_[i] -= k;
+		sp->len -= k;
+		m -= k;
+		if (!sp->len_[i])
+			put_page(sp->pages[--sp->nr]);
+	}
 
-	pci_read_config_word(dev, PCI_VENDOR_ID, &vendor_id);
+	return n;
+}
 
-	if (!(vendor_id == PCI_VENDOR_ID_REDHAT_QUMRANET && device_id == PCI_FLIP_DEVICE_ID))
-		return IRQ_NONE;
-	
-	printk("handle flip irq\n");
-	in = inb(ioport + FLIP_REG_STATE);
-	if ( in & FLIP_OUT_EMPTY)
-		return IRQ_HANDLED;
+/* submit what was gathered, last at the end of the splice */
+static int flip_splice_flush(struct flip_splice *sp, bool last)
+{
+	struct page *carry = NULL;
+	int ret = 0, n = 0;
 
-	in = inl(ioport + FLIP_REG_OUT);
+	if (!sp->nr)
+		return 0;
 
-	if (down_trylock(&flip_char_dev->sem))
-		return -ERESTARTSYS;
-	
-	//printk("write to fifo: %u\n", in);
-	for (i = 0; i < FLIP_REG_LEN; i++) {
-		data = (in >> i * 8) & 0xff;
-		if (data == 0)
-			goto fail;
-		ret = flip_fifo_put_data(&flip_char_dev->fifo_out, data);
-		if (ret < 0) {
-			printk(KERN_ERR "flip fifo put data failed !\n");
-			goto fail;
+	if (flip_conf_utf8(sp->ff->dev->conf)) {
+		if (!last) {
+			n = flip_splice_cut(sp, &carry);
+			if (n < 0)
+				ret = n;
 		}
+		if (!ret && sp->nr)
+			ret = flip_splice_sg(sp);
+	} else if (sp->len < sp->ff->dev->cpu_threshold || sp->ff->dev->shm.r)
+		ret = flip_splice_kernel(sp);
+	else
+		ret = flip_splice_sg(sp);
+
+	flip_splice_release(sp);
+
+	/* the cut sequence starts the next request */
+	if (carry && ret < 0)
+		put_page(carry);
+	else if (carry) {
+		sp->pages[0] = carry;
+		sp->off[0] = 0;
+		sp->len_[0] = n;
+		sp->nr = 1;
+		sp->len = n;
 	}
 
-fail:	
-	up(&flip_char_dev->sem);
-	return IRQ_HANDLED;
+	return ret;
 }
 
-static int flip_pci_probe(struct pci_dev *dev, const struct pci_device_id *ent)
+static int flip_splice_actor(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+			     struct splice_desc *sd)
 {
-
+	struct flip_splice *sp = sd->u.data;
 	int ret;
 
-	strncpy(dev->dev.kobj.name, "pci-flip", KOBJ_NAME_LEN);
-	
-	ret = pci_enable_device(dev);
-	if (ret)
-		return ret;
-
-	if (dev->irq && request_irq(dev->irq, flip_handler, IRQF_SHARED, "pci-flip", dev)) {
-		printk(KERN_ERR "pci-flip: IRQ %d not free\n", dev->irq);
-		return -EIO;
-	}
-	if (dev->irq) {
-		printk(KERN_INFO "pci-flip: IRQ = %d\n", dev->irq);
-	}
-	else 
-		printk(KERN_INFO "pci-flip: no irq required!\n");
-
-	
-	ioport = pci_resource_start(dev, 0);
-	io_len = pci_resource_len(dev, 0);
-	if (io_len && !request_region(ioport, io_len, dev->dev.kobj.name)) {
-		printk(KERN_ERR "can not get io_region for %s\n", dev->dev.kobj.name);
-		goto cleanup_irq;
+	if (sp->nr == FLIP_SPLICE_PAGES || sp->len + sd->len > sp->max) {
+		ret = flip_splice_flush(sp, false);
+		if (ret < 0)
+			return ret;
 	}
-	if (io_len) 
-		printk(KERN_INFO "pci-flip: ioport len %d\n", io_len);
-	else
-		printk(KERN_INFO "pci-flip: ioport not needed!\n");
-	
-	return 0;
 
-cleanup_irq:
-	if (dev->irq)
-		free_irq(dev->irq, dev);
+	get_page(buf->page);
+	sp->pages[sp->nr] = buf->page;
+	sp->off[sp->nr] = buf->offset;
+	sp->len_[sp->nr] = sd->len;
+	sp->nr++;
+	sp->len += sd->len;
 
-	return -EIO;
+	return sd->len;
 }
 
+static ssize_t flip_char_splice_write(struct pipe_inode_info *pipe, struct file *out,
+				      loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct flip_file *ff = out->private_data;
+	struct flip_char *dev = ff->dev;
+	struct splice_desc sd = {
+		.total_len = len,
+		.flags = flags,
+		.pos = *ppos,
+	};
+	struct flip_splice *sp;
+	ssize_t ret;
+	int err;
+
+	if (!dev->mmio)
+		return -EINVAL;
+
+	sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+	if (!sp)
+		return -ENOMEM;
+	sp->ff = ff;
+	sp->max = dev->shm.r ? dev->shm.buf_size : FLIP_SG_MAX_LEN;
+	if (flip_conf_utf8(dev->conf))
+		sp->max = FLIP_SG_MAX_LEN / FLIP_UTF8_GROWTH;
+	sd.u.data = sp;
+
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, &sd, flip_splice_actor);
+	pipe_unlock(pipe);
 
-static void flip_pci_remove(struct pci_dev *dev)
+	/* the rest was taken from the pipe as well, whatever happens to it */
+	err = flip_splice_flush(sp, true);
+	if (err < 0 && ret >= 0)
+		ret = err;
+	kfree(sp);
+
+	if (ret > 0)
+		*ppos += ret;
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+/* the pages stay ours until the pipe lets go, nobody may steal them */
+static int flip_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
 {
-	if (dev->irq)
-		free_irq(dev->irq, dev);
-	if (io_len)
-		release_region(ioport, io_len);
+	return 1;
 }
 
-static struct pci_driver flip_pci_driver = {
-	.name = "pci-flip",
-	.id_table = ids,
-	.probe = flip_pci_probe,
-	.remove = flip_pci_remove,
+static const struct pipe_buf_operations flip_pipe_buf_ops = {
+	.can_merge = 0,
+	.map = generic_pipe_buf_map,
+	.unmap = generic_pipe_buf_unmap,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = flip_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
 };
+#else
+#define flip_pipe_buf_ops nosteal_pipe_buf_ops
+#endif
+
+static void flip_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/* the head request's output pages, as far as one pipe fill goes */
+static ssize_t flip_char_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+				     size_t len, unsigned int flags)
+{
+	struct flip_file *ff = in->private_data;
+	struct flip_char *dev = ff->dev;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+#endif
+		.flags = flags,
+		.ops = &flip_pipe_buf_ops,
+		.spd_release = flip_spd_release,
+	};
+	struct flip_req *req;
+	struct page *page;
+	size_t off, left, n, po;
+	ssize_t ret;
+
+	if (!dev->mmio)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&ff->rd_mutex))
+		return -ERESTARTSYS;
+
+	/* requests that failed have nothing to give */
+	while ((req = flip_file_head(ff)) && req->done && req->rd_off == req->out_len)
+		flip_file_pop(ff, req);
+
+	ret = 0;
+	if (!req)
+		goto out;
+
+	if (!flip_req_readable(req)) {
+		ret = -EAGAIN;
+		if ((flags & SPLICE_F_NONBLOCK) || (in->f_flags & O_NONBLOCK))
+			goto out;
+		ret = wait_event_interruptible(*flip_req_wq(dev, req), flip_req_readable(req));
+		if (ret)
+			goto out;
+	}
+
+	off = req->rd_off;
+	left = min_t(size_t, len, flip_req_ready(req) - off);
+	while (left && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		if (req->dst_pages) {
+			/* what the device wrote, handed over as it is */
+			po = off & ~PAGE_MASK;
+			n = min_t(size_t, left, PAGE_SIZE - po);
+			page = req->dst_pages[off >> PAGE_SHIFT];
+			get_page(page);
+		} else {
+			/* the output is in a kernel buffer that goes back to its pool */
+			po = 0;
+			n = min_t(size_t, left, PAGE_SIZE);
+			page = alloc_page(GFP_KERNEL);
+			if (!page)
+				break;
+			memcpy(page_address(page), (char *)req->data + off, n);
+		}
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = po;
+		partial[spd.nr_pages].len = n;
+		spd.nr_pages++;
+		off += n;
+		left -= n;
+	}
+
+	ret = -ENOMEM;
+	if (!spd.nr_pages)
+		goto out;
+
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0) {
+		req->rd_off += ret;
+		if (req->done && req->rd_off == req->out_len)
+			flip_file_pop(ff, req);
+	}
+
+out:
+	mutex_unlock(&ff->rd_mutex);
+
+	return ret;
+}
 
 static int flip_char_open(struct inode *inode, struct file *flip)
 {
 	struct flip_char *dev;
+	struct flip_file *ff;
 
 	dev = container_of(inode->i_cdev, struct flip_char, cdev);
 
-	flip->private_data = dev;
+	ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+	if (!ff)
+		return -ENOMEM;
+
+	ff->dev = dev;
+	INIT_LIST_HEAD(&ff->reqs);
+	spin_lock_init(&ff->lock);
+	mutex_init(&ff->rd_mutex);
+	ff->busy_poll = min_t(unsigned int, READ_ONCE(busy_poll), FLIP_BUSY_POLL_MAX);
+
+	flip->private_data = ff;
 
 	return 0;
 }
@@ -244,31 +2862,38 @@ static int flip_char_open(struct inode *inode, struct file *flip)
 
 static int flip_char_close(struct inode *inode, struct file *filp)
 {
+	struct flip_file *ff = filp->private_data;
+	struct flip_req *req, *tmp;
+
+	/* the device may still be writing into unread requests */
+	list_for_each_entry_safe(req, tmp, &ff->reqs, list) {
+		wait_event(*flip_req_wq(ff->dev, req), req->done);
+		list_del(&req->list);
+		flip_req_put(ff->dev, req);
+	}
+
+	kfree(ff);
+
 	return 0;
 }
 
 static ssize_t flip_char_read(struct file *flip, char *buff, size_t count, loff_t *f_pos)
 {
-	struct flip_char *dev = flip->private_data;
+	struct flip_file *ff = flip->private_data;
+	struct flip_char *dev = ff->dev;
 	int i, ret;
 	char *data;
 
 
 	//printk("read: count = %d, pos = %lld\n", count, *f_pos);
 
-	if (down_trylock(&dev->sem))
-		return -ERESTARTSYS;
+	if (dev->mmio)
+		return flip_dma_read(ff, buff, count, flip->f_flags & O_NONBLOCK);
 
 	data = (char *)kmalloc(count, GFP_KERNEL);
 	if (!data)
 		return -ENOMEM;
-	i = 0;
-	while (i < count) {
-		if (flip_fifo_get_data(&dev->fifo_out, &data[i]) < 0)
-			break;
-		i++;
-	}
-	up(&dev->sem);
+	i = kfifo_out_spinlocked(&dev->fifo_out, data, count, &dev->fifo_lock);
 	
 	if((ret = copy_to_user(buff, data, i))) {
 		printk(KERN_ERR "copy_to_user error!\n");
@@ -282,16 +2907,26 @@ static ssize_t flip_char_read(struct file *flip, char *buff, size_t count, loff_
 
 static ssize_t flip_char_write(struct file *flip, __user const char *buff, size_t count, loff_t *f_pos)
 {
+	struct flip_file *ff = flip->private_data;
+	struct flip_char *dev = ff->dev;
 	int ret;
-	u32 d;
-	int i, j, n;
+	unsigned int i, n, words;
 	char *data;
 
 	//printk("write: count = %d, pos = %lld\n", count, *f_pos);
 
+	if (dev->mmio) {
+		ret = flip_dma_write(ff, buff, count);
+		if (ret > 0)
+			*f_pos += ret;
+		return ret;
+	}
+
 	ret = 0;
 
-	data = (char *)kmalloc(count, GFP_KERNEL);
+	/* whole words for outsl, the zeros padding the last one are dropped on read */
+	words = DIV_ROUND_UP(count, FLIP_REG_LEN);
+	data = (char *)kzalloc(words * FLIP_REG_LEN, GFP_KERNEL);
 	if (!data)
 		goto nomem;
 
@@ -301,20 +2936,54 @@ static ssize_t flip_char_write(struct file *flip, __user const char *buff, size_
 	}
 	
 	*f_pos += count;
+
+	/* small requests, or the device is busy: convert on the cpu */
+	if (count < dev->cpu_threshold || flip_dev_full()) {
+		if (count >= dev->cpu_threshold)
+			atomic64_inc(&dev->full_reqs);
+		ret = flip_cpu_write(dev, data, count);
+		if (ret < 0) {
+			*f_pos -= count;
+			kfree(data);
+			return ret;
+		}
+		goto fail_copy;
+	}
+
+	atomic64_inc(&dev->dev_reqs);
+	atomic64_add(count, &dev->dev_bytes);
 		
-	i = 0;
-	while (i < count) {
-		d = 0;
-		n = (count - i >= 4) ? 4 : count - i;
-		for (j = 0; j < n; j++)
-			d = data[i + j] << (8 * j) | d;
-		
-		printk("outl 0x%08x -> %p\n", d, ioport + FLIP_REG_IN);
-		outl(d, ioport + FLIP_REG_IN);
-		mdelay(1);
-		
-		i += n;
+	/*
+	 * as many words as the input fifo has room for in one rep outsl,
+	 * which kvm hands to the device a page per exit.  The fifo drains
+	 * on the device's timer, so back off briefly when it is full.  The
+	 * device drops what does not fit, so the room we saw must stay ours.
+	 */
+	if (mutex_lock_interruptible(&dev->port_mutex)) {
+		*f_pos -= count;
+		kfree(data);
+		return -ERESTARTSYS;
 	}
+	for (i = 0; i < words; i += n) {
+		n = min_t(unsigned int, flip_port_room(dev) / FLIP_REG_LEN, words - i);
+		if (!n) {
+			if (signal_pending(current)) {
+				/* what went out is converted, report that much */
+				ret = count - min_t(size_t, count, i * FLIP_REG_LEN);
+				*f_pos -= ret;
+				if (!i) {
+					kfree(data);
+					return -ERESTARTSYS;
+				}
+				break;
+			}
+			usleep_range(20, 100);
+			continue;
+		}
+		atomic_add(n, &dev->inflight);
+		outsl(ioport + FLIP_REG_IN, (u32 *)data + i, n);
+	}
+	mutex_unlock(&dev->port_mutex);
 
 fail_copy:
 
@@ -324,8 +2993,56 @@ nomem:
 	return count - ret;
 }
 
+/* the translation table needs a revision 3 device with the bus-master BAR */
+static int flip_has_lut(struct flip_char *dev)
+{
+	return dev->mmio && dev->pdev->revision >= 3;
+}
+
+static int flip_has_utf8(struct flip_char *dev)
+{
+	return dev->mmio && dev->pdev->revision >= 10 && !dev->shm.r;
+}
+
+/*
+ * hand a new table to the device in one dma load.  Descriptors the
+ * device has not fetched yet are converted with the new table, so load
+ * it before writing data that relies on it.
+ */
+static int flip_lut_load(struct flip_char *dev, const void __user *table)
+{
+	struct flip_buf *b;
+	int ret = 0;
+
+	if (!flip_has_lut(dev))
+		return -ENODEV;
+
+	b = flip_pool_get(&dev->pool);
+	if (!b)
+		return -ERESTARTSYS;
+
+	if (copy_from_user(b->vaddr, table, FLIP_LUT_LEN)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	mutex_lock(&dev->lut_mutex);
+	writel(lower_32_bits(b->dma), dev->mmio + FLIP_DMA_LUT);
+	writel(upper_32_bits(b->dma), dev->mmio + FLIP_DMA_LUT + 4);
+	memcpy(dev->lut, b->vaddr, FLIP_LUT_LEN);
+	/* the server reads its copy from the slot */
+	if (dev->shm.r)
+		memcpy(dev->shm.r->lut, dev->lut, FLIP_LUT_LEN);
+	mutex_unlock(&dev->lut_mutex);
+
+out:
+	flip_pool_put(&dev->pool, b);
+	return ret;
+}
+
 int flip_char_ioctl(struct file *flip, unsigned int cmd, unsigned long arg)
 {
+	struct flip_file *ff = flip->private_data;
 	int ret, dir;
 
 	ret = 0;
@@ -336,7 +3053,72 @@ int flip_char_ioctl(struct file *flip, unsigned int cmd, unsigned long arg)
 	switch (cmd) {
 	case FLIP_CMD_DIR:
 		ret = __get_user(dir, (int  __user *) arg);
-		outb(dir & 0x1, ioport + FLIP_REG_CONF);
+		if (ret)
+			break;
+		if (dir < FLIP_CONF_UP || dir > FLIP_CONF_UTF8_LOW)
+			return -EINVAL;
+		if (dir == FLIP_CONF_LUT && !flip_has_lut(flip_char_dev))
+			return -ENODEV;
+		/* bus-master only, the server converts in place */
+		if (flip_conf_utf8(dir) && !flip_has_utf8(flip_char_dev))
+			return -ENODEV;
+		flip_char_dev->conf = dir;
+		outb(dir, ioport + FLIP_REG_CONF);
+		break;
+	case FLIP_CMD_LUT:
+		ret = flip_lut_load(flip_char_dev, (const void __user *)arg);
+		break;
+	case FLIP_CMD_CRC:
+		/* the checksum comes with the bus-master completions */
+		if (!flip_char_dev->mmio)
+			return -ENODEV;
+		ret = __get_user(dir, (int __user *)arg);
+		if (!ret)
+			ff->crc = !!dir;
+		break;
+	case FLIP_CMD_CLASS:
+		/*
+		 * requests already queued keep their place, later ones go
+		 * to the queue of the class
+		 */
+		ret = __get_user(dir, (int __user *)arg);
+		if (ret)
+			break;
+		if (dir < FLIP_CLASS_NORMAL || dir >= FLIP_NR_CLASSES)
+			return -EINVAL;
+		ff->class = dir;
+		break;
+	case FLIP_CMD_PROGRESS:
+		/*
+		 * KiB between progress completions of later requests, so that
+		 * read() gets the start of a large one before it is finished
+		 */
+		if (!flip_char_dev->mmio)
+			return -ENODEV;
+		ret = __get_user(dir, (int __user *)arg);
+		if (ret)
+			break;
+		if (dir < 0 || dir > 0xffff)
+			return -EINVAL;
+		ff->progress = dir;
+		break;
+	case FLIP_CMD_BUSY_POLL:
+		/* like SO_BUSY_POLL: us read() spins on the completion before sleeping */
+		if (!flip_char_dev->mmio)
+			return -ENODEV;
+		ret = __get_user(dir, (int __user *)arg);
+		if (ret)
+			break;
+		if (dir < 0 || dir > FLIP_BUSY_POLL_MAX)
+			return -EINVAL;
+		ff->busy_poll = dir;
+		break;
+	case FLIP_CMD_GET_CRC:
+		/*
+		 * crc32c of the last request read out completely.  A write
+		 * is one request unless it is larger than FLIP_SG_MAX_LEN.
+		 */
+		ret = put_user(ff->last_crc, (__u32 __user *)arg);
 		break;
 	default:
 		return -ENOTTY;
@@ -345,10 +3127,168 @@ int flip_char_ioctl(struct file *flip, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/* readable once the oldest request has output to hand out, writes always go */
+static unsigned int flip_char_poll(struct file *filp, poll_table *wait)
+{
+	struct flip_file *ff = filp->private_data;
+	struct flip_char *dev = ff->dev;
+	struct flip_req *req = NULL;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(filp, &dev->read_wq, wait);
+
+	if (!dev->mmio) {
+		if (!kfifo_is_empty(&dev->fifo_out))
+			mask |= POLLIN | POLLRDNORM;
+		return mask;
+	}
+
+	/* a reader may pop it meanwhile, hold a reference */
+	spin_lock(&ff->lock);
+	if (!list_empty(&ff->reqs)) {
+		req = list_first_entry(&ff->reqs, struct flip_req, list);
+		atomic_inc(&req->ref);
+	}
+	spin_unlock(&ff->lock);
+
+	if (req) {
+		poll_wait(filp, flip_req_wq(dev, req), wait);
+		if (flip_req_readable(req))
+			mask |= POLLIN | POLLRDNORM;
+		flip_req_put(dev, req);
+	}
+
+	return mask;
+}
+
+#ifdef FLIP_URING
+static const struct flip_uring_cmd *flip_uring_sqe_cmd(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	return ioucmd->cmd;
+#endif
+}
+
+/*
+ * IORING_OP_URING_CMD: the device converts the pinned user buffer in
+ * place and the cqe is posted when it is done, no read() and no copy.
+ * On an IORING_SETUP_IOPOLL ring the descriptor completes on the polled
+ * queue, which flip_uring_cmd_iopoll() reaps instead of an interrupt.
+ */
+static int flip_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct flip_file *ff = ioucmd->file->private_data;
+	struct flip_char *dev = ff->dev;
+	const struct flip_uring_cmd *cmd = flip_uring_sqe_cmd(ioucmd);
+	int nonblock = issue_flags & IO_URING_F_NONBLOCK;
+	struct flip_sge *sge;
+	struct flip_desc d;
+	struct flip_req *req;
+	u64 addr;
+	u32 len;
+	int ret;
+
+	if (ioucmd->cmd_op != FLIP_URING_CONVERT)
+		return -ENOTTY;
+	/* the server converts its own buffers, not user pages */
+	if (!dev->mmio || dev->shm.r)
+		return -EOPNOTSUPP;
+	/* in place, the output of the UTF-8 modes may not fit */
+	if (flip_conf_utf8(dev->conf))
+		return -EOPNOTSUPP;
+
+	/* the sqe belongs to the application, read it once */
+	addr = READ_ONCE(cmd->addr);
+	len = READ_ONCE(cmd->len);
+	if (READ_ONCE(cmd->rsvd) || len > FLIP_SG_MAX_LEN)
+		return -EINVAL;
+	if (!len)
+		return 0;
+
+	req = flip_req_alloc();
+	if (!req)
+		return -ENOMEM;
+
+	/* the sg table lives in a pool buffer, io-wq retries what would block */
+	req->buf = nonblock ? flip_pool_try_get(&dev->pool) : flip_pool_get(&dev->pool);
+	if (!req->buf) {
+		kfree(req);
+		return nonblock ? -EAGAIN : -EINTR;
+	}
+	req->len = len;
+	req->ucmd = ioucmd;
+	req->polled = !!(issue_flags & IO_URING_F_IOPOLL);
+
+	ret = flip_req_pin(req, u64_to_user_ptr(addr), len, FOLL_WRITE);
+	if (ret < 0)
+		goto fail;
+	req->src_nents = dma_map_sg(&dev->pdev->dev, req->src_sgt.sgl, req->nr_src,
+				    DMA_BIDIRECTIONAL);
+	if (!req->src_nents) {
+		ret = -EIO;
+		goto fail;
+	}
+
+	sge = req->buf->vaddr;
+	memset(&d, 0, sizeof(d));
+	d.src = cpu_to_le64(req->buf->dma);
+	d.src_nsg = cpu_to_le16(flip_sg_table(sge, &req->src_sgt, req->src_nents));
+	d.len = cpu_to_le32(len);
+	d.flags = cpu_to_le16(FLIP_DESC_SG | FLIP_DESC_INPLACE | (ff->crc ? FLIP_DESC_CRC : 0));
+
+	/* the completion may run before we return */
+	flip_uring_pdu(ioucmd)->req = req;
+	if (req->polled)
+		ioucmd->flags |= IORING_URING_CMD_POLLED;
+
+	while (flip_ring_submit(dev, ff->class, req, &d) < 0) {
+		atomic64_inc(&dev->full_reqs);
+		if (nonblock) {
+			ioucmd->flags &= ~IORING_URING_CMD_POLLED;
+			ret = -EAGAIN;
+			goto fail;
+		}
+		wait_event(dev->read_wq, dev->ring.nr_inflight < FLIP_RING_SIZE - 1);
+	}
+
+	atomic64_inc(&dev->dev_reqs);
+	atomic64_add(len, &dev->dev_bytes);
+
+	flip_req_put(dev, req);
+	return -EIOCBQUEUED;
+
+fail:
+	flip_req_put(dev, req);
+	return ret;
+}
+
+/* IORING_SETUP_IOPOLL: reap the polled queue, or every queue without one */
+static int flip_uring_cmd_iopoll(struct io_uring_cmd *ioucmd, struct io_comp_batch *iob,
+				 unsigned int poll_flags)
+{
+	struct flip_file *ff = ioucmd->file->private_data;
+	struct flip_ring *ring = &ff->dev->ring;
+
+	if (ring->poll_cq >= 0)
+		return flip_cq_complete(ff->dev, &ring->cq[ring->poll_cq]);
+
+	return flip_ring_complete(ff->dev);
+}
+#endif
+
 static struct file_operations flip_char_ops = {
 	.owner = THIS_MODULE,
 	.read = flip_char_read,
 	.write = flip_char_write,
+	.poll = flip_char_poll,
+	.splice_write = flip_char_splice_write,
+	.splice_read = flip_char_splice_read,
+#ifdef FLIP_URING
+	.uring_cmd = flip_uring_cmd,
+	.uring_cmd_iopoll = flip_uring_cmd_iopoll,
+#endif
 	.unlocked_ioctl = flip_char_ioctl,
 	.open = flip_char_open,
 	.release = flip_char_close,
@@ -359,7 +3299,8 @@ static int __init flip_pci_init(void)
 	int ret = 0;
 	dev_t dev = MKDEV(flip_char_major, 0);
 
-	int devno;
+	int devno, i;
+	void *buf;
 
 
 	printk(KERN_INFO "pci-flip init!\n");
@@ -381,9 +3322,27 @@ static int __init flip_pci_init(void)
 	}
 
 	memset(flip_char_dev, 0, sizeof(struct flip_char));
-	sema_init(&flip_char_dev->sem, 1);
-	if ((ret = flip_fifo_init(&flip_char_dev->fifo_out)) < 0)
+	spin_lock_init(&flip_char_dev->fifo_lock);
+	init_waitqueue_head(&flip_char_dev->drain_wq);
+	init_waitqueue_head(&flip_char_dev->read_wq);
+	flip_char_dev->conf = FLIP_CONF_UP;
+	for (i = 0; i < FLIP_LUT_LEN; i++)
+		flip_char_dev->lut[i] = i;
+	mutex_init(&flip_char_dev->lut_mutex);
+	mutex_init(&flip_char_dev->port_mutex);
+	flip_char_dev->cpu_threshold = FLIP_CPU_THRESHOLD;
+	buf = vmalloc(FLIP_FIFO_OUT_LEN);
+	if (!buf) {
+		ret = -ENOMEM;
 		goto fail_mem;
+	}
+	flip_char_dev->fifo_buf = buf;
+	kfifo_init(&flip_char_dev->fifo_out, buf, FLIP_FIFO_OUT_LEN);
+	flip_char_dev->pcpu = alloc_percpu(struct flip_pcpu);
+	if (!flip_char_dev->pcpu) {
+		ret = -ENOMEM;
+		goto fail_pcpu;
+	}
 
 	
 	devno = MKDEV(flip_char_major,0);
@@ -398,7 +3357,10 @@ static int __init flip_pci_init(void)
 	return pci_register_driver(&flip_pci_driver);
 
 fail_cdev:
-	flip_fifo_destroy(&flip_char_dev->fifo_out);
+	free_percpu(flip_char_dev->pcpu);
+
+fail_pcpu:
+	vfree(buf);
 
 fail_mem:
 	kfree(flip_char_dev);
@@ -412,6 +3374,8 @@ static void __exit flip_pci_exit(void)
 {
 	pci_unregister_driver(&flip_pci_driver);
 	cdev_del(&flip_char_dev->cdev);
+	vfree(flip_char_dev->fifo_buf);
+	free_percpu(flip_char_dev->pcpu);
 	kfree(flip_char_dev);
 
 	unregister_chrdev_region(MKDEV(flip_char_major,0), 1);
@@ -0,0 +1,179 @@
+/*
+ * flip_perf_init: /init of the initramfs tools/flip_perf.py boots
+ *
+ * Loads /flip_pci.ko, runs /flip_bench once per queue depth and powers
+ * the guest off.  The matrix comes from the kernel command line:
+ *
+ *   flipperf.sizes=16,4096 flipperf.depths=1,8 flipperf.iters=1000 flipperf.dir=0
+ *
+ * Output goes to the console between "@@flip-perf" marker lines, the
+ * host NUMA node the device converted on last.  The initramfs holds
+ * nothing else, so build it static.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/reboot.h>
+#include <sys/wait.h>
+
+#define FLIP_MODULE "/flip_pci.ko"
+#define FLIP_BENCH  "/flip_bench"
+#define FLIP_CHRDEV "flip-char"      /* as in /proc/devices, see load_flip.sh */
+#define FLIP_STATS  "/sys/kernel/debug/pci-flip/stats"
+
+static char sizes[256] = "16,256,4096,65536,1048576";
+static char depths[128] = "1";
+static char iters[16] = "1000";
+static char dir[8] = "0";
+static char extra[128];              /* more flip_bench options, ':' for ' ' */
+
+static void cmdline_opt(const char *tok, const char *key, char *val, size_t len)
+{
+	size_t n = strlen(key);
+
+	if (!strncmp(tok, key, n) && tok[n] == '=')
+		snprintf(val, len, "%s", tok + n + 1);
+}
+
+static void cmdline_read(void)
+{
+	char buf[1024], *tok, *p;
+	FILE *fp;
+
+	fp = fopen("/proc/cmdline", "r");
+	if (!fp)
+		return;
+	if (!fgets(buf, sizeof(buf), fp))
+		buf[0] = 0;
+	fclose(fp);
+
+	for (tok = strtok(buf, " \n"); tok; tok = strtok(NULL, " \n")) {
+		cmdline_opt(tok, "flipperf.sizes", sizes, sizeof(sizes));
+		cmdline_opt(tok, "flipperf.depths", depths, sizeof(depths));
+		cmdline_opt(tok, "flipperf.iters", iters, sizeof(iters));
+		cmdline_opt(tok, "flipperf.dir", dir, sizeof(dir));
+		cmdline_opt(tok, "flipperf.extra", extra, sizeof(extra));
+	}
+
+	for (p = extra; *p; p++)
+		if (*p == ':')
+			*p = ' ';
+}
+
+static int module_load(void)
+{
+	char line[128], name[64];
+	FILE *fp;
+	int fd, major = -1;
+
+	fd = open(FLIP_MODULE, O_RDONLY);
+	if (fd < 0 || syscall(SYS_finit_module, fd, "", 0) < 0) {
+		perror("@@flip-perf error: " FLIP_MODULE);
+		return -1;
+	}
+	close(fd);
+
+	fp = fopen("/proc/devices", "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%d %63s", &fd, name) == 2 && !strcmp(name, FLIP_CHRDEV))
+			major = fd;
+	fclose(fp);
+
+	if (major < 0 || mknod("/dev/flip0", S_IFCHR | 0666, makedev(major, 0)) < 0) {
+		printf("@@flip-perf error: no " FLIP_CHRDEV " device\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench_run(const char *depth)
+{
+	char opts[sizeof(extra)], *argv[32];
+	char *tok;
+	int argc = 0, status;
+	pid_t pid;
+
+	argv[argc++] = FLIP_BENCH;
+	argv[argc++] = "-s";
+	argv[argc++] = sizes;
+	argv[argc++] = "-n";
+	argv[argc++] = iters;
+	argv[argc++] = "-d";
+	argv[argc++] = dir;
+	argv[argc++] = "-q";
+	argv[argc++] = (char *)depth;
+	snprintf(opts, sizeof(opts), "%s", extra);
+	for (tok = strtok(opts, " "); tok && argc < 31; tok = strtok(NULL, " "))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+
+	printf("@@flip-perf depth=%s\n", depth);
+	fflush(stdout);
+
+	pid = fork();
+	if (pid == 0) {
+		execv(FLIP_BENCH, argv);
+		perror("@@flip-perf error: " FLIP_BENCH);
+		_exit(1);
+	}
+	if (pid > 0)
+		waitpid(pid, &status, 0);
+}
+
+/* the host_node line of the driver's stats, revision 11 devices */
+static void placement_show(void)
+{
+	char line[128];
+	FILE *fp;
+	int node;
+
+	if (mount("debugfs", "/sys/kernel/debug", "debugfs", 0, NULL) < 0 && errno != EBUSY)
+		return;
+
+	fp = fopen(FLIP_STATS, "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "host_node: %d", &node) == 1)
+			printf("@@flip-perf host_node=%d\n", node);
+	fclose(fp);
+}
+
+int main(void)
+{
+	char list[sizeof(depths)], *tok, *save;
+
+	mount("proc", "/proc", "proc", 0, NULL);
+	mount("sysfs", "/sys", "sysfs", 0, NULL);
+	mount("devtmpfs", "/dev", "devtmpfs", 0, NULL);
+
+	cmdline_read();
+	printf("@@flip-perf begin\n");
+
+	if (module_load() == 0) {
+		/* bench_run uses strtok, walk the depths with strtok_r */
+		snprintf(list, sizeof(list), "%s", depths);
+		for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+			bench_run(tok);
+		placement_show();
+	}
+
+	printf("@@flip-perf end\n");
+	fflush(stdout);
+	sync();
+	reboot(RB_POWER_OFF);
+
+	return 0;
+}
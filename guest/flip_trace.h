@@ -0,0 +1,142 @@
+/*
+ * static tracepoints of the pci-flip driver, under events/flip in tracefs.
+ * Disabled they cost a patched-out branch each.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM flip
+
+#if !defined(_FLIP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FLIP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* a descriptor took a tag, before the doorbell */
+TRACE_EVENT(flip_submit,
+	TP_PROTO(u16 tag, int sq, int cq, u32 len),
+	TP_ARGS(tag, sq, cq, len),
+
+	TP_STRUCT__entry(
+		__field(u16, tag)
+		__field(int, sq)
+		__field(int, cq)
+		__field(u32, len)
+	),
+
+	TP_fast_assign(
+		__entry->tag = tag;
+		__entry->sq = sq;
+		__entry->cq = cq;
+		__entry->len = len;
+	),
+
+	TP_printk("tag=%u sq=%d cq=%d len=%u",
+		  __entry->tag, __entry->sq, __entry->cq, __entry->len)
+);
+
+/* submission queue doorbell */
+TRACE_EVENT(flip_kick,
+	TP_PROTO(int sq, unsigned int tail),
+	TP_ARGS(sq, tail),
+
+	TP_STRUCT__entry(
+		__field(int, sq)
+		__field(unsigned int, tail)
+	),
+
+	TP_fast_assign(
+		__entry->sq = sq;
+		__entry->tail = tail;
+	),
+
+	TP_printk("sq=%d tail=%u", __entry->sq, __entry->tail)
+);
+
+/* interrupt of a completion queue, 0 also on the shared line */
+TRACE_EVENT(flip_irq,
+	TP_PROTO(int irq, int cq),
+	TP_ARGS(irq, cq),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+		__field(int, cq)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+		__entry->cq = cq;
+	),
+
+	TP_printk("irq=%d cq=%d", __entry->irq, __entry->cq)
+);
+
+/* completion entry reaped, progress ones included */
+TRACE_EVENT(flip_complete,
+	TP_PROTO(u16 tag, int cq, u16 status, u32 len, s64 lat_ns),
+	TP_ARGS(tag, cq, status, len, lat_ns),
+
+	TP_STRUCT__entry(
+		__field(u16, tag)
+		__field(int, cq)
+		__field(u16, status)
+		__field(u32, len)
+		__field(s64, lat_ns)
+	),
+
+	TP_fast_assign(
+		__entry->tag = tag;
+		__entry->cq = cq;
+		__entry->status = status;
+		__entry->len = len;
+		__entry->lat_ns = lat_ns;
+	),
+
+	TP_printk("tag=%u cq=%d status=%u len=%u lat_ns=%lld",
+		  __entry->tag, __entry->cq, __entry->status, __entry->len,
+		  (long long)__entry->lat_ns)
+);
+
+/* read() woke up to a completed request */
+TRACE_EVENT(flip_read_wake,
+	TP_PROTO(size_t len, s64 wake_ns),
+	TP_ARGS(len, wake_ns),
+
+	TP_STRUCT__entry(
+		__field(size_t, len)
+		__field(s64, wake_ns)
+	),
+
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->wake_ns = wake_ns;
+	),
+
+	TP_printk("len=%zu wake_ns=%lld", __entry->len, (long long)__entry->wake_ns)
+);
+
+/* port output dropped, nobody reads it */
+TRACE_EVENT(flip_fifo_overflow,
+	TP_PROTO(unsigned int len, unsigned int dropped),
+	TP_ARGS(len, dropped),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, len)
+		__field(unsigned int, dropped)
+	),
+
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("len=%u dropped=%u", __entry->len, __entry->dropped)
+);
+
+#endif /* _FLIP_TRACE_H */
+
+/* outside the guard, define_trace.h reads it again */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE flip_trace
+#include <trace/define_trace.h>
@@ -2,26 +2,64 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <ctype.h>
 #include <sys/ioctl.h>
 
 
 #define FLIP_CONF_UP   0x0
 #define FLIP_CONF_LOW  0x1
+#define FLIP_CONF_LUT  0x2
+#define FLIP_CONF_UTF8_UP  0x3
+#define FLIP_CONF_UTF8_LOW 0x4
 #define FLIP_IN_EMPTY  (0x1 << 1)
 #define FLIP_OUT_EMPTY (0x1 << 2)
 
 #define FLIP_IO  0xF4
+#define FLIP_LUT_LEN   256
+
 #define FLIP_CMD_DIR  _IOW(FLIP_IO, 1, int)
+#define FLIP_CMD_LUT  _IOW(FLIP_IO, 2, unsigned char[FLIP_LUT_LEN])
 
 #define DEFAULT_BUF_SIZE 1024
 
 #define FLIP_DEV "/dev/flip0"
 
 
+/* table from a 256 byte file, rot13 when no file is given */
+static int load_table(unsigned char *lut, const char *file)
+{
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < FLIP_LUT_LEN; i++) {
+		lut[i] = i;
+		if (i >= 'a' && i <= 'z')
+			lut[i] = 'a' + (i - 'a' + 13) % 26;
+		else if (i >= 'A' && i <= 'Z')
+			lut[i] = 'A' + (i - 'A' + 13) % 26;
+	}
+
+	if (!file)
+		return 0;
+
+	if (!(fp = fopen(file, "rb"))) {
+		printf("can not open '%s'!\n", file);
+		return -1;
+	}
+	if (fread(lut, 1, FLIP_LUT_LEN, fp) != FLIP_LUT_LEN) {
+		printf("'%s' must hold %d bytes!\n", file, FLIP_LUT_LEN);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
+	unsigned char lut[FLIP_LUT_LEN];
 	int dir;
 	int fd;
 	int ret;
@@ -29,9 +67,11 @@ int main(int argc, char *argv[])
 	char *p;
 
 	if (argc < 2) {
-		printf("usage: flip_ioctl < 0 | 1 >\n");
+		printf("usage: flip_ioctl < 0 | 1 | 2 [table] | 3 | 4 >\n");
 		printf("       '0': turn to upper case\n");
 		printf("       '1': turn to lower case\n");
+		printf("       '2': translate through a 256 byte table file, rot13 by default\n");
+		printf("       '3', '4': upper and lower case of UTF-8 text, bus-master only\n");
 		exit(0);
 	}
 
@@ -44,11 +84,14 @@ int main(int argc, char *argv[])
 	}
 
 	dir = atoi(argv[1]);
-	if (dir != 0 && dir != 1) {
-		printf("arguments can only be '0' or '1'!\n");
+	if (dir < FLIP_CONF_UP || dir > FLIP_CONF_UTF8_LOW) {
+		printf("arguments can only be '0' to '4'!\n");
 		exit(0);
 	}
 
+	if (dir == FLIP_CONF_LUT && load_table(lut, argc > 2 ? argv[2] : NULL) < 0)
+		exit(0);
+
 	
 	if ((fd = open(FLIP_DEV, O_RDWR)) < 0) {
 		printf("can not open '/dev/flip0', make sure it exist!\n");
@@ -57,7 +100,18 @@ int main(int argc, char *argv[])
 
 
 
-	printf("set flip direction to %s\n", dir & 1 ? "lower" : "upper");
+	if (dir == FLIP_CONF_LUT) {
+		ret = ioctl(fd, FLIP_CMD_LUT, lut);
+		if (ret < 0) {
+			perror("table load failed!\n");
+			close(fd);
+			return ret;
+		}
+	}
+
+	printf("set flip direction to %s\n",
+	       dir == FLIP_CONF_LUT ? "table" : dir == FLIP_CONF_UTF8_UP ? "UTF-8 upper"
+	       : dir == FLIP_CONF_UTF8_LOW ? "UTF-8 lower" : dir & 1 ? "lower" : "upper");
 	ret = ioctl(fd, FLIP_CMD_DIR, &dir);
 
 	if (ret < 0) 
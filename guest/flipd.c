@@ -0,0 +1,427 @@
+/*
+ * flipd: coalesce many small conversion requests onto /dev/flip0
+ *
+ * Every write()/read() pair on the device costs a syscall, a doorbell,
+ * an interrupt and a wakeup, whatever the size.  flipd takes requests
+ * from its clients (see flipd.h), appends them to one buffer and hands
+ * the buffer to the device in a single write when it is full or when
+ * the oldest request has waited for the latency budget.  The device
+ * converts byte by byte in order, so each client's slice of the output
+ * is its answer.
+ *
+ * Only over the bus-master interface: the port path drops NUL bytes
+ * and its read() does not wait for the output, either would shift the
+ * slices, so flipd refuses a port-only device.
+ *
+ *   flipd [-s socket] [-D device] [-d 0|1|2] [-t table] [-l budget_us] [-B batch]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "flipd.h"
+
+#define FLIP_CONF_UP   0x0
+#define FLIP_CONF_LOW  0x1
+#define FLIP_CONF_LUT  0x2
+
+#define FLIP_LUT_LEN   256
+
+#define FLIP_IO  0xF4
+#define FLIP_CMD_DIR  _IOW(FLIP_IO, 1, int)
+#define FLIP_CMD_LUT  _IOW(FLIP_IO, 2, unsigned char[FLIP_LUT_LEN])
+#define FLIP_CMD_BUSY_POLL  _IOW(FLIP_IO, 8, int)
+
+#define FLIP_DEV "/dev/flip0"
+
+#define FLIPD_MAX_CLIENTS  1024               /* fds beyond this are refused */
+#define FLIPD_MAX_PENDING  4096               /* requests per batch */
+
+#define EV_LISTEN  (-1)
+#define EV_TIMER   (-2)
+
+/* a connection, gen tells a reused fd from the one a request came on */
+struct client {
+	int open;
+	unsigned int gen;
+	int queued;            /* requests in the current batch */
+};
+
+/* a request in the current batch, its bytes at off in the batch buffer */
+struct pending {
+	int fd;
+	unsigned int gen;
+	uint32_t id;
+	uint32_t off;
+	uint32_t len;
+};
+
+static struct client clients[FLIPD_MAX_CLIENTS];
+static struct pending pend[FLIPD_MAX_PENDING];
+static int npend;
+static char *batch_in, *batch_out;
+static size_t batch_len, batch_max = 256 << 10;
+static long budget_us = 200;
+static int dev_fd, timer_fd, ep;
+static int nr_clients, nr_waiting;  /* connected, with a request in the batch */
+
+/* what the batches looked like */
+static unsigned long long st_reqs, st_bytes, st_flushes, st_full, st_timeout, st_waiting, st_dropped;
+static volatile sig_atomic_t stop;
+
+static void usage(void)
+{
+	printf("usage: flipd [-s socket] [-D device] [-d 0|1|2] [-t table] [-l budget_us] [-B batch]\n");
+	printf("       -s: listen here, default " FLIPD_SOCK "\n");
+	printf("       -D: device, default " FLIP_DEV "\n");
+	printf("       -d: '0' upper case, '1' lower case, '2' through the table\n");
+	printf("       -t: file with the %d byte table for -d 2\n", FLIP_LUT_LEN);
+	printf("       -l: longest a request waits for its batch to fill, default 200 us\n");
+	printf("       -B: bytes per device submission, default 256K\n");
+	exit(0);
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int read_full(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void timer_set(long us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = us % 1000000 * 1000;
+	timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+static void client_drop(int fd)
+{
+	epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	if (clients[fd].queued)
+		nr_waiting--;
+	clients[fd].open = 0;
+	clients[fd].queued = 0;
+	clients[fd].gen++;
+	nr_clients--;
+}
+
+static int respond(int fd, uint32_t id, int status, const char *data, uint32_t len)
+{
+	struct flipd_resp r;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	r.id = id;
+	r.status = status;
+	r.len = status ? 0 : len;
+	r.rsvd = 0;
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = r.len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	/* a client that does not read its answers must not stall the others */
+	return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/* one device round trip for the whole batch, then every client its slice */
+static void flush(void)
+{
+	struct pending *p;
+	int status = 0, i;
+
+	if (!npend)
+		return;
+
+	timer_set(0);
+
+	if (write_full(dev_fd, batch_in, batch_len) < 0
+	    || read_full(dev_fd, batch_out, batch_len) < 0) {
+		perror("device");
+		status = -EIO;
+	}
+
+	for (i = 0; i < npend; i++) {
+		p = &pend[i];
+		if (!clients[p->fd].open || clients[p->fd].gen != p->gen)
+			continue;
+		clients[p->fd].queued = 0;
+		if (respond(p->fd, p->id, status, batch_out + p->off, p->len) < 0) {
+			st_dropped++;
+			client_drop(p->fd);
+		}
+	}
+
+	st_flushes++;
+	nr_waiting = 0;
+	npend = 0;
+	batch_len = 0;
+}
+
+/* take every request the client has queued */
+static void client_read(int fd)
+{
+	struct flipd_req r;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	for (;;) {
+		/* room for a request of any size, or submit what we have */
+		if (batch_max - batch_len < FLIPD_MAX_REQ || npend == FLIPD_MAX_PENDING) {
+			st_full++;
+			flush();
+		}
+
+		iov[0].iov_base = &r;
+		iov[0].iov_len = sizeof(r);
+		iov[1].iov_base = batch_in + batch_len;
+		iov[1].iov_len = FLIPD_MAX_REQ;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+
+		n = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n <= 0) {
+			client_drop(fd);
+			return;
+		}
+
+		n -= sizeof(r);
+		if (n < 0 || (msg.msg_flags & MSG_TRUNC) || r.len != (uint32_t)n) {
+			if (respond(fd, n < 0 ? 0 : r.id, -EINVAL, NULL, 0) < 0) {
+				client_drop(fd);
+				return;
+			}
+			continue;
+		}
+
+		/* the first request of a batch starts the clock */
+		if (!npend)
+			timer_set(budget_us > 0 ? budget_us : 1);
+
+		pend[npend].fd = fd;
+		pend[npend].gen = clients[fd].gen;
+		pend[npend].id = r.id;
+		pend[npend].off = batch_len;
+		pend[npend].len = n;
+		npend++;
+		if (!clients[fd].queued++)
+			nr_waiting++;
+		batch_len += n;
+		st_reqs++;
+		st_bytes += n;
+	}
+}
+
+static void client_accept(int lsock)
+{
+	struct epoll_event ev;
+	int fd;
+
+	while ((fd = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (fd >= FLIPD_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		clients[fd].open = 1;
+		nr_clients++;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *sock_path = FLIPD_SOCK, *dev_path = FLIP_DEV, *table = NULL;
+	unsigned char lut[FLIP_LUT_LEN];
+	struct epoll_event ev, evs[64];
+	struct sockaddr_un sa;
+	uint64_t expired;
+	int dir = FLIP_CONF_UP, busy_poll = 0;
+	int lsock, opt, n, i, fd;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "s:D:d:t:l:B:h")) != -1) {
+		switch (opt) {
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'D':
+			dev_path = optarg;
+			break;
+		case 'd':
+			dir = atoi(optarg);
+			if (dir < FLIP_CONF_UP || dir > FLIP_CONF_LUT)
+				usage();
+			break;
+		case 't':
+			table = optarg;
+			break;
+		case 'l':
+			budget_us = atol(optarg);
+			break;
+		case 'B':
+			batch_max = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (batch_max < FLIPD_MAX_REQ || (dir == FLIP_CONF_LUT && !table))
+		usage();
+
+	dev_fd = open(dev_path, O_RDWR);
+	if (dev_fd < 0) {
+		printf("can not open '%s', make sure it exist!\n", dev_path);
+		exit(1);
+	}
+
+	/* the default, ENODEV without the bus-master interface */
+	if (ioctl(dev_fd, FLIP_CMD_BUSY_POLL, &busy_poll) < 0 && errno == ENODEV) {
+		printf("'%s' has no bus-master interface, flipd needs it!\n", dev_path);
+		exit(1);
+	}
+
+	if (dir == FLIP_CONF_LUT) {
+		fp = fopen(table, "rb");
+		if (!fp || fread(lut, 1, FLIP_LUT_LEN, fp) != FLIP_LUT_LEN
+		    || ioctl(dev_fd, FLIP_CMD_LUT, lut) < 0) {
+			printf("can not load table '%s'!\n", table);
+			exit(1);
+		}
+		fclose(fp);
+	}
+	if (ioctl(dev_fd, FLIP_CMD_DIR, &dir) < 0)
+		perror("ioctl failed!\n");
+
+	batch_in = malloc(batch_max);
+	batch_out = malloc(batch_max);
+	if (!batch_in || !batch_out) {
+		printf("out of memory!\n");
+		exit(1);
+	}
+
+	lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", sock_path);
+	unlink(sa.sun_path);
+	if (lsock < 0 || bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) < 0
+	    || listen(lsock, 128) < 0) {
+		printf("can not listen on '%s'!\n", sock_path);
+		exit(1);
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = EV_LISTEN;
+	epoll_ctl(ep, EPOLL_CTL_ADD, lsock, &ev);
+	ev.data.fd = EV_TIMER;
+	epoll_ctl(ep, EPOLL_CTL_ADD, timer_fd, &ev);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		n = epoll_wait(ep, evs, 64, -1);
+		for (i = 0; i < n; i++) {
+			fd = evs[i].data.fd;
+			if (fd == EV_LISTEN) {
+				client_accept(lsock);
+			} else if (fd == EV_TIMER) {
+				if (read(timer_fd, &expired, sizeof(expired)) > 0 && npend) {
+					st_timeout++;
+					flush();
+				}
+			} else if (clients[fd].open) {
+				client_read(fd);
+			}
+		}
+
+		/*
+		 * nobody can add to the batch when every client waits for an
+		 * answer, as synchronous clients do: no point in waiting out
+		 * the budget.  A batch that can not take another request of
+		 * any size goes now as well.
+		 */
+		if (npend && nr_waiting == nr_clients) {
+			st_waiting++;
+			flush();
+		} else if (npend && (batch_max - batch_len < FLIPD_MAX_REQ
+				     || npend == FLIPD_MAX_PENDING)) {
+			st_full++;
+			flush();
+		}
+	}
+
+	flush();
+
+	printf("%llu requests, %llu bytes, %llu submissions, %.2f requests each\n",
+	       st_reqs, st_bytes, st_flushes, st_flushes ? (double)st_reqs / st_flushes : 0.0);
+	printf("%llu full, %llu at the latency budget, %llu with every client waiting\n",
+	       st_full, st_timeout, st_waiting);
+	printf("%llu answers dropped\n", st_dropped);
+
+	unlink(sa.sun_path);
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * flipd, the guest conversion daemon, and its client library
+ *
+ * Clients send requests over a SOCK_SEQPACKET unix socket, one message
+ * per request: a struct flipd_req followed by len bytes.  The daemon
+ * packs requests from all clients into one large device submission,
+ * waiting at most its latency budget for the batch to fill, and sends
+ * each client a struct flipd_resp followed by its converted bytes.
+ * Responses to one client come back in the order of its requests.
+ */
+
+#ifndef FLIPD_H
+#define FLIPD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FLIPD_SOCK     "/var/run/flipd.sock"
+#define FLIPD_MAX_REQ  (64 << 10)            /* bytes per request */
+
+struct flipd_req {
+	uint32_t id;           /* echoed back in the response */
+	uint32_t len;          /* bytes following */
+};
+
+struct flipd_resp {
+	uint32_t id;
+	int32_t status;        /* 0, or a negative errno */
+	uint32_t len;          /* bytes following */
+	uint32_t rsvd;
+};
+
+/* connect to the daemon, path NULL for FLIPD_SOCK; fd or -1 */
+int flipd_connect(const char *path);
+void flipd_close(int fd);
+
+/* queue a request, several may be in flight; 0 or -1 */
+int flipd_submit(int fd, uint32_t id, const void *in, size_t len);
+
+/* next response: converted bytes in out, -1 on error, *id of the request */
+ssize_t flipd_reap(int fd, uint32_t *id, void *out, size_t len);
+
+/* one request, waiting for its answer */
+ssize_t flipd_convert(int fd, const void *in, void *out, size_t len);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * client library of flipd, see flipd.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "flipd.h"
+
+int flipd_connect(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path ? path : FLIPD_SOCK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void flipd_close(int fd)
+{
+	close(fd);
+}
+
+int flipd_submit(int fd, uint32_t id, const void *in, size_t len)
+{
+	struct flipd_req r;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	if (len > FLIPD_MAX_REQ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	r.id = id;
+	r.len = len;
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void *)in;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	do {
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+
+	return n == (ssize_t)(sizeof(r) + len) ? 0 : -1;
+}
+
+ssize_t flipd_reap(int fd, uint32_t *id, void *out, size_t len)
+{
+	struct flipd_resp r;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = out;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	do {
+		n = recvmsg(fd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < (ssize_t)sizeof(r)) {
+		if (n >= 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+	if (msg.msg_flags & MSG_TRUNC) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (r.status < 0) {
+		errno = -r.status;
+		return -1;
+	}
+
+	if (id)
+		*id = r.id;
+	return n - sizeof(r);
+}
+
+ssize_t flipd_convert(int fd, const void *in, void *out, size_t len)
+{
+	if (flipd_submit(fd, 0, in, len) < 0)
+		return -1;
+
+	return flipd_reap(fd, NULL, out, len);
+}
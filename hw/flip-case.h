@@ -0,0 +1,513 @@
+/*
+ * unicode case tables of the UTF-8 modes, Unicode 14.0.0
+ *
+ * generated by tools/gen_case_table.py, do not edit
+ */
+
+#ifndef HW_FLIP_CASE_H
+#define HW_FLIP_CASE_H
+
+/* code points first, first + stride, ... len of them map to cp + delta */
+typedef struct FLIPCaseRange {
+	uint32_t first;
+	uint16_t len;
+	uint8_t stride;
+	int32_t delta;
+} FLIPCaseRange;
+
+/* a code point whose mapping is several code points, as UTF-8 */
+typedef struct FLIPCaseSpecial {
+	uint32_t cp;
+	uint8_t len;
+	char out[3 * 4];
+} FLIPCaseSpecial;
+
+static const FLIPCaseRange flip_case_upper_ranges[] = {
+	{ 0x000b5,     1, 1,     743 },
+	{ 0x000e0,    23, 1,     -32 },
+	{ 0x000f8,     7, 1,     -32 },
+	{ 0x000ff,     1, 1,     121 },
+	{ 0x00101,    24, 2,      -1 },
+	{ 0x00131,     1, 1,    -232 },
+	{ 0x00133,     3, 2,      -1 },
+	{ 0x0013a,     8, 2,      -1 },
+	{ 0x0014b,    23, 2,      -1 },
+	{ 0x0017a,     3, 2,      -1 },
+	{ 0x0017f,     1, 1,    -300 },
+	{ 0x00180,     1, 1,     195 },
+	{ 0x00183,     2, 2,      -1 },
+	{ 0x00188,     1, 1,      -1 },
+	{ 0x0018c,     1, 1,      -1 },
+	{ 0x00192,     1, 1,      -1 },
+	{ 0x00195,     1, 1,      97 },
+	{ 0x00199,     1, 1,      -1 },
+	{ 0x0019a,     1, 1,     163 },
+	{ 0x0019e,     1, 1,     130 },
+	{ 0x001a1,     3, 2,      -1 },
+	{ 0x001a8,     1, 1,      -1 },
+	{ 0x001ad,     1, 1,      -1 },
+	{ 0x001b0,     1, 1,      -1 },
+	{ 0x001b4,     2, 2,      -1 },
+	{ 0x001b9,     1, 1,      -1 },
+	{ 0x001bd,     1, 1,      -1 },
+	{ 0x001bf,     1, 1,      56 },
+	{ 0x001c5,     1, 1,      -1 },
+	{ 0x001c6,     1, 1,      -2 },
+	{ 0x001c8,     1, 1,      -1 },
+	{ 0x001c9,     1, 1,      -2 },
+	{ 0x001cb,     1, 1,      -1 },
+	{ 0x001cc,     1, 1,      -2 },
+	{ 0x001ce,     8, 2,      -1 },
+	{ 0x001dd,     1, 1,     -79 },
+	{ 0x001df,     9, 2,      -1 },
+	{ 0x001f2,     1, 1,      -1 },
+	{ 0x001f3,     1, 1,      -2 },
+	{ 0x001f5,     1, 1,      -1 },
+	{ 0x001f9,    20, 2,      -1 },
+	{ 0x00223,     9, 2,      -1 },
+	{ 0x0023c,     1, 1,      -1 },
+	{ 0x0023f,     2, 1,   10815 },
+	{ 0x00242,     1, 1,      -1 },
+	{ 0x00247,     5, 2,      -1 },
+	{ 0x00250,     1, 1,   10783 },
+	{ 0x00251,     1, 1,   10780 },
+	{ 0x00252,     1, 1,   10782 },
+	{ 0x00253,     1, 1,    -210 },
+	{ 0x00254,     1, 1,    -206 },
+	{ 0x00256,     2, 1,    -205 },
+	{ 0x00259,     1, 1,    -202 },
+	{ 0x0025b,     1, 1,    -203 },
+	{ 0x0025c,     1, 1,   42319 },
+	{ 0x00260,     1, 1,    -205 },
+	{ 0x00261,     1, 1,   42315 },
+	{ 0x00263,     1, 1,    -207 },
+	{ 0x00265,     1, 1,   42280 },
+	{ 0x00266,     1, 1,   42308 },
+	{ 0x00268,     1, 1,    -209 },
+	{ 0x00269,     1, 1,    -211 },
+	{ 0x0026a,     1, 1,   42308 },
+	{ 0x0026b,     1, 1,   10743 },
+	{ 0x0026c,     1, 1,   42305 },
+	{ 0x0026f,     1, 1,    -211 },
+	{ 0x00271,     1, 1,   10749 },
+	{ 0x00272,     1, 1,    -213 },
+	{ 0x00275,     1, 1,    -214 },
+	{ 0x0027d,     1, 1,   10727 },
+	{ 0x00280,     1, 1,    -218 },
+	{ 0x00282,     1, 1,   42307 },
+	{ 0x00283,     1, 1,    -218 },
+	{ 0x00287,     1, 1,   42282 },
+	{ 0x00288,     1, 1,    -218 },
+	{ 0x00289,     1, 1,     -69 },
+	{ 0x0028a,     2, 1,    -217 },
+	{ 0x0028c,     1, 1,     -71 },
+	{ 0x00292,     1, 1,    -219 },
+	{ 0x0029d,     1, 1,   42261 },
+	{ 0x0029e,     1, 1,   42258 },
+	{ 0x00345,     1, 1,      84 },
+	{ 0x00371,     2, 2,      -1 },
+	{ 0x00377,     1, 1,      -1 },
+	{ 0x0037b,     3, 1,     130 },
+	{ 0x003ac,     1, 1,     -38 },
+	{ 0x003ad,     3, 1,     -37 },
+	{ 0x003b1,    17, 1,     -32 },
+	{ 0x003c2,     1, 1,     -31 },
+	{ 0x003c3,     9, 1,     -32 },
+	{ 0x003cc,     1, 1,     -64 },
+	{ 0x003cd,     2, 1,     -63 },
+	{ 0x003d0,     1, 1,     -62 },
+	{ 0x003d1,     1, 1,     -57 },
+	{ 0x003d5,     1, 1,     -47 },
+	{ 0x003d6,     1, 1,     -54 },
+	{ 0x003d7,     1, 1,      -8 },
+	{ 0x003d9,    12, 2,      -1 },
+	{ 0x003f0,     1, 1,     -86 },
+	{ 0x003f1,     1, 1,     -80 },
+	{ 0x003f2,     1, 1,       7 },
+	{ 0x003f3,     1, 1,    -116 },
+	{ 0x003f5,     1, 1,     -96 },
+	{ 0x003f8,     1, 1,      -1 },
+	{ 0x003fb,     1, 1,      -1 },
+	{ 0x00430,    32, 1,     -32 },
+	{ 0x00450,    16, 1,     -80 },
+	{ 0x00461,    17, 2,      -1 },
+	{ 0x0048b,    27, 2,      -1 },
+	{ 0x004c2,     7, 2,      -1 },
+	{ 0x004cf,     1, 1,     -15 },
+	{ 0x004d1,    48, 2,      -1 },
+	{ 0x00561,    38, 1,     -48 },
+	{ 0x010d0,    43, 1,    3008 },
+	{ 0x010fd,     3, 1,    3008 },
+	{ 0x013f8,     6, 1,      -8 },
+	{ 0x01c80,     1, 1,   -6254 },
+	{ 0x01c81,     1, 1,   -6253 },
+	{ 0x01c82,     1, 1,   -6244 },
+	{ 0x01c83,     2, 1,   -6242 },
+	{ 0x01c85,     1, 1,   -6243 },
+	{ 0x01c86,     1, 1,   -6236 },
+	{ 0x01c87,     1, 1,   -6181 },
+	{ 0x01c88,     1, 1,   35266 },
+	{ 0x01d79,     1, 1,   35332 },
+	{ 0x01d7d,     1, 1,    3814 },
+	{ 0x01d8e,     1, 1,   35384 },
+	{ 0x01e01,    75, 2,      -1 },
+	{ 0x01e9b,     1, 1,     -59 },
+	{ 0x01ea1,    48, 2,      -1 },
+	{ 0x01f00,     8, 1,       8 },
+	{ 0x01f10,     6, 1,       8 },
+	{ 0x01f20,     8, 1,       8 },
+	{ 0x01f30,     8, 1,       8 },
+	{ 0x01f40,     6, 1,       8 },
+	{ 0x01f51,     4, 2,       8 },
+	{ 0x01f60,     8, 1,       8 },
+	{ 0x01f70,     2, 1,      74 },
+	{ 0x01f72,     4, 1,      86 },
+	{ 0x01f76,     2, 1,     100 },
+	{ 0x01f78,     2, 1,     128 },
+	{ 0x01f7a,     2, 1,     112 },
+	{ 0x01f7c,     2, 1,     126 },
+	{ 0x01fb0,     2, 1,       8 },
+	{ 0x01fbe,     1, 1,   -7205 },
+	{ 0x01fd0,     2, 1,       8 },
+	{ 0x01fe0,     2, 1,       8 },
+	{ 0x01fe5,     1, 1,       7 },
+	{ 0x0214e,     1, 1,     -28 },
+	{ 0x02170,    16, 1,     -16 },
+	{ 0x02184,     1, 1,      -1 },
+	{ 0x024d0,    26, 1,     -26 },
+	{ 0x02c30,    48, 1,     -48 },
+	{ 0x02c61,     1, 1,      -1 },
+	{ 0x02c65,     1, 1,  -10795 },
+	{ 0x02c66,     1, 1,  -10792 },
+	{ 0x02c68,     3, 2,      -1 },
+	{ 0x02c73,     1, 1,      -1 },
+	{ 0x02c76,     1, 1,      -1 },
+	{ 0x02c81,    50, 2,      -1 },
+	{ 0x02cec,     2, 2,      -1 },
+	{ 0x02cf3,     1, 1,      -1 },
+	{ 0x02d00,    38, 1,   -7264 },
+	{ 0x02d27,     1, 1,   -7264 },
+	{ 0x02d2d,     1, 1,   -7264 },
+	{ 0x0a641,    23, 2,      -1 },
+	{ 0x0a681,    14, 2,      -1 },
+	{ 0x0a723,     7, 2,      -1 },
+	{ 0x0a733,    31, 2,      -1 },
+	{ 0x0a77a,     2, 2,      -1 },
+	{ 0x0a77f,     5, 2,      -1 },
+	{ 0x0a78c,     1, 1,      -1 },
+	{ 0x0a791,     2, 2,      -1 },
+	{ 0x0a794,     1, 1,      48 },
+	{ 0x0a797,    10, 2,      -1 },
+	{ 0x0a7b5,     8, 2,      -1 },
+	{ 0x0a7c8,     2, 2,      -1 },
+	{ 0x0a7d1,     1, 1,      -1 },
+	{ 0x0a7d7,     2, 2,      -1 },
+	{ 0x0a7f6,     1, 1,      -1 },
+	{ 0x0ab53,     1, 1,    -928 },
+	{ 0x0ab70,    80, 1,  -38864 },
+	{ 0x0ff41,    26, 1,     -32 },
+	{ 0x10428,    40, 1,     -40 },
+	{ 0x104d8,    36, 1,     -40 },
+	{ 0x10597,    11, 1,     -39 },
+	{ 0x105a3,    15, 1,     -39 },
+	{ 0x105b3,     7, 1,     -39 },
+	{ 0x105bb,     2, 1,     -39 },
+	{ 0x10cc0,    51, 1,     -64 },
+	{ 0x118c0,    32, 1,     -32 },
+	{ 0x16e60,    32, 1,     -32 },
+	{ 0x1e922,    34, 1,     -34 },
+};
+
+static const FLIPCaseSpecial flip_case_upper_special[] = {
+	{ 0x000df, 2, "\x53\x53" },
+	{ 0x00149, 3, "\xca\xbc\x4e" },
+	{ 0x001f0, 3, "\x4a\xcc\x8c" },
+	{ 0x00390, 6, "\xce\x99\xcc\x88\xcc\x81" },
+	{ 0x003b0, 6, "\xce\xa5\xcc\x88\xcc\x81" },
+	{ 0x00587, 4, "\xd4\xb5\xd5\x92" },
+	{ 0x01e96, 3, "\x48\xcc\xb1" },
+	{ 0x01e97, 3, "\x54\xcc\x88" },
+	{ 0x01e98, 3, "\x57\xcc\x8a" },
+	{ 0x01e99, 3, "\x59\xcc\x8a" },
+	{ 0x01e9a, 3, "\x41\xca\xbe" },
+	{ 0x01f50, 4, "\xce\xa5\xcc\x93" },
+	{ 0x01f52, 6, "\xce\xa5\xcc\x93\xcc\x80" },
+	{ 0x01f54, 6, "\xce\xa5\xcc\x93\xcc\x81" },
+	{ 0x01f56, 6, "\xce\xa5\xcc\x93\xcd\x82" },
+	{ 0x01f80, 5, "\xe1\xbc\x88\xce\x99" },
+	{ 0x01f81, 5, "\xe1\xbc\x89\xce\x99" },
+	{ 0x01f82, 5, "\xe1\xbc\x8a\xce\x99" },
+	{ 0x01f83, 5, "\xe1\xbc\x8b\xce\x99" },
+	{ 0x01f84, 5, "\xe1\xbc\x8c\xce\x99" },
+	{ 0x01f85, 5, "\xe1\xbc\x8d\xce\x99" },
+	{ 0x01f86, 5, "\xe1\xbc\x8e\xce\x99" },
+	{ 0x01f87, 5, "\xe1\xbc\x8f\xce\x99" },
+	{ 0x01f88, 5, "\xe1\xbc\x88\xce\x99" },
+	{ 0x01f89, 5, "\xe1\xbc\x89\xce\x99" },
+	{ 0x01f8a, 5, "\xe1\xbc\x8a\xce\x99" },
+	{ 0x01f8b, 5, "\xe1\xbc\x8b\xce\x99" },
+	{ 0x01f8c, 5, "\xe1\xbc\x8c\xce\x99" },
+	{ 0x01f8d, 5, "\xe1\xbc\x8d\xce\x99" },
+	{ 0x01f8e, 5, "\xe1\xbc\x8e\xce\x99" },
+	{ 0x01f8f, 5, "\xe1\xbc\x8f\xce\x99" },
+	{ 0x01f90, 5, "\xe1\xbc\xa8\xce\x99" },
+	{ 0x01f91, 5, "\xe1\xbc\xa9\xce\x99" },
+	{ 0x01f92, 5, "\xe1\xbc\xaa\xce\x99" },
+	{ 0x01f93, 5, "\xe1\xbc\xab\xce\x99" },
+	{ 0x01f94, 5, "\xe1\xbc\xac\xce\x99" },
+	{ 0x01f95, 5, "\xe1\xbc\xad\xce\x99" },
+	{ 0x01f96, 5, "\xe1\xbc\xae\xce\x99" },
+	{ 0x01f97, 5, "\xe1\xbc\xaf\xce\x99" },
+	{ 0x01f98, 5, "\xe1\xbc\xa8\xce\x99" },
+	{ 0x01f99, 5, "\xe1\xbc\xa9\xce\x99" },
+	{ 0x01f9a, 5, "\xe1\xbc\xaa\xce\x99" },
+	{ 0x01f9b, 5, "\xe1\xbc\xab\xce\x99" },
+	{ 0x01f9c, 5, "\xe1\xbc\xac\xce\x99" },
+	{ 0x01f9d, 5, "\xe1\xbc\xad\xce\x99" },
+	{ 0x01f9e, 5, "\xe1\xbc\xae\xce\x99" },
+	{ 0x01f9f, 5, "\xe1\xbc\xaf\xce\x99" },
+	{ 0x01fa0, 5, "\xe1\xbd\xa8\xce\x99" },
+	{ 0x01fa1, 5, "\xe1\xbd\xa9\xce\x99" },
+	{ 0x01fa2, 5, "\xe1\xbd\xaa\xce\x99" },
+	{ 0x01fa3, 5, "\xe1\xbd\xab\xce\x99" },
+	{ 0x01fa4, 5, "\xe1\xbd\xac\xce\x99" },
+	{ 0x01fa5, 5, "\xe1\xbd\xad\xce\x99" },
+	{ 0x01fa6, 5, "\xe1\xbd\xae\xce\x99" },
+	{ 0x01fa7, 5, "\xe1\xbd\xaf\xce\x99" },
+	{ 0x01fa8, 5, "\xe1\xbd\xa8\xce\x99" },
+	{ 0x01fa9, 5, "\xe1\xbd\xa9\xce\x99" },
+	{ 0x01faa, 5, "\xe1\xbd\xaa\xce\x99" },
+	{ 0x01fab, 5, "\xe1\xbd\xab\xce\x99" },
+	{ 0x01fac, 5, "\xe1\xbd\xac\xce\x99" },
+	{ 0x01fad, 5, "\xe1\xbd\xad\xce\x99" },
+	{ 0x01fae, 5, "\xe1\xbd\xae\xce\x99" },
+	{ 0x01faf, 5, "\xe1\xbd\xaf\xce\x99" },
+	{ 0x01fb2, 5, "\xe1\xbe\xba\xce\x99" },
+	{ 0x01fb3, 4, "\xce\x91\xce\x99" },
+	{ 0x01fb4, 4, "\xce\x86\xce\x99" },
+	{ 0x01fb6, 4, "\xce\x91\xcd\x82" },
+	{ 0x01fb7, 6, "\xce\x91\xcd\x82\xce\x99" },
+	{ 0x01fbc, 4, "\xce\x91\xce\x99" },
+	{ 0x01fc2, 5, "\xe1\xbf\x8a\xce\x99" },
+	{ 0x01fc3, 4, "\xce\x97\xce\x99" },
+	{ 0x01fc4, 4, "\xce\x89\xce\x99" },
+	{ 0x01fc6, 4, "\xce\x97\xcd\x82" },
+	{ 0x01fc7, 6, "\xce\x97\xcd\x82\xce\x99" },
+	{ 0x01fcc, 4, "\xce\x97\xce\x99" },
+	{ 0x01fd2, 6, "\xce\x99\xcc\x88\xcc\x80" },
+	{ 0x01fd3, 6, "\xce\x99\xcc\x88\xcc\x81" },
+	{ 0x01fd6, 4, "\xce\x99\xcd\x82" },
+	{ 0x01fd7, 6, "\xce\x99\xcc\x88\xcd\x82" },
+	{ 0x01fe2, 6, "\xce\xa5\xcc\x88\xcc\x80" },
+	{ 0x01fe3, 6, "\xce\xa5\xcc\x88\xcc\x81" },
+	{ 0x01fe4, 4, "\xce\xa1\xcc\x93" },
+	{ 0x01fe6, 4, "\xce\xa5\xcd\x82" },
+	{ 0x01fe7, 6, "\xce\xa5\xcc\x88\xcd\x82" },
+	{ 0x01ff2, 5, "\xe1\xbf\xba\xce\x99" },
+	{ 0x01ff3, 4, "\xce\xa9\xce\x99" },
+	{ 0x01ff4, 4, "\xce\x8f\xce\x99" },
+	{ 0x01ff6, 4, "\xce\xa9\xcd\x82" },
+	{ 0x01ff7, 6, "\xce\xa9\xcd\x82\xce\x99" },
+	{ 0x01ffc, 4, "\xce\xa9\xce\x99" },
+	{ 0x0fb00, 2, "\x46\x46" },
+	{ 0x0fb01, 2, "\x46\x49" },
+	{ 0x0fb02, 2, "\x46\x4c" },
+	{ 0x0fb03, 3, "\x46\x46\x49" },
+	{ 0x0fb04, 3, "\x46\x46\x4c" },
+	{ 0x0fb05, 2, "\x53\x54" },
+	{ 0x0fb06, 2, "\x53\x54" },
+	{ 0x0fb13, 4, "\xd5\x84\xd5\x86" },
+	{ 0x0fb14, 4, "\xd5\x84\xd4\xb5" },
+	{ 0x0fb15, 4, "\xd5\x84\xd4\xbb" },
+	{ 0x0fb16, 4, "\xd5\x8e\xd5\x86" },
+	{ 0x0fb17, 4, "\xd5\x84\xd4\xbd" },
+};
+
+static const FLIPCaseRange flip_case_lower_ranges[] = {
+	{ 0x000c0,    23, 1,      32 },
+	{ 0x000d8,     7, 1,      32 },
+	{ 0x00100,    24, 2,       1 },
+	{ 0x00132,     3, 2,       1 },
+	{ 0x00139,     8, 2,       1 },
+	{ 0x0014a,    23, 2,       1 },
+	{ 0x00178,     1, 1,    -121 },
+	{ 0x00179,     3, 2,       1 },
+	{ 0x00181,     1, 1,     210 },
+	{ 0x00182,     2, 2,       1 },
+	{ 0x00186,     1, 1,     206 },
+	{ 0x00187,     1, 1,       1 },
+	{ 0x00189,     2, 1,     205 },
+	{ 0x0018b,     1, 1,       1 },
+	{ 0x0018e,     1, 1,      79 },
+	{ 0x0018f,     1, 1,     202 },
+	{ 0x00190,     1, 1,     203 },
+	{ 0x00191,     1, 1,       1 },
+	{ 0x00193,     1, 1,     205 },
+	{ 0x00194,     1, 1,     207 },
+	{ 0x00196,     1, 1,     211 },
+	{ 0x00197,     1, 1,     209 },
+	{ 0x00198,     1, 1,       1 },
+	{ 0x0019c,     1, 1,     211 },
+	{ 0x0019d,     1, 1,     213 },
+	{ 0x0019f,     1, 1,     214 },
+	{ 0x001a0,     3, 2,       1 },
+	{ 0x001a6,     1, 1,     218 },
+	{ 0x001a7,     1, 1,       1 },
+	{ 0x001a9,     1, 1,     218 },
+	{ 0x001ac,     1, 1,       1 },
+	{ 0x001ae,     1, 1,     218 },
+	{ 0x001af,     1, 1,       1 },
+	{ 0x001b1,     2, 1,     217 },
+	{ 0x001b3,     2, 2,       1 },
+	{ 0x001b7,     1, 1,     219 },
+	{ 0x001b8,     1, 1,       1 },
+	{ 0x001bc,     1, 1,       1 },
+	{ 0x001c4,     1, 1,       2 },
+	{ 0x001c5,     1, 1,       1 },
+	{ 0x001c7,     1, 1,       2 },
+	{ 0x001c8,     1, 1,       1 },
+	{ 0x001ca,     1, 1,       2 },
+	{ 0x001cb,     9, 2,       1 },
+	{ 0x001de,     9, 2,       1 },
+	{ 0x001f1,     1, 1,       2 },
+	{ 0x001f2,     2, 2,       1 },
+	{ 0x001f6,     1, 1,     -97 },
+	{ 0x001f7,     1, 1,     -56 },
+	{ 0x001f8,    20, 2,       1 },
+	{ 0x00220,     1, 1,    -130 },
+	{ 0x00222,     9, 2,       1 },
+	{ 0x0023a,     1, 1,   10795 },
+	{ 0x0023b,     1, 1,       1 },
+	{ 0x0023d,     1, 1,    -163 },
+	{ 0x0023e,     1, 1,   10792 },
+	{ 0x00241,     1, 1,       1 },
+	{ 0x00243,     1, 1,    -195 },
+	{ 0x00244,     1, 1,      69 },
+	{ 0x00245,     1, 1,      71 },
+	{ 0x00246,     5, 2,       1 },
+	{ 0x00370,     2, 2,       1 },
+	{ 0x00376,     1, 1,       1 },
+	{ 0x0037f,     1, 1,     116 },
+	{ 0x00386,     1, 1,      38 },
+	{ 0x00388,     3, 1,      37 },
+	{ 0x0038c,     1, 1,      64 },
+	{ 0x0038e,     2, 1,      63 },
+	{ 0x00391,    17, 1,      32 },
+	{ 0x003a3,     9, 1,      32 },
+	{ 0x003cf,     1, 1,       8 },
+	{ 0x003d8,    12, 2,       1 },
+	{ 0x003f4,     1, 1,     -60 },
+	{ 0x003f7,     1, 1,       1 },
+	{ 0x003f9,     1, 1,      -7 },
+	{ 0x003fa,     1, 1,       1 },
+	{ 0x003fd,     3, 1,    -130 },
+	{ 0x00400,    16, 1,      80 },
+	{ 0x00410,    32, 1,      32 },
+	{ 0x00460,    17, 2,       1 },
+	{ 0x0048a,    27, 2,       1 },
+	{ 0x004c0,     1, 1,      15 },
+	{ 0x004c1,     7, 2,       1 },
+	{ 0x004d0,    48, 2,       1 },
+	{ 0x00531,    38, 1,      48 },
+	{ 0x010a0,    38, 1,    7264 },
+	{ 0x010c7,     1, 1,    7264 },
+	{ 0x010cd,     1, 1,    7264 },
+	{ 0x013a0,    80, 1,   38864 },
+	{ 0x013f0,     6, 1,       8 },
+	{ 0x01c90,    43, 1,   -3008 },
+	{ 0x01cbd,     3, 1,   -3008 },
+	{ 0x01e00,    75, 2,       1 },
+	{ 0x01e9e,     1, 1,   -7615 },
+	{ 0x01ea0,    48, 2,       1 },
+	{ 0x01f08,     8, 1,      -8 },
+	{ 0x01f18,     6, 1,      -8 },
+	{ 0x01f28,     8, 1,      -8 },
+	{ 0x01f38,     8, 1,      -8 },
+	{ 0x01f48,     6, 1,      -8 },
+	{ 0x01f59,     4, 2,      -8 },
+	{ 0x01f68,     8, 1,      -8 },
+	{ 0x01f88,     8, 1,      -8 },
+	{ 0x01f98,     8, 1,      -8 },
+	{ 0x01fa8,     8, 1,      -8 },
+	{ 0x01fb8,     2, 1,      -8 },
+	{ 0x01fba,     2, 1,     -74 },
+	{ 0x01fbc,     1, 1,      -9 },
+	{ 0x01fc8,     4, 1,     -86 },
+	{ 0x01fcc,     1, 1,      -9 },
+	{ 0x01fd8,     2, 1,      -8 },
+	{ 0x01fda,     2, 1,    -100 },
+	{ 0x01fe8,     2, 1,      -8 },
+	{ 0x01fea,     2, 1,    -112 },
+	{ 0x01fec,     1, 1,      -7 },
+	{ 0x01ff8,     2, 1,    -128 },
+	{ 0x01ffa,     2, 1,    -126 },
+	{ 0x01ffc,     1, 1,      -9 },
+	{ 0x02126,     1, 1,   -7517 },
+	{ 0x0212a,     1, 1,   -8383 },
+	{ 0x0212b,     1, 1,   -8262 },
+	{ 0x02132,     1, 1,      28 },
+	{ 0x02160,    16, 1,      16 },
+	{ 0x02183,     1, 1,       1 },
+	{ 0x024b6,    26, 1,      26 },
+	{ 0x02c00,    48, 1,      48 },
+	{ 0x02c60,     1, 1,       1 },
+	{ 0x02c62,     1, 1,  -10743 },
+	{ 0x02c63,     1, 1,   -3814 },
+	{ 0x02c64,     1, 1,  -10727 },
+	{ 0x02c67,     3, 2,       1 },
+	{ 0x02c6d,     1, 1,  -10780 },
+	{ 0x02c6e,     1, 1,  -10749 },
+	{ 0x02c6f,     1, 1,  -10783 },
+	{ 0x02c70,     1, 1,  -10782 },
+	{ 0x02c72,     1, 1,       1 },
+	{ 0x02c75,     1, 1,       1 },
+	{ 0x02c7e,     2, 1,  -10815 },
+	{ 0x02c80,    50, 2,       1 },
+	{ 0x02ceb,     2, 2,       1 },
+	{ 0x02cf2,     1, 1,       1 },
+	{ 0x0a640,    23, 2,       1 },
+	{ 0x0a680,    14, 2,       1 },
+	{ 0x0a722,     7, 2,       1 },
+	{ 0x0a732,    31, 2,       1 },
+	{ 0x0a779,     2, 2,       1 },
+	{ 0x0a77d,     1, 1,  -35332 },
+	{ 0x0a77e,     5, 2,       1 },
+	{ 0x0a78b,     1, 1,       1 },
+	{ 0x0a78d,     1, 1,  -42280 },
+	{ 0x0a790,     2, 2,       1 },
+	{ 0x0a796,    10, 2,       1 },
+	{ 0x0a7aa,     1, 1,  -42308 },
+	{ 0x0a7ab,     1, 1,  -42319 },
+	{ 0x0a7ac,     1, 1,  -42315 },
+	{ 0x0a7ad,     1, 1,  -42305 },
+	{ 0x0a7ae,     1, 1,  -42308 },
+	{ 0x0a7b0,     1, 1,  -42258 },
+	{ 0x0a7b1,     1, 1,  -42282 },
+	{ 0x0a7b2,     1, 1,  -42261 },
+	{ 0x0a7b3,     1, 1,     928 },
+	{ 0x0a7b4,     8, 2,       1 },
+	{ 0x0a7c4,     1, 1,     -48 },
+	{ 0x0a7c5,     1, 1,  -42307 },
+	{ 0x0a7c6,     1, 1,  -35384 },
+	{ 0x0a7c7,     2, 2,       1 },
+	{ 0x0a7d0,     1, 1,       1 },
+	{ 0x0a7d6,     2, 2,       1 },
+	{ 0x0a7f5,     1, 1,       1 },
+	{ 0x0ff21,    26, 1,      32 },
+	{ 0x10400,    40, 1,      40 },
+	{ 0x104b0,    36, 1,      40 },
+	{ 0x10570,    11, 1,      39 },
+	{ 0x1057c,    15, 1,      39 },
+	{ 0x1058c,     7, 1,      39 },
+	{ 0x10594,     2, 1,      39 },
+	{ 0x10c80,    51, 1,      64 },
+	{ 0x118a0,    32, 1,      32 },
+	{ 0x16e40,    32, 1,      32 },
+	{ 0x1e900,    34, 1,      34 },
+};
+
+static const FLIPCaseSpecial flip_case_lower_special[] = {
+	{ 0x00130, 3, "\x69\xcc\x87" },
+};
+
+#endif
@@ -0,0 +1,516 @@
+#include <string.h>
+
+#include "flip-conv.h"
+#include "flip-case.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FLIP_CONV_X86
+#endif
+
+/* convert the character for [a-zA-Z], leave other alone */
+void flip_conv_case(uint8_t *dst, const uint8_t *src, size_t len, int conf)
+{
+	size_t i;
+	int step;
+
+	if (conf == FLIP_CONF_UP)
+		step = -32;
+	else
+		step = 32;
+
+	for (i = 0; i < len; i++) {
+		if (((src[i] >= 65 && src[i] <= 90) && step > 0)
+		    || ((src[i] >= 97 && src[i] <= 122) && step < 0))
+			dst[i] = src[i] + step;
+		else
+			dst[i] = src[i];
+	}
+}
+
+static void flip_conv_lut_c(uint8_t *dst, const uint8_t *src, size_t len,
+			    const uint8_t *lut)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = lut[src[i]];
+}
+
+#ifdef FLIP_CONV_X86
+
+/*
+ * nibble split lookup: the table is 16 rows of 16 bytes, one row per
+ * high nibble.  pshufb looks up the low nibble in every row, and the
+ * row whose number matches the high nibble is kept.
+ */
+__attribute__((target("ssse3")))
+static void flip_conv_lut_ssse3(uint8_t *dst, const uint8_t *src, size_t len,
+				const uint8_t *lut)
+{
+	const __m128i nib = _mm_set1_epi8(0x0f);
+	__m128i row[16];
+	__m128i v, lo, hi, r;
+	size_t i;
+	int h;
+
+	for (h = 0; h < 16; h++)
+		row[h] = _mm_loadu_si128((const __m128i *)(lut + h * 16));
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_and_si128(v, nib);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+		r = _mm_setzero_si128();
+		for (h = 0; h < 16; h++)
+			r = _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi8(hi, _mm_set1_epi8(h)),
+							  _mm_shuffle_epi8(row[h], lo)));
+		_mm_storeu_si128((__m128i *)(dst + i), r);
+	}
+
+	flip_conv_lut_c(dst + i, src + i, len - i, lut);
+}
+
+/* same on 32 bytes, vpshufb works per 128 bit lane so each row is doubled */
+__attribute__((target("avx2")))
+static void flip_conv_lut_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+			       const uint8_t *lut)
+{
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	__m256i row[16];
+	__m256i v, lo, hi, r;
+	size_t i;
+	int h;
+
+	for (h = 0; h < 16; h++)
+		row[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lut + h * 16)));
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		lo = _mm256_and_si256(v, nib);
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+		r = _mm256_setzero_si256();
+		for (h = 0; h < 16; h++)
+			r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpeq_epi8(hi, _mm256_set1_epi8(h)),
+								_mm256_shuffle_epi8(row[h], lo)));
+		_mm256_storeu_si256((__m256i *)(dst + i), r);
+	}
+
+	flip_conv_lut_ssse3(dst + i, src + i, len - i, lut);
+}
+
+#endif
+
+typedef void (*flip_lut_fn)(uint8_t *, const uint8_t *, size_t, const uint8_t *);
+
+/* picked on first use from what the host cpu supports */
+static flip_lut_fn flip_lut_impl;
+
+static flip_lut_fn flip_conv_lut_select(void)
+{
+#ifdef FLIP_CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return flip_conv_lut_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return flip_conv_lut_ssse3;
+#endif
+	return flip_conv_lut_c;
+}
+
+void flip_conv_lut(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *lut)
+{
+	if (!flip_lut_impl)
+		flip_lut_impl = flip_conv_lut_select();
+
+	flip_lut_impl(dst, src, len, lut);
+}
+
+void flip_conv(uint8_t *dst, const uint8_t *src, size_t len, int conf,
+	       const uint8_t *lut)
+{
+	if (conf == FLIP_CONF_LUT)
+		flip_conv_lut(dst, src, len, lut);
+	else if (conf == FLIP_CONF_UTF8_UP)
+		flip_conv_case(dst, src, len, FLIP_CONF_UP);
+	else if (conf == FLIP_CONF_UTF8_LOW)
+		flip_conv_case(dst, src, len, FLIP_CONF_LOW);
+	else
+		flip_conv_case(dst, src, len, conf);
+}
+
+/* UTF-8 modes */
+
+#define FLIP_UTF8_BLOCK 32                    /* bytes the table path takes before the fast path is tried again */
+
+#define FLIP_NR(a) (sizeof(a) / sizeof((a)[0]))
+
+static inline uint8_t flip_ascii_case(uint8_t c, int upper)
+{
+	if (upper)
+		return c >= 'a' && c <= 'z' ? c - 32 : c;
+	return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+/*
+ * the fast paths convert whole blocks of ASCII and return how many
+ * bytes that was, stopping at the first block with a byte above 0x7f.
+ * Eight bytes at a time in a word: a byte below 0x80 has its top bit
+ * set after adding 0x80 - c exactly when it is c or above.
+ */
+static size_t flip_utf8_ascii_c(uint8_t *dst, const uint8_t *src, size_t len, int upper)
+{
+	const uint64_t ones = 0x0101010101010101ULL, top = ones << 7;
+	uint64_t ge_first = ones * (0x80 - (upper ? 'a' : 'A'));
+	uint64_t gt_last = ones * (0x80 - (upper ? 'z' : 'Z') - 1);
+	uint64_t w, m;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, src + i, 8);
+		if (w & top)
+			break;
+		m = (w + ge_first) & ~(w + gt_last) & top;
+		w ^= m >> 2;
+		memcpy(dst + i, &w, 8);
+	}
+
+	return i;
+}
+
+#ifdef FLIP_CONV_X86
+
+/* bytes are below 0x80, the signed compares are fine */
+__attribute__((target("avx2")))
+static inline __m256i flip_case_avx2(__m256i v, __m256i first, __m256i last)
+{
+	__m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(v, first), _mm256_cmpgt_epi8(last, v));
+
+	return _mm256_xor_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(0x20)));
+}
+
+/* 64 bytes a round, then a last try on 32 where the 64 had a multibyte sequence */
+__attribute__((target("avx2")))
+static size_t flip_utf8_ascii_avx2(uint8_t *dst, const uint8_t *src, size_t len, int upper)
+{
+	const __m256i first = _mm256_set1_epi8(upper ? 'a' - 1 : 'A' - 1);
+	const __m256i last = _mm256_set1_epi8(upper ? 'z' + 1 : 'Z' + 1);
+	__m256i a, b;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		a = _mm256_loadu_si256((const __m256i *)(src + i));
+		b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+		if (_mm256_movemask_epi8(_mm256_or_si256(a, b)))
+			break;
+		_mm256_storeu_si256((__m256i *)(dst + i), flip_case_avx2(a, first, last));
+		_mm256_storeu_si256((__m256i *)(dst + i + 32), flip_case_avx2(b, first, last));
+	}
+
+	if (i + 32 <= len) {
+		a = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (!_mm256_movemask_epi8(a)) {
+			_mm256_storeu_si256((__m256i *)(dst + i), flip_case_avx2(a, first, last));
+			i += 32;
+		}
+	}
+
+	return i;
+}
+
+#endif
+
+typedef size_t (*flip_ascii_fn)(uint8_t *, const uint8_t *, size_t, int);
+
+static flip_ascii_fn flip_ascii_impl;
+
+static flip_ascii_fn flip_utf8_ascii_select(void)
+{
+#ifdef FLIP_CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return flip_utf8_ascii_avx2;
+#endif
+	return flip_utf8_ascii_c;
+}
+
+/* length of a sequence led by c, 0 if c can not lead one */
+static int flip_utf8_seq_len(uint8_t c)
+{
+	if (c >= 0xc2 && c <= 0xdf)
+		return 2;
+	if (c >= 0xe0 && c <= 0xef)
+		return 3;
+	if (c >= 0xf0 && c <= 0xf4)
+		return 4;
+	return 0;
+}
+
+/* the second byte also rules out overlong forms, surrogates and above U+10FFFF */
+static int flip_utf8_second_ok(uint8_t lead, uint8_t c)
+{
+	switch (lead) {
+	case 0xe0:
+		return c >= 0xa0 && c <= 0xbf;
+	case 0xed:
+		return c >= 0x80 && c <= 0x9f;
+	case 0xf0:
+		return c >= 0x90 && c <= 0xbf;
+	case 0xf4:
+		return c >= 0x80 && c <= 0x8f;
+	default:
+		return c >= 0x80 && c <= 0xbf;
+	}
+}
+
+/* length of the sequence at s, 0 if it is invalid, -1 if it is cut by the end */
+static int flip_utf8_decode(const uint8_t *s, size_t avail, uint32_t *cp)
+{
+	int n = flip_utf8_seq_len(s[0]);
+	int i;
+
+	if (!n)
+		return 0;
+
+	for (i = 1; i < n; i++) {
+		if ((size_t)i == avail)
+			return -1;
+		if (i == 1 ? !flip_utf8_second_ok(s[0], s[1]) : (s[i] & 0xc0) != 0x80)
+			return 0;
+	}
+
+	*cp = s[0] & (0x7f >> n);
+	for (i = 1; i < n; i++)
+		*cp = *cp << 6 | (s[i] & 0x3f);
+
+	return n;
+}
+
+static int flip_utf8_encode(uint8_t *d, uint32_t cp)
+{
+	if (cp < 0x80) {
+		d[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		d[0] = 0xc0 | cp >> 6;
+		d[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		d[0] = 0xe0 | cp >> 12;
+		d[1] = 0x80 | (cp >> 6 & 0x3f);
+		d[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	d[0] = 0xf0 | cp >> 18;
+	d[1] = 0x80 | (cp >> 12 & 0x3f);
+	d[2] = 0x80 | (cp >> 6 & 0x3f);
+	d[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+/* write the mapping of a non-ASCII code point, returns its length */
+static int flip_case_map(uint8_t *d, uint32_t cp, int upper)
+{
+	const FLIPCaseRange *r = upper ? flip_case_upper_ranges : flip_case_lower_ranges;
+	const FLIPCaseSpecial *s = upper ? flip_case_upper_special : flip_case_lower_special;
+	size_t nr = upper ? FLIP_NR(flip_case_upper_ranges) : FLIP_NR(flip_case_lower_ranges);
+	size_t ns = upper ? FLIP_NR(flip_case_upper_special) : FLIP_NR(flip_case_lower_special);
+	size_t lo, hi, mid;
+	uint32_t off;
+
+	/* expansions first, they have no range */
+	for (lo = 0, hi = ns; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (s[mid].cp < cp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < ns && s[lo].cp == cp) {
+		memcpy(d, s[lo].out, s[lo].len);
+		return s[lo].len;
+	}
+
+	/* the last range starting at or before cp */
+	for (lo = 0, hi = nr; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (r[mid].first <= cp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo) {
+		r += lo - 1;
+		off = cp - r->first;
+		if (off % r->stride == 0 && off / r->stride < r->len)
+			cp += r->delta;
+	}
+
+	return flip_utf8_encode(d, cp);
+}
+
+size_t flip_conv_utf8(uint8_t *dst, const uint8_t *src, size_t len, int conf,
+		      int last, size_t *used)
+{
+	int upper = conf == FLIP_CONF_UTF8_UP;
+	size_t i = 0, o = 0, n, end;
+	uint32_t cp;
+	int k;
+
+	if (!flip_ascii_impl)
+		flip_ascii_impl = flip_utf8_ascii_select();
+
+	while (i < len) {
+		n = flip_ascii_impl(dst + o, src + i, len - i, upper);
+		i += n;
+		o += n;
+
+		/* a block with a multibyte sequence, or the tail, through the table */
+		end = len - i > FLIP_UTF8_BLOCK ? i + FLIP_UTF8_BLOCK : len;
+		while (i < end) {
+			if (src[i] < 0x80) {
+				dst[o++] = flip_ascii_case(src[i++], upper);
+				continue;
+			}
+			k = flip_utf8_decode(src + i, len - i, &cp);
+			if (k < 0 && !last)
+				goto out;
+			if (k <= 0) {
+				dst[o++] = src[i++];
+				continue;
+			}
+			o += flip_case_map(dst + o, cp, upper);
+			i += k;
+		}
+	}
+
+out:
+	if (used)
+		*used = i;
+	return o;
+}
+
+/* reflected crc32c (Castagnoli) polynomial */
+#define FLIP_CRC32C_POLY 0x82f63b78
+
+/* byte at a time table of FLIP_CRC32C_POLY, const so the workers share it */
+static const uint32_t flip_crc_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+	0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+	0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+	0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+	0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+	0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+	0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+	0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+	0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+	0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+	0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+	0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+	0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+	0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+	0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+	0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+	0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+	0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+	0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+	0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+	0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+	0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint32_t flip_crc32c_c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	while (len--)
+		crc = flip_crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef FLIP_CONV_X86
+
+/* the crc32 instruction computes exactly crc32c */
+__attribute__((target("sse4.2")))
+static uint32_t flip_crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t w;
+#ifdef __x86_64__
+	uint64_t c = crc, v;
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+#endif
+
+	for (; len >= 4; len -= 4, buf += 4) {
+		memcpy(&w, buf, 4);
+		crc = _mm_crc32_u32(crc, w);
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+
+	return crc;
+}
+
+#endif
+
+typedef uint32_t (*flip_crc_fn)(uint32_t, const uint8_t *, size_t);
+
+static flip_crc_fn flip_crc_impl;
+
+static flip_crc_fn flip_crc32c_select(void)
+{
+#ifdef FLIP_CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		return flip_crc32c_sse42;
+#endif
+	return flip_crc32c_c;
+}
+
+uint32_t flip_crc32c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	if (!flip_crc_impl)
+		flip_crc_impl = flip_crc32c_select();
+
+	return flip_crc_impl(crc, buf, len);
+}
+
+uint32_t flip_conv_crc(uint8_t *dst, const uint8_t *src, size_t len, int conf,
+		       const uint8_t *lut, uint32_t crc)
+{
+	size_t n;
+
+	for (; len; len -= n, dst += n, src += n) {
+		n = len < FLIP_CONV_BLOCK ? len : FLIP_CONV_BLOCK;
+		flip_conv(dst, src, n, conf, lut);
+		crc = flip_crc32c(crc, dst, n);
+	}
+
+	return crc;
+}
@@ -0,0 +1,60 @@
+/*
+ * conversion kernels of the flip device
+ *
+ * Plain C with no QEMU dependency, so tools can run the same code
+ * the device does.
+ */
+
+#ifndef HW_FLIP_CONV_H
+#define HW_FLIP_CONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLIP_CONF_UP   0x0                    /* flip upper case */
+#define FLIP_CONF_LOW  0x1                    /* flip lower case */
+#define FLIP_CONF_LUT  0x2                    /* translate through the loaded table */
+#define FLIP_CONF_UTF8_UP  0x3                /* unicode upper case of UTF-8 text */
+#define FLIP_CONF_UTF8_LOW 0x4                /* unicode lower case of UTF-8 text */
+
+#define FLIP_LUT_LEN   256                    /* one entry per byte value */
+
+#define FLIP_CONV_BLOCK 4096                  /* fused convert and checksum step */
+
+#define FLIP_UTF8_GROWTH 3                    /* UTF-8 output is at most this times the input */
+#define FLIP_UTF8_SEQ    4                    /* longest UTF-8 sequence */
+
+#define flip_conf_utf8(conf) ((conf) == FLIP_CONF_UTF8_UP || (conf) == FLIP_CONF_UTF8_LOW)
+
+/* dst may equal src */
+void flip_conv_case(uint8_t *dst, const uint8_t *src, size_t len, int conf);
+void flip_conv_lut(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *lut);
+
+/*
+ * convert len bytes in the given mode, lut is only used by FLIP_CONF_LUT.
+ * Output is as long as the input, so the UTF-8 modes only convert ASCII
+ * here, see flip_conv_utf8 for the rest.
+ */
+void flip_conv(uint8_t *dst, const uint8_t *src, size_t len, int conf,
+	       const uint8_t *lut);
+
+/*
+ * UTF-8 modes, returns the bytes written to dst, which needs room for
+ * FLIP_UTF8_GROWTH * len.  A sequence cut by the end of src is left
+ * for the next call unless last, *used tells how much of src was taken.
+ * Invalid bytes are copied as they are.
+ */
+size_t flip_conv_utf8(uint8_t *dst, const uint8_t *src, size_t len, int conf,
+		      int last, size_t *used);
+
+/* crc32c update, no inversion: start with ~0 and invert the result */
+uint32_t flip_crc32c(uint32_t crc, const uint8_t *buf, size_t len);
+
+/*
+ * convert and checksum the output in one pass: each block is summed
+ * right after it is converted, while it is still in the cache
+ */
+uint32_t flip_conv_crc(uint8_t *dst, const uint8_t *src, size_t len, int conf,
+		       const uint8_t *lut, uint32_t crc);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * flip shared conversion service
+ *
+ * With -device pci-flip,server=<socket> the device does not convert
+ * itself.  tools/flip_server owns one shared memory region cut into
+ * per-VM slots; each device maps its slot as BAR 3, and the guest puts
+ * its rings and data straight into it.  Doorbells are eventfds: kick
+ * from the device to the server, done from the server to the device.
+ * Plain C so that tools can include it.
+ *
+ * Slot layout, offsets from the slot start:
+ *   0          FLIPShmRing
+ *   sq_off     entries FLIPShmDesc
+ *   cq_off     entries FLIPShmCompl
+ *   data_off   nbufs buffers of buf_size bytes, converted in place
+ *
+ * All fields are little endian.  The guest writes sq_tail and cq_head,
+ * the server sq_head and cq_tail; each index has a cache line of its
+ * own.  The server fills in the geometry when it hands out the slot.
+ */
+
+#ifndef HW_FLIP_SHM_H
+#define HW_FLIP_SHM_H
+
+#include <stdint.h>
+
+#define FLIP_SHM_MAGIC     0x504c4946        /* "FLIP" */
+#define FLIP_SHM_VERSION   1
+
+#define FLIP_SHM_BUF       (64 << 10)        /* default data buffer size */
+#define FLIP_SHM_MAX_BUFS  127               /* a buffer per tag, entries at most 128 */
+
+typedef struct FLIPShmRing {
+	uint32_t magic;        /* FLIP_SHM_MAGIC */
+	uint32_t version;      /* FLIP_SHM_VERSION */
+	uint32_t entries;      /* sq and cq entries, power of 2 */
+	uint32_t nbufs;        /* data buffers, less than entries */
+	uint32_t buf_size;     /* bytes per data buffer */
+	uint32_t sq_off;
+	uint32_t cq_off;
+	uint32_t data_off;
+	uint32_t slot;         /* slot number in the server */
+	uint32_t rsvd[7];
+	uint32_t sq_tail;      /* guest: next descriptor to fill */
+	uint32_t pad0[15];
+	uint32_t sq_head;      /* server: next descriptor to take */
+	uint32_t pad1[15];
+	uint32_t cq_tail;      /* server: next completion to fill */
+	uint32_t pad2[15];
+	uint32_t cq_head;      /* guest: next completion to consume */
+	uint32_t pad3[15];
+	uint64_t descs;        /* server: descriptors converted */
+	uint64_t bytes;        /* server: bytes converted */
+	uint64_t batches;      /* server: batches this slot took part in */
+	uint64_t rsvd2[5];
+	uint8_t lut[256];      /* FLIP_CONF_LUT table, written by the guest */
+} FLIPShmRing;
+
+/* submission entry, the data is converted in place */
+typedef struct FLIPShmDesc {
+	uint32_t buf;          /* data buffer index */
+	uint32_t len;          /* bytes to convert, at most buf_size */
+	uint16_t flags;        /* conversion mode and FLIP_DESC_CRC, as on BAR 1 */
+	uint16_t tag;          /* echoed back in the completion */
+	uint32_t rsvd;
+} FLIPShmDesc;
+
+/* completion entry, same layout as FLIPCompl */
+typedef struct FLIPShmCompl {
+	uint16_t tag;
+	uint16_t status;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t rsvd;
+} FLIPShmCompl;
+
+/*
+ * sent by the server on connect, with three descriptors attached
+ * (SCM_RIGHTS): the shared memory, the kick eventfd and the done
+ * eventfd.  The slot is freed when the connection closes.
+ */
+typedef struct FLIPShmHello {
+	uint32_t magic;        /* FLIP_SHM_MAGIC */
+	uint32_t version;      /* FLIP_SHM_VERSION */
+	uint32_t slot;
+	uint32_t rsvd;
+	uint64_t offset;       /* of the slot in the shared memory */
+	uint64_t size;         /* of the slot, a power of 2 */
+} FLIPShmHello;
+
+#endif
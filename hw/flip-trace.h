@@ -0,0 +1,50 @@
+/*
+ * flip device workload trace
+ *
+ * Written by the device when the trace property is set, read by
+ * tools/flip_replay.  Plain C so that tools can include it.
+ *
+ * A trace is a FLIPTraceHeader followed by FLIPTraceRec records.  All
+ * fields are little endian.  A record of a type marked "payload" is
+ * followed by len bytes of data.
+ */
+
+#ifndef HW_FLIP_TRACE_H
+#define HW_FLIP_TRACE_H
+
+#include <stdint.h>
+
+#define FLIP_TRACE_MAGIC    "FLIPTRC1"
+#define FLIP_TRACE_VERSION  1
+
+#define FLIP_TRACE_F_PAYLOAD  (0x1 << 0)     /* descriptors carry their source data */
+
+typedef struct FLIPTraceHeader {
+	char magic[8];         /* FLIP_TRACE_MAGIC */
+	uint32_t version;      /* FLIP_TRACE_VERSION */
+	uint32_t flags;        /* FLIP_TRACE_F_* */
+	uint64_t start_ns;     /* host realtime clock when capture began */
+	uint64_t rsvd;
+} FLIPTraceHeader;
+
+enum {
+	FLIP_TRACE_PIO_READ = 1,   /* addr: port offset, val: value read */
+	FLIP_TRACE_PIO_WRITE,      /* addr: port offset, val: value written */
+	FLIP_TRACE_MMIO_READ,      /* addr: BAR1 offset, val: value read */
+	FLIP_TRACE_MMIO_WRITE,     /* addr: BAR1 offset, val: value written */
+	FLIP_TRACE_DESC,           /* fetched: addr: tag, val: length, size: queue, payload */
+	FLIP_TRACE_COMPL,          /* posted: addr: tag, val: length, flags: status */
+	FLIP_TRACE_LUT,            /* table loaded, payload of FLIP_LUT_LEN bytes */
+};
+
+typedef struct FLIPTraceRec {
+	uint64_t ns;           /* since start_ns */
+	uint8_t type;          /* FLIP_TRACE_* */
+	uint8_t size;          /* access size in bytes, queue for descriptors */
+	uint16_t flags;        /* descriptor flags, completion status */
+	uint32_t len;          /* payload bytes following the record */
+	uint64_t addr;
+	uint64_t val;
+} FLIPTraceRec;
+
+#endif
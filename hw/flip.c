@@ -1,7 +1,21 @@
 #include "flip.h"
 
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "exec/address-spaces.h"
+#include "qapi/visitor.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "sysemu/kvm.h"
+#include "migration/migration.h"
+#include "hw/pci/msix.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#ifdef CONFIG_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
 
 /* pci vendor and device id, see docs/specs/pci-ids.txt */
 #define PCI_VENDOR_ID_REDHAT_QUMRANET 0x1af4  /* pci vendor id */
@@ -11,24 +25,371 @@
 #define FLIP_REG_STATE 0x1                    /* state register offset 1 */
 #define FLIP_REG_IN    0x2                    /* input buffer offset 2, lengh 4 bytes */
 #define FLIP_REG_OUT   0x2 + FLIP_REG_LEN     /* output buffer, also 4 bytes */
+#define FLIP_REG_ROOM  0xa                    /* 16 bits, bytes free in the input fifo, revision 7 */
+#define FLIP_REG_AVAIL 0xc                    /* 16 bits, bytes ready in the output fifo, revision 7 */
 
-#define FLIP_CONF_UP   0x0                    /* flip upper case */
-#define FLIP_CONF_LOW  0x1                    /* flip lower case */ 
 #define FLIP_IN_EMPTY  (0x1 << 1)             /* input buffer empty mask */
 #define FLIP_OUT_EMPTY (0x1 << 2)             /* output buffer emtpy mask */
 
+/* bus-master registers, BAR 1 */
+#define FLIP_DMA_CTRL      0x00               /* control */
+#define FLIP_DMA_ISR       0x04               /* interrupt status, read to clear */
+#define FLIP_DMA_RING_SIZE 0x08               /* descriptors per ring, power of 2 */
+#define FLIP_DMA_SQ_BASE   0x10               /* submission ring, lo at 0x10, hi at 0x14 */
+#define FLIP_DMA_CQ_BASE   0x18               /* completion ring, lo at 0x18, hi at 0x1c */
+#define FLIP_DMA_SQ_TAIL   0x20               /* doorbell */
+#define FLIP_DMA_SQ_HEAD   0x24               /* next descriptor the device fetches */
+#define FLIP_DMA_CQ_TAIL   0x28               /* next completion the device fills */
+#define FLIP_DMA_CQ_HEAD   0x2c               /* next completion the guest consumes */
+#define FLIP_DMA_STATS     0x30               /* stats page, lo at 0x30, hi at 0x34 */
+#define FLIP_DMA_LUT       0x38               /* table load, lo at 0x38, writing hi at 0x3c loads */
+#define FLIP_DMA_QUEUES    0x40               /* number of submission queues, read only */
+#define FLIP_DMA_SHM_KICK  0x44               /* server mode doorbell, write only */
+#define FLIP_DMA_CQS       0x48               /* number of completion queues, read only */
+#define FLIP_DMA_LUT_WIN   0x100              /* translation table window, FLIP_LUT_LEN bytes */
+#define FLIP_DMA_QUEUE     0x200              /* submission queue n at 0x200 + n * 0x20 */
+#define FLIP_DMA_QUEUE_SIZE 0x20
+#define FLIP_DMA_CQ        0x400              /* completion queue n at 0x400 + n * 0x20 */
+#define FLIP_DMA_CQ_SIZE   0x20
+
+/* registers in a submission queue block, queue 0 also at FLIP_DMA_SQ_* */
+#define FLIP_SQ_BASE       0x00               /* lo at 0x00, hi at 0x04 */
+#define FLIP_SQ_TAIL       0x08               /* doorbell */
+#define FLIP_SQ_HEAD       0x0c               /* next descriptor the device fetches */
+#define FLIP_SQ_PRIO       0x10               /* FLIP_PRIO_* */
+
+/* completion queue registers, relative to the queue */
+#define FLIP_CQ_BASE       0x00               /* lo at 0x00, hi at 0x04 */
+#define FLIP_CQ_TAIL       0x08               /* next completion the device fills */
+#define FLIP_CQ_HEAD       0x0c               /* next completion the guest consumes */
+#define FLIP_CQ_FLAGS      0x10               /* FLIP_CQ_*, revision 9 */
+
+#define FLIP_CQ_POLLED     (0x1 << 0)         /* no interrupt, the guest polls the tail */
+
+#define FLIP_PRIO_NORMAL   0
+#define FLIP_PRIO_HIGH     1                  /* served before any normal queue */
+
+#define FLIP_CTRL_ENABLE   (0x1 << 0)         /* rings are set up, start processing */
+#define FLIP_ISR_DMA       (0x1 << 0)         /* completions posted */
+#define FLIP_ISR_SHM       (0x1 << 1)         /* the server posted completions in BAR 3 */
+
+#define FLIP_DESC_CONF     0xf                /* conversion mode, FLIP_CONF_* */
+#define FLIP_DESC_SG       (0x1 << 4)         /* src/dst point to FLIPSge tables */
+#define FLIP_DESC_CRC      (0x1 << 5)         /* return crc32c of the output */
+#define FLIP_DESC_INPLACE  (0x1 << 6)         /* convert src in place, dst is ignored */
+
+#define FLIP_STS_OK        0x0
+#define FLIP_STS_ERR       0x1                /* bad descriptor or dma error */
+#define FLIP_STS_PROGRESS  0x2                /* len bytes converted so far, more to come */
+
 static void flip_callback(void *opaque);
+static void flip_dma_done(void *opaque);
+static void flip_dma_complete(FLIPState *f, bool post);
+
+static PCIDevice *flip_pci_dev(FLIPState *f)
+{
+	return &container_of(f, PCIFLIPState, state)->dev;
+}
+
+/* device IOTLB */
+
+/* the address space mappings come from, for their unmap */
+static AddressSpace *flip_dma_as(FLIPState *f)
+{
+	return f->iommu ? f->iotlb_as : pci_get_address_space(flip_pci_dev(f));
+}
+
+/* the translation of a page, asking the vIOMMU on a miss; NULL on a fault */
+static FLIPIotlbEntry *flip_iotlb_get(FLIPState *f, uint64_t iova, bool is_write)
+{
+	FLIPIotlbEntry *e = &f->iotlb[(iova >> FLIP_IOTLB_SHIFT) % FLIP_IOTLB_SIZE];
+	IOMMUTLBEntry t;
+
+	if (e->perm != IOMMU_NONE && (iova & ~e->mask) == e->iova) {
+		f->iotlb_hits++;
+		return e;
+	}
+
+	f->iotlb_misses++;
+	t = f->iommu->iommu_ops->translate(f->iommu, iova, is_write);
+	if (t.perm == IOMMU_NONE)
+		return NULL;
+
+	e->iova = t.iova & ~t.addr_mask;
+	e->addr = t.translated_addr & ~t.addr_mask;
+	e->mask = t.addr_mask;
+	e->perm = t.perm;
+	f->iotlb_as = t.target_as;
+
+	return e;
+}
+
+/*
+ * where a device address is for an access, *len is cut where its
+ * translation ends.  Without a vIOMMU the bus master address space
+ * does it all.  false on a fault.
+ */
+static bool flip_iova(FLIPState *f, uint64_t iova, uint32_t *len, bool is_write,
+		      AddressSpace **as, hwaddr *addr)
+{
+	PCIDevice *dev = flip_pci_dev(f);
+	FLIPIotlbEntry *e;
+
+	if (!f->iommu) {
+		*as = pci_get_address_space(dev);
+		*addr = iova;
+		return true;
+	}
+
+	/* translated accesses go around the bus master address space */
+	if (!(pci_get_word(dev->config + PCI_COMMAND) & PCI_COMMAND_MASTER))
+		return false;
+
+	e = flip_iotlb_get(f, iova, is_write);
+	if (!e || !(e->perm & (is_write ? IOMMU_WO : IOMMU_RO)))
+		return false;
+
+	*len = MIN(*len, (iova | e->mask) - iova + 1);
+	*as = f->iotlb_as;
+	*addr = e->addr | (iova & e->mask);
+
+	return true;
+}
+
+/* pci_dma_read and pci_dma_write through the IOTLB, a piece per translation */
+static int flip_dma_rw(FLIPState *f, uint64_t iova, uint8_t *buf, uint32_t len,
+		       DMADirection dir)
+{
+	AddressSpace *as;
+	hwaddr addr;
+	uint32_t n;
+
+	for (; len; len -= n, iova += n, buf += n) {
+		n = len;
+		if (!flip_iova(f, iova, &n, dir == DMA_DIRECTION_FROM_DEVICE, &as, &addr)
+		    || dma_memory_rw(as, addr, buf, n, dir))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int flip_dma_read(FLIPState *f, uint64_t iova, void *buf, uint32_t len)
+{
+	return flip_dma_rw(f, iova, buf, len, DMA_DIRECTION_TO_DEVICE);
+}
+
+static int flip_dma_write(FLIPState *f, uint64_t iova, const void *buf, uint32_t len)
+{
+	return flip_dma_rw(f, iova, (uint8_t *)buf, len, DMA_DIRECTION_FROM_DEVICE);
+}
+
+/* consumer: bytes ready to be taken, acquire so the data is visible */
+static uint32_t flip_fifo_used(FLIPFifo *q)
+{
+	uint32_t n = atomic_read(&q->tail) - q->head;
+
+	smp_rmb();
+	return n;
+}
+
+/* producer: free slots, the consumer has finished reading them */
+static uint32_t flip_fifo_room(FLIPFifo *q)
+{
+	uint32_t n = FLIP_FIFO_LEN - (q->tail - atomic_read(&q->head));
+
+	smp_mb();
+	return n;
+}
+
+/* producer: publish n bytes written at tail */
+static void flip_fifo_push(FLIPFifo *q, uint32_t n)
+{
+	smp_wmb();
+	atomic_set(&q->tail, q->tail + n);
+}
+
+/* consumer: release n bytes read at head */
+static void flip_fifo_pop(FLIPFifo *q, uint32_t n)
+{
+	smp_mb();
+	atomic_set(&q->head, q->head + n);
+}
+
+/* peek without ownership, for the state register and the stats page */
+static bool flip_fifo_empty(FLIPFifo *q)
+{
+	return atomic_read(&q->head) == atomic_read(&q->tail);
+}
+
+static uint8_t flip_state(FLIPState *f)
+{
+	uint8_t state = 0;
+
+	if (flip_fifo_empty(&f->in))
+		state |= FLIP_IN_EMPTY;
+	if (flip_fifo_empty(&f->out))
+		state |= FLIP_OUT_EMPTY;
+
+	return state;
+}
+
+/*
+ * mirror indices, state and counters into the guest's stats page,
+ * so the driver can read them without an exit.  Everything the
+ * indices cover (completions) is written before the indices.
+ */
+static void flip_update_stats(FLIPState *f)
+{
+	FLIPStats *s = f->stats;
+	int i;
+
+	if (!s)
+		return;
+
+	smp_wmb();
+	atomic_set(&s->fliped_nr, cpu_to_le64(f->fliped_nr));
+	atomic_set(&s->full_nr, cpu_to_le64(f->full_nr));
+	atomic_set(&s->irq_nr, cpu_to_le64(f->irq_nr));
+	atomic_set(&s->state, cpu_to_le32(flip_state(f)));
+	atomic_set(&s->node, cpu_to_le32(atomic_read(&f->numa_node) + 1));
+	atomic_set(&s->sq_head, cpu_to_le32(atomic_read(&f->sq[0].head)));
+	atomic_set(&s->cq_tail, cpu_to_le32(atomic_read(&f->cq[0].tail)));
+	for (i = 0; i < FLIP_CQS; i++)
+		atomic_set(&s->cqn_tail[i], cpu_to_le32(atomic_read(&f->cq[i].tail)));
+}
+
+static void flip_stats_unmap(FLIPState *f)
+{
+	if (f->stats) {
+		dma_memory_unmap(pci_get_address_space(flip_pci_dev(f)), f->stats,
+				 sizeof(FLIPStats), DMA_DIRECTION_FROM_DEVICE, sizeof(FLIPStats));
+		f->stats = NULL;
+	}
+}
+
+/* map the page the guest registered, it stays mapped until changed or reset */
+static void flip_stats_map(FLIPState *f)
+{
+	dma_addr_t len = sizeof(FLIPStats);
+
+	flip_stats_unmap(f);
+
+	if (!f->stats_base)
+		return;
+
+	f->stats = dma_memory_map(pci_get_address_space(flip_pci_dev(f)), f->stats_base,
+				  &len, DMA_DIRECTION_FROM_DEVICE);
+	if (f->stats && len < sizeof(FLIPStats)) {
+		dma_memory_unmap(pci_get_address_space(flip_pci_dev(f)), f->stats, len,
+				 DMA_DIRECTION_FROM_DEVICE, 0);
+		f->stats = NULL;
+	}
+
+	flip_update_stats(f);
+}
 
 /* update irq according state field */
 
 static void flip_update_irq(FLIPState *f)
 {
-	/* if output buffer not empty, raise irq */
-	if(f->state & FLIP_OUT_EMPTY)
+	PCIDevice *dev = flip_pci_dev(f);
+
+	/* if output buffer not empty or completions pending, raise irq */
+	if(flip_fifo_empty(&f->out) && !atomic_read(&f->dma_isr)) {
+		f->irq_level = 0;
 		qemu_irq_lower(f->irq);
-	else
-		qemu_irq_raise(f->irq);
+	} else {
+		/* with msi-x, vector 0 fires when the line would go up */
+		if (!f->irq_level) {
+			f->irq_nr++;
+			if (msix_enabled(dev))
+				msix_notify(dev, 0);
+		}
+		f->irq_level = 1;
+		if (!msix_enabled(dev))
+			qemu_irq_raise(f->irq);
+	}
+
+	flip_update_stats(f);
+}
+
+/* convert in the given mode, FLIP_CONF_LUT goes through the loaded table */
+static void flip_convert(FLIPState *f, uint8_t *dst, const uint8_t *src, int len, uint8_t conf)
+{
+	flip_conv(dst, src, len, conf, f->lut);
+}
+
+/* workload capture, every record is written under the global lock */
 
+static void flip_trace_open(FLIPState *f)
+{
+	FLIPTraceHeader h;
+
+	if (!f->trace_path)
+		return;
+
+	f->trace = fopen(f->trace_path, "wb");
+	if (!f->trace) {
+		error_report("flip: can not open trace file %s", f->trace_path);
+		return;
+	}
+
+	f->trace_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, FLIP_TRACE_MAGIC, sizeof(h.magic));
+	h.version = cpu_to_le32(FLIP_TRACE_VERSION);
+	h.flags = cpu_to_le32(f->trace_payload ? FLIP_TRACE_F_PAYLOAD : 0);
+	h.start_ns = cpu_to_le64(f->trace_start);
+	fwrite(&h, sizeof(h), 1, f->trace);
+}
+
+static void flip_trace_close(FLIPState *f)
+{
+	if (f->trace)
+		fclose(f->trace);
+	f->trace = NULL;
+}
+
+static void flip_trace_rec(FLIPState *f, int type, int size, uint16_t flags,
+			   uint64_t addr, uint64_t val, const void *data, uint32_t len)
+{
+	FLIPTraceRec r;
+
+	r.ns = cpu_to_le64(qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - f->trace_start);
+	r.type = type;
+	r.size = size;
+	r.flags = cpu_to_le16(flags);
+	r.len = cpu_to_le32(data ? len : 0);
+	r.addr = cpu_to_le64(addr);
+	r.val = cpu_to_le64(val);
+
+	if (fwrite(&r, sizeof(r), 1, f->trace) != 1
+	    || (data && fwrite(data, len, 1, f->trace) != 1)) {
+		error_report("flip: trace write failed, capture stopped");
+		flip_trace_close(f);
+	}
+}
+
+static void flip_trace_access(FLIPState *f, int type, hwaddr addr, unsigned size,
+			      uint64_t val)
+{
+	if (f->trace)
+		flip_trace_rec(f, type, size, 0, addr, val, NULL, 0);
+}
+
+/* fetch a whole translation table from guest memory, the old one stays on a fault */
+static void flip_lut_load(FLIPState *f)
+{
+	uint8_t lut[FLIP_LUT_LEN];
+
+	if (flip_dma_read(f, f->lut_base, lut, FLIP_LUT_LEN))
+		return;
+	memcpy(f->lut, lut, FLIP_LUT_LEN);
+
+	if (f->trace)
+		flip_trace_rec(f, FLIP_TRACE_LUT, 0, 0, f->lut_base, 0, f->lut, FLIP_LUT_LEN);
 }
 
 /* ioport read function */
@@ -37,47 +398,47 @@ static uint64_t flip_ioport_read(void *opaque, hwaddr addr, unsigned size)
 {
 	FLIPState *f = opaque;
 	uint64_t ret;
+	uint32_t n;
 	int i;
 
-	addr &= 0x7;
+	addr &= 0xf;
 	
 	/* default value */
 	ret = 0xffffffff;
 
 	switch(addr) {
 	case FLIP_REG_CONF:
-		ret = f->conf;
+		ret = atomic_read(&f->conf);
 		break;
 	case FLIP_REG_STATE:
-		ret = f->state;
+		ret = flip_state(f);
+		break;
+	case FLIP_REG_ROOM:
+		ret = flip_fifo_room(&f->in);
+		break;
+	case FLIP_REG_AVAIL:
+		ret = flip_fifo_used(&f->out);
 		break;
 	case FLIP_REG_OUT:
 		if (!size || size > 4)
 			break;
 
 		/* if is empty, read from output buffer */
-		if (!(f->state & FLIP_OUT_EMPTY)) {
-			size = size > f->out_nr ? f->out_nr : size;
-			i = 0;
+		n = flip_fifo_used(&f->out);
+		if (n) {
+			size = size > n ? n : size;
 			ret = 0;
-			do {
-				ret = f->out[i] << (i * 8) | ret; 
-				i++;
-			}while (i < size);
-			
-			/* update related fields */
-			qemu_mutex_lock(&f->lock);
+			for (i = 0; i < size; i++)
+				ret |= (uint64_t)f->out.data[(f->out.head + i) % FLIP_FIFO_LEN] << (i * 8);
 
-			f->out_nr -= size;
+			flip_fifo_pop(&f->out, size);
 
-			if (f->out_nr == 0) {
-				f->state |= FLIP_OUT_EMPTY;
-			}
-			
-			qemu_mutex_unlock(&f->lock);
 			/* update irq */
 			flip_update_irq(f);
 
+			/* conversion may be waiting for room in out */
+			if (!flip_fifo_empty(&f->in))
+				timer_mod(f->flip_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 2);
 		}
 		break;
 	default:
@@ -97,12 +458,10 @@ static void flip_ioport_write(void *opaque, hwaddr addr, uint64_t val, unsigned
 
 	//printf("addr = %d, size = %u, val = 0x%04lx\n", addr, size, val);
 
-	addr &= 0x7;
+	addr &= 0xf;
 	switch (addr) {
 	case FLIP_REG_CONF:
-		qemu_mutex_lock(&f->lock);
-		f->conf = val & 0xff;
-		qemu_mutex_unlock(&f->lock);
+		atomic_set(&f->conf, val & 0xff);
 		break;
 	case FLIP_REG_IN:
 		if (!size)
@@ -110,25 +469,28 @@ static void flip_ioport_write(void *opaque, hwaddr addr, uint64_t val, unsigned
 		if (size > 4)
 			size = 4;
 
-		/* wait for convert action read away, 2000 us */
-	 	if (!(f->state & FLIP_IN_EMPTY)) {
-			usleep(2000);
-		 }
-		
-
-		qemu_mutex_lock(&f->lock);
+		/*
+		 * a rep outsl arrives here word by word within one exit, the
+		 * timer converts the burst once the exit is over.  The driver
+		 * checks FLIP_REG_ROOM first, a word that does not fit is dropped
+		 * and counted in in-dropped.
+		 */
+		if (flip_fifo_room(&f->in) < size) {
+			f->full_nr++;
+			f->in_dropped += size;
+			flip_update_stats(f);
+			break;
+		}
 
 		/* write 4 bytes to input buffer */
 		//printf("write 0x04%lx to in\n", val);
 		for (i = 0; i < size; i++) {
-			f->in[i] = (val >> (i * 8)) & 0xff ;
+			f->in.data[(f->in.tail + i) % FLIP_FIFO_LEN] = (val >> (i * 8)) & 0xff ;
 		}
 
-		/* update some fields and state*/
-		f->in_nr = size;
-		f->state &= ~FLIP_IN_EMPTY;
+		flip_fifo_push(&f->in, size);
 
-		qemu_mutex_unlock(&f->lock);
+		flip_update_stats(f);
 
 		/* dispatch flip action in 2 ns */
 		timer_mod(f->flip_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 2);
@@ -141,117 +503,1909 @@ static void flip_ioport_write(void *opaque, hwaddr addr, uint64_t val, unsigned
 }
 
 
+static uint64_t flip_io_read(void *opaque, hwaddr addr, unsigned size)
+{
+	uint64_t ret = flip_ioport_read(opaque, addr, size);
+
+	flip_trace_access(opaque, FLIP_TRACE_PIO_READ, addr, size, ret);
+	return ret;
+}
+
+static void flip_io_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+{
+	flip_trace_access(opaque, FLIP_TRACE_PIO_WRITE, addr, size, val);
+	flip_ioport_write(opaque, addr, val, size);
+}
+
 const MemoryRegionOps flip_io_ops = {
-	.read = flip_ioport_read,
-	.write = flip_ioport_write,
+	.read = flip_io_read,
+	.write = flip_io_write,
 	.endianness = DEVICE_LITTLE_ENDIAN,
 	.impl.unaligned = true,
 	.valid.unaligned = true,
 };
 
-/* device reset function */
-static void flip_reset(void *opaque)
+static void flip_sg_init(FLIPSgIter *it, uint64_t addr, uint32_t len,
+			 uint16_t nsg, bool sg)
 {
-	FLIPState *f = opaque;
+	it->table = sg ? addr : 0;
+	it->nsg = sg ? nsg : 0;
+	it->addr = addr;
+	it->left = sg ? 0 : len;
+}
 
-	/* default upper case */
-	f->conf = FLIP_CONF_UP;
-	f->state = FLIP_IN_EMPTY | FLIP_OUT_EMPTY;
-	f->out_nr = 0;
-	f->in_nr = 0;
-	f->fliped_nr = 0;
+/* next contiguous run of at most max bytes, 0 when the buffer is exhausted */
+static uint32_t flip_sg_next(FLIPState *f, FLIPSgIter *it, uint64_t *addr,
+			     uint32_t max)
+{
+	FLIPIotlbEntry *e;
+	FLIPSge sge;
+	uint32_t n;
+
+	while (!it->left) {
+		if (!it->nsg)
+			return 0;
+		if (flip_dma_read(f, it->table, &sge, sizeof(sge)))
+			return 0;
+		it->table += sizeof(sge);
+		it->nsg--;
+		it->addr = le64_to_cpu(sge.addr);
+		it->left = le32_to_cpu(sge.len);
+	}
 
-	qemu_mutex_init(&f->lock);
+	n = MIN(it->left, max);
 
-	qemu_irq_lower(f->irq);
+	/* with a vIOMMU a run ends where its translation does, so it maps in one go */
+	if (f->iommu && (e = flip_iotlb_get(f, it->addr, false)))
+		n = MIN(n, (it->addr | e->mask) - it->addr + 1);
+
+	*addr = it->addr;
+	it->addr += n;
+	it->left -= n;
+
+	return n;
 }
 
-/* flip convert function */
-static void flip_callback(void *opaque)
+/* crc is NULL unless the descriptor asked for a checksum */
+static void flip_dma_conv(FLIPState *f, uint8_t *dst, const uint8_t *src, uint32_t len,
+			  int conf, uint32_t *crc)
 {
-	FLIPState *f = opaque;
-	int i;
-	int step;
+	if (crc)
+		*crc = flip_conv_crc(dst, src, len, conf, f->lut, *crc);
+	else
+		flip_convert(f, dst, src, len, conf);
+}
+
+/*
+ * map a guest range to convert it where it is.  NULL unless the whole
+ * range is guest RAM, MMIO and ROM go through dma_buf instead.
+ */
+static void *flip_dma_map(FLIPState *f, uint64_t addr, uint32_t len, DMADirection dir)
+{
+	bool is_write = dir == DMA_DIRECTION_FROM_DEVICE;
+	AddressSpace *as;
+	MemoryRegion *mr;
+	hwaddr a, xlat, l = len;
+	uint32_t n = len;
+	dma_addr_t mlen = len;
+	void *p;
+
+	if (!flip_iova(f, addr, &n, is_write, &as, &a) || n < len)
+		return NULL;
+
+	mr = address_space_translate(as, a, &xlat, &l, is_write);
+	if (!memory_region_is_ram(mr) || (is_write && memory_region_is_rom(mr)) || l < len)
+		return NULL;
+
+	p = dma_memory_map(as, a, &mlen, dir);
+	if (p && mlen < len) {
+		dma_memory_unmap(as, p, mlen, dir, 0);
+		return NULL;
+	}
+
+	return p;
+}
+
+static void flip_dma_unmap(FLIPState *f, void *p, uint32_t len, DMADirection dir)
+{
+	dma_memory_unmap(flip_dma_as(f), p, len, dir, len);
+}
 
-	if (!(f->state & FLIP_IN_EMPTY)) {
+/* FLIP_DESC_INPLACE: each byte is read and written once, in guest RAM */
+static uint32_t flip_dma_inplace(FLIPState *f, FLIPSgIter *it, uint32_t done,
+				 uint32_t end, int conf, uint32_t *crc)
+{
+	uint64_t addr;
+	uint32_t n;
+	uint8_t *p;
+
+	for (; done < end; done += n) {
+		n = flip_sg_next(f, it, &addr, MIN(end - done, FLIP_DMA_CHUNK));
+		if (!n)
+			break;
 
-		/* wait for ISR to read away */
-		if (!(f->state & FLIP_OUT_EMPTY)) {
-			usleep(2000);
+		p = flip_dma_map(f, addr, n, DMA_DIRECTION_FROM_DEVICE);
+		if (p) {
+			flip_dma_conv(f, p, p, n, conf, crc);
+			flip_dma_unmap(f, p, n, DMA_DIRECTION_FROM_DEVICE);
+			continue;
 		}
-		
-
-		qemu_mutex_lock(&f->lock);
-
-		/* convert the character for [a-zA-Z], leave other alone */
-		if (f->conf == FLIP_CONF_UP)
-			step = -32;
-		else 
-			step = 32;
-				       
-		for (i = 0; i < f->in_nr; i++) {
-			if (((f->in[i] >= 65 && f->in[i] <= 90) && step > 0)
-			    || ((f->in[i] >= 97 && f->in[i] <= 122) && step < 0))
-					
-				f->out[i] = f->in[i] + step;
-			else
-				f->out[i] = f->in[i];
+
+		/* not RAM, bounce */
+		if (flip_dma_read(f, addr, f->dma_buf, n))
+			break;
+		flip_dma_conv(f, f->dma_buf, f->dma_buf, n, conf, crc);
+		if (flip_dma_write(f, addr, f->dma_buf, n))
+			break;
+	}
+
+	return done;
+}
+
+/* src to dst, converting straight from one mapping into the other */
+static uint32_t flip_dma_copy(FLIPState *f, FLIPSgIter *src, FLIPSgIter *dst,
+			      uint32_t done, uint32_t end, int conf, uint32_t *crc)
+{
+	uint64_t saddr, daddr;
+	uint32_t n, off, m;
+	uint8_t *sp, *dp, *in;
+
+	for (; done < end; done += n) {
+		n = flip_sg_next(f, src, &saddr, MIN(end - done, FLIP_DMA_CHUNK));
+		if (!n)
+			break;
+
+		sp = flip_dma_map(f, saddr, n, DMA_DIRECTION_TO_DEVICE);
+		if (!sp && flip_dma_read(f, saddr, f->dma_buf, n))
+			break;
+		in = sp ? sp : f->dma_buf;
+
+		/* dst may be split differently, bounced pieces reuse their slot in dma_buf */
+		for (off = 0; off < n; off += m) {
+			m = flip_sg_next(f, dst, &daddr, n - off);
+			if (!m)
+				break;
+			dp = flip_dma_map(f, daddr, m, DMA_DIRECTION_FROM_DEVICE);
+			if (dp) {
+				flip_dma_conv(f, dp, in + off, m, conf, crc);
+				flip_dma_unmap(f, dp, m, DMA_DIRECTION_FROM_DEVICE);
+				continue;
+			}
+			flip_dma_conv(f, f->dma_buf + off, in + off, m, conf, crc);
+			if (flip_dma_write(f, daddr, f->dma_buf + off, m))
+				break;
 		}
 
-		/* update fields and state */
-		f->out_nr = f->in_nr;
-		f->in_nr = 0;
-		f->fliped_nr += f->out_nr;
-		f->state |= FLIP_IN_EMPTY;
-		f->state &= ~FLIP_OUT_EMPTY;
+		if (sp)
+			flip_dma_unmap(f, sp, n, DMA_DIRECTION_TO_DEVICE);
+		if (off < n)
+			break;
+	}
+
+	return done;
+}
 
-		qemu_mutex_unlock(&f->lock);
+static void flip_dma_begin(FLIPDmaCur *c, FLIPDesc *d)
+{
+	bool sg = d->flags & FLIP_DESC_SG;
 
-		/* after convertion, trigger a irq */
-		flip_update_irq(f);
+	c->d = *d;
+	c->done = 0;
+	c->crc = ~0;
+	flip_sg_init(&c->src, d->src, d->len, d->src_nsg, sg);
+	flip_sg_init(&c->dst, d->dst, d->len, d->dst_nsg, sg);
+}
+
+/* convert up to end, bouncing through dma_buf only what is not RAM; false on error */
+static bool flip_dma_step(FLIPState *f, FLIPDmaCur *c, uint32_t end)
+{
+	FLIPDesc *d = &c->d;
+	int conf = d->flags & FLIP_DESC_CONF;
+	uint32_t *crcp = d->flags & FLIP_DESC_CRC ? &c->crc : NULL;
+	uint32_t done;
+
+	if (d->flags & FLIP_DESC_INPLACE)
+		done = flip_dma_inplace(f, &c->src, c->done, end, conf, crcp);
+	else
+		done = flip_dma_copy(f, &c->src, &c->dst, c->done, end, conf, crcp);
 
+	f->fliped_nr += done - c->done;
+	c->done = done;
+
+	return done == end;
+}
+
+/* the next len bytes of the output, false when dst is full or on a dma error */
+static bool flip_dma_put(FLIPState *f, FLIPSgIter *dst, const uint8_t *buf, uint32_t len)
+{
+	uint64_t addr;
+	uint32_t n;
+
+	for (; len; len -= n, buf += n) {
+		n = flip_sg_next(f, dst, &addr, len);
+		if (!n || flip_dma_write(f, addr, buf, n))
+			return false;
 	}
-			
 
+	return true;
 }
 
-/* instance init function */
-static int flip_pci_init(PCIDevice *dev)
+/*
+ * FLIP_CONF_UTF8_*: the output can be up to FLIP_UTF8_GROWTH times
+ * longer than the input, so such a descriptor is never converted in
+ * place, by the workers or with progress, only here a step at a time.
+ * A linear dst has room for FLIP_UTF8_GROWTH * len, an sg one for what
+ * its table adds up to.  A sequence cut by the end of a step is carried
+ * over to the next.  out_len is the bytes written to dst.
+ */
+static int flip_dma_utf8(FLIPState *f, FLIPDesc *d, uint32_t *out_len, uint32_t *crc)
 {
-	PCIFLIPState *pf = DO_UPCAST(PCIFLIPState, dev, dev);
-	FLIPState *f = &pf->state;
+	bool sg = d->flags & FLIP_DESC_SG;
+	int conf = d->flags & FLIP_DESC_CONF;
+	uint64_t room = (uint64_t)d->len * FLIP_UTF8_GROWTH;
+	uint8_t *in = f->utf8_buf, *out = f->utf8_buf + FLIP_UTF8_IN;
+	FLIPSgIter src, dst;
+	uint64_t addr;
+	uint32_t done, n, carry = 0;
+	size_t used, len;
 
-	/* connect to INTA pin*/
-	//pf->dev.config[PCI_INTERRUPT_PIN] = 0x01; /* INTA */
-	pci_config_set_interrupt_pin(pf->dev.config, 0x1);
-	//f->irq = pf->dev.irq[0]; /* INTA */
-	f->irq = pci_allocate_irq(dev);
+	*out_len = 0;
+	*crc = ~0;
+	if (d->flags & FLIP_DESC_INPLACE)
+		return FLIP_STS_ERR;
 
-	/* init the timer */
-	f->flip_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *)flip_callback, f);
-	/* register reset function */
-	qemu_register_reset(flip_reset, f);
-	/* register ioport */
-	memory_region_init_io(&f->io, OBJECT(pf), &flip_io_ops, f, "flip", 16);
+	flip_sg_init(&src, d->src, d->len, d->src_nsg, sg);
+	flip_sg_init(&dst, d->dst, MIN(room, UINT32_MAX), d->dst_nsg, sg);
 
-	/* register PCI bar */
-	pci_register_bar(&pf->dev, 0, PCI_BASE_ADDRESS_SPACE_IO, &f->io);
+	for (done = 0; done < d->len; done += n) {
+		n = flip_sg_next(f, &src, &addr, MIN(d->len - done, FLIP_DMA_CHUNK));
+		if (!n || flip_dma_read(f, addr, in + carry, n))
+			return FLIP_STS_ERR;
 
-	return 0;
+		len = flip_conv_utf8(out, in, carry + n, conf, done + n == d->len, &used);
+		if (d->flags & FLIP_DESC_CRC)
+			*crc = flip_crc32c(*crc, out, len);
+		if (!flip_dma_put(f, &dst, out, len))
+			return FLIP_STS_ERR;
+		*out_len += len;
+		f->fliped_nr += n;
 
+		carry = carry + n - used;
+		memmove(in, in + used, carry);
+	}
+
+	*crc = ~*crc;
+
+	return FLIP_STS_OK;
 }
 
-/* instance destroy function */
-static void flip_pci_exit(PCIDevice *dev)
+/* run one descriptor to the end */
+static int flip_dma_convert(FLIPState *f, FLIPDesc *d, uint32_t *out_len, uint32_t *crc)
 {
-	PCIFLIPState *pf = DO_UPCAST(PCIFLIPState, dev, dev);
-	FLIPState *f = &pf->state;
-	
-	qemu_unregister_reset(flip_reset, f);
-	memory_region_destroy(&f->io);
-	
+	FLIPDmaCur c;
+	bool ok;
+
+	if (flip_conf_utf8(d->flags & FLIP_DESC_CONF))
+		return flip_dma_utf8(f, d, out_len, crc);
+
+	flip_dma_begin(&c, d);
+	ok = flip_dma_step(f, &c, d->len);
+
+	*out_len = c.done;
+	*crc = ~c.crc;
+
+	return ok ? FLIP_STS_OK : FLIP_STS_ERR;
+}
+
+/* bytes between progress completions, 0 for none */
+static uint32_t flip_progress_step(FLIPDesc *d)
+{
+	return (uint32_t)d->progress << 10;
+}
+
+/* NUMA placement */
+
+#define FLIP_UTF8_BUF_LEN  (FLIP_UTF8_IN * (1 + FLIP_UTF8_GROWTH))
+
+static bool flip_numa_valid(int node)
+{
+#ifdef CONFIG_NUMA
+	return numa_available() >= 0 && node <= numa_max_node() && node < MAX_NODES;
+#else
+	return false;
+#endif
+}
+
+#ifdef CONFIG_NUMA
+/* host node of the guest RAM at a device address, -1 when unknown */
+static int flip_numa_node_of(FLIPState *f, uint64_t addr)
+{
+	void *p = flip_dma_map(f, addr, 1, DMA_DIRECTION_TO_DEVICE);
+	int node = -1;
+
+	if (!p)
+		return -1;
+	if (get_mempolicy(&node, NULL, 0, p, MPOL_F_NODE | MPOL_F_ADDR) < 0)
+		node = -1;
+	dma_memory_unmap(flip_dma_as(f), p, 1, DMA_DIRECTION_TO_DEVICE, 0);
+
+	return node;
+}
+
+/* prefer node for a host buffer, the pages already touched move now */
+static void flip_numa_buf(void *p, size_t len, int node)
+{
+	DECLARE_BITMAP(nodes, MAX_NODES + 1) = { 0 };
+
+	set_bit(node, nodes);
+	if (mbind(p, len, MPOL_PREFERRED, nodes, MAX_NODES + 1, MPOL_MF_MOVE) < 0)
+		error_report("flip: can not move buffers to node %d: %s", node, strerror(errno));
+}
+#endif
+
+/* called by a worker, onto the CPUs of the node the device is on */
+static void flip_numa_run(FLIPState *f)
+{
+#ifdef CONFIG_NUMA
+	int node = atomic_read(&f->numa_node);
+
+	if (node >= 0 && numa_run_on_node(node) < 0)
+		error_report("flip: can not run workers on node %d", node);
+#endif
+}
+
+/* move the buffers to node and tell the workers, under the global lock */
+static void flip_numa_place(FLIPState *f, int node)
+{
+#ifdef CONFIG_NUMA
+	if (!flip_numa_valid(node) || node == f->numa_node)
+		return;
+
+	flip_numa_buf(f->dma_buf, FLIP_DMA_CHUNK, node);
+	flip_numa_buf(f->utf8_buf, FLIP_UTF8_BUF_LEN, node);
+	atomic_set(&f->numa_node, node);
+	atomic_inc(&f->numa_gen);
+	flip_update_stats(f);
+#endif
 }
 
+/* rings enabled: without the node property, go where they are */
+static void flip_numa_follow(FLIPState *f)
+{
+#ifdef CONFIG_NUMA
+	if (f->node < 0 && f->sq[0].base)
+		flip_numa_place(f, flip_numa_node_of(f, f->sq[0].base));
+#endif
+}
+
+/* worker pool */
+
+static void flip_req_free(FLIPState *f, FLIPReq *req, bool written)
+{
+	int i;
+
+	for (i = 0; i < req->nr_maps; i++)
+		dma_memory_unmap(flip_dma_as(f), req->maps[i].p,
+				 req->maps[i].len, req->maps[i].dir,
+				 written ? req->maps[i].len : 0);
+	g_free(req->maps);
+	g_free(req->job_end);
+	g_free(req->job_done);
+	g_free(req);
+}
+
+static uint8_t *flip_req_map(FLIPState *f, FLIPReq *req, uint64_t addr, uint32_t len,
+			     DMADirection dir)
+{
+	uint8_t *p = flip_dma_map(f, addr, len, dir);
+
+	if (p) {
+		req->maps = g_renew(FLIPMap, req->maps, req->nr_maps + 1);
+		req->maps[req->nr_maps].p = p;
+		req->maps[req->nr_maps].len = len;
+		req->maps[req->nr_maps].dir = dir;
+		req->nr_maps++;
+	}
+
+	return p;
+}
+
+static void flip_job_add(FLIPJob *job, const uint8_t *src, uint8_t *dst, uint32_t len)
+{
+	job->pieces = g_renew(FLIPPiece, job->pieces, job->nr_pieces + 1);
+	job->pieces[job->nr_pieces].src = src;
+	job->pieces[job->nr_pieces].dst = dst;
+	job->pieces[job->nr_pieces].len = len;
+	job->nr_pieces++;
+	job->len += len;
+}
+
+/*
+ * map the whole descriptor and cut it into jobs.  NULL when some range
+ * is not guest RAM, such a descriptor is converted in dma_bh as before.
+ */
+static FLIPReq *flip_req_prepare(FLIPState *f, FLIPDesc *d, GSList **jobs)
+{
+	bool sg = d->flags & FLIP_DESC_SG;
+	bool inplace = d->flags & FLIP_DESC_INPLACE;
+	FLIPSgIter src, dst;
+	FLIPReq *req;
+	FLIPJob *job = NULL;
+	GSList *l;
+	uint64_t saddr, daddr;
+	uint32_t done, n, off, m, end;
+	uint32_t chunk = FLIP_WORK_CHUNK;
+	uint8_t *sp, *dp;
+
+	/* a job per progress interval, so that the converted prefix grows in steps */
+	if (flip_progress_step(d))
+		chunk = MIN(chunk, flip_progress_step(d));
+
+	req = g_new0(FLIPReq, 1);
+	req->d = *d;
+	req->crc = ~0;
+	if ((d->flags & FLIP_DESC_CONF) == FLIP_CONF_LUT)
+		memcpy(req->lut, f->lut, FLIP_LUT_LEN);
+
+	flip_sg_init(&src, d->src, d->len, d->src_nsg, sg);
+	flip_sg_init(&dst, d->dst, d->len, d->dst_nsg, sg);
+
+	for (done = 0; done < d->len; done += n) {
+		n = flip_sg_next(f, &src, &saddr, MIN(d->len - done, FLIP_DMA_CHUNK));
+		if (!n)
+			goto fail;
+		sp = flip_req_map(f, req, saddr, n, inplace ? DMA_DIRECTION_FROM_DEVICE
+						       : DMA_DIRECTION_TO_DEVICE);
+		if (!sp)
+			goto fail;
+
+		for (off = 0; off < n; off += m) {
+			if (inplace) {
+				m = n;
+				dp = sp;
+			} else {
+				m = flip_sg_next(f, &dst, &daddr, n - off);
+				if (!m)
+					goto fail;
+				dp = flip_req_map(f, req, daddr, m, DMA_DIRECTION_FROM_DEVICE);
+				if (!dp)
+					goto fail;
+			}
+
+			/* the checksum is sequential, keep such a descriptor in one job */
+			if (!job || (job->len >= chunk && !(d->flags & FLIP_DESC_CRC))) {
+				job = g_new0(FLIPJob, 1);
+				job->req = req;
+				*jobs = g_slist_append(*jobs, job);
+				req->jobs++;
+			}
+			flip_job_add(job, sp + off, dp, m);
+		}
+	}
+
+	/* jobs are in output order, job n ends where job n + 1 starts */
+	if (flip_progress_step(d) && req->jobs > 1) {
+		req->nr_jobs = req->jobs;
+		req->job_end = g_new(uint32_t, req->nr_jobs);
+		req->job_done = g_new0(int, req->nr_jobs);
+		end = 0;
+		for (l = *jobs, n = 0; l; l = l->next, n++) {
+			job = l->data;
+			job->idx = n;
+			end += job->len;
+			req->job_end[n] = end;
+		}
+	}
+
+	return req;
+
+fail:
+	while (*jobs) {
+		job = (*jobs)->data;
+		g_free(job->pieces);
+		g_free(job);
+		*jobs = g_slist_delete_link(*jobs, *jobs);
+	}
+	flip_req_free(f, req, false);
+	return NULL;
+}
+
+static void flip_job_run(FLIPJob *job)
+{
+	FLIPReq *req = job->req;
+	int conf = req->d.flags & FLIP_DESC_CONF;
+	int i;
+
+	for (i = 0; i < job->nr_pieces; i++) {
+		if (req->d.flags & FLIP_DESC_CRC)
+			req->crc = flip_conv_crc(job->pieces[i].dst, job->pieces[i].src,
+						 job->pieces[i].len, conf, req->lut, req->crc);
+		else
+			flip_conv(job->pieces[i].dst, job->pieces[i].src,
+				  job->pieces[i].len, conf, req->lut);
+	}
+}
+
+/* own queues: small descriptors first, each in the order queued */
+static FLIPJob *flip_worker_pop(FLIPWorker *w)
+{
+	FLIPJob *job;
+
+	qemu_mutex_lock(&w->lock);
+	job = QTAILQ_FIRST(&w->small);
+	if (job) {
+		QTAILQ_REMOVE(&w->small, job, next);
+	} else {
+		job = QTAILQ_FIRST(&w->jobs);
+		if (job)
+			QTAILQ_REMOVE(&w->jobs, job, next);
+	}
+	if (job)
+		atomic_dec(&w->queued);
+	qemu_mutex_unlock(&w->lock);
+
+	return job;
+}
+
+/* idle: take a chunk from the tail of a busy worker */
+static FLIPJob *flip_worker_steal(FLIPWorker *w)
+{
+	FLIPState *f = w->f;
+	FLIPWorker *v;
+	FLIPJob *job = NULL;
+	uint32_t i, self = w - f->worker;
+
+	for (i = 1; i < f->workers && !job; i++) {
+		v = &f->worker[(self + i) % f->workers];
+		/* racy, the lock decides */
+		if (!atomic_read(&v->queued))
+			continue;
+		qemu_mutex_lock(&v->lock);
+		job = QTAILQ_FIRST(&v->small);
+		if (job) {
+			QTAILQ_REMOVE(&v->small, job, next);
+		} else {
+			job = QTAILQ_LAST(&v->jobs, FLIPJobList);
+			if (job)
+				QTAILQ_REMOVE(&v->jobs, job, next);
+		}
+		if (job)
+			atomic_dec(&v->queued);
+		qemu_mutex_unlock(&v->lock);
+	}
+
+	return job;
+}
+
+static void *flip_worker_thread(void *opaque)
+{
+	FLIPWorker *w = opaque;
+	FLIPState *f = w->f;
+	FLIPJob *job;
+	FLIPReq *req;
+	bool progress;
+	int gen = 0;
+
+	for (;;) {
+		/* the device was placed on another node since the last job */
+		if (gen != atomic_read(&f->numa_gen)) {
+			gen = atomic_read(&f->numa_gen);
+			flip_numa_run(f);
+		}
+
+		job = flip_worker_pop(w);
+		if (!job)
+			job = flip_worker_steal(w);
+
+		if (!job) {
+			qemu_mutex_lock(&f->work_lock);
+			while (atomic_read(&f->work_pending) <= 0 && !f->work_stop)
+				qemu_cond_wait(&f->work_cond, &f->work_lock);
+			if (f->work_stop) {
+				qemu_mutex_unlock(&f->work_lock);
+				break;
+			}
+			qemu_mutex_unlock(&f->work_lock);
+			continue;
+		}
+
+		atomic_dec(&f->work_pending);
+		flip_job_run(job);
+		req = job->req;
+		/* the output of the job before the flag, done_bh may post it */
+		progress = req->job_done != NULL;
+		if (progress)
+			atomic_mb_set(&req->job_done[job->idx], 1);
+		g_free(job->pieces);
+		g_free(job);
+
+		/* last job of the descriptor hands it to done_bh */
+		if (atomic_fetch_sub(&req->jobs, 1) == 1) {
+			qemu_mutex_lock(&f->done_lock);
+			QSIMPLEQ_INSERT_TAIL(&f->done, req, next);
+			qemu_mutex_unlock(&f->done_lock);
+			qemu_bh_schedule(f->done_bh);
+		} else if (progress) {
+			qemu_bh_schedule(f->done_bh);
+		}
+
+		qemu_mutex_lock(&f->work_lock);
+		if (--f->work_busy == 0)
+			qemu_cond_broadcast(&f->idle_cond);
+		qemu_mutex_unlock(&f->work_lock);
+	}
+
+	return NULL;
+}
+
+/* spread the jobs of one descriptor over the workers */
+static void flip_work_queue(FLIPState *f, GSList *jobs, bool urgent)
+{
+	bool small = urgent || (!jobs->next && ((FLIPJob *)jobs->data)->len <= FLIP_WORK_CHUNK);
+	FLIPWorker *w;
+	FLIPJob *job;
+	int n = 0;
+
+	for (; jobs; jobs = g_slist_delete_link(jobs, jobs)) {
+		job = jobs->data;
+		w = &f->worker[f->work_next++ % f->workers];
+		qemu_mutex_lock(&w->lock);
+		if (small)
+			QTAILQ_INSERT_TAIL(&w->small, job, next);
+		else
+			QTAILQ_INSERT_TAIL(&w->jobs, job, next);
+		atomic_inc(&w->queued);
+		qemu_mutex_unlock(&w->lock);
+		n++;
+	}
+
+	qemu_mutex_lock(&f->work_lock);
+	f->work_busy += n;
+	atomic_fetch_add(&f->work_pending, n);
+	if (n > 1)
+		qemu_cond_broadcast(&f->work_cond);
+	else
+		qemu_cond_signal(&f->work_cond);
+	qemu_mutex_unlock(&f->work_lock);
+}
+
+/* wait until the workers are idle, finished descriptors stay on done */
+static void flip_work_drain(FLIPState *f)
+{
+	if (!f->workers)
+		return;
+
+	qemu_mutex_lock(&f->work_lock);
+	while (f->work_busy)
+		qemu_cond_wait(&f->idle_cond, &f->work_lock);
+	qemu_mutex_unlock(&f->work_lock);
+}
+
+static void flip_work_init(FLIPState *f)
+{
+	uint32_t i;
+
+	qemu_mutex_init(&f->done_lock);
+	QSIMPLEQ_INIT(&f->done);
+	QLIST_INIT(&f->progress);
+	f->done_bh = qemu_bh_new(flip_dma_done, f);
+
+	if (f->workers > FLIP_WORKERS_MAX)
+		f->workers = FLIP_WORKERS_MAX;
+	if (!f->workers)
+		return;
+
+	qemu_mutex_init(&f->work_lock);
+	qemu_cond_init(&f->work_cond);
+	qemu_cond_init(&f->idle_cond);
+
+	f->worker = g_new0(FLIPWorker, f->workers);
+	for (i = 0; i < f->workers; i++) {
+		f->worker[i].f = f;
+		qemu_mutex_init(&f->worker[i].lock);
+		QTAILQ_INIT(&f->worker[i].small);
+		QTAILQ_INIT(&f->worker[i].jobs);
+		qemu_thread_create(&f->worker[i].thread, "flip-worker",
+				   flip_worker_thread, &f->worker[i], QEMU_THREAD_JOINABLE);
+	}
+}
+
+static void flip_work_exit(FLIPState *f)
+{
+	uint32_t i;
+
+	if (f->workers) {
+		flip_work_drain(f);
+
+		qemu_mutex_lock(&f->work_lock);
+		f->work_stop = true;
+		qemu_cond_broadcast(&f->work_cond);
+		qemu_mutex_unlock(&f->work_lock);
+
+		for (i = 0; i < f->workers; i++) {
+			qemu_thread_join(&f->worker[i].thread);
+			qemu_mutex_destroy(&f->worker[i].lock);
+		}
+		g_free(f->worker);
+
+		qemu_cond_destroy(&f->idle_cond);
+		qemu_cond_destroy(&f->work_cond);
+		qemu_mutex_destroy(&f->work_lock);
+	}
+
+	flip_dma_complete(f, false);
+	qemu_bh_delete(f->done_bh);
+	qemu_mutex_destroy(&f->done_lock);
+}
+
+/* completion ring */
+
+static void flip_dma_post(FLIPState *f, int n, uint16_t tag, int status, uint32_t len,
+			  bool crc_on, uint32_t crc)
+{
+	FLIPCq *q = &f->cq[n];
+	FLIPCompl c;
+
+	memset(&c, 0, sizeof(c));
+	c.status = cpu_to_le16(status);
+	c.tag = cpu_to_le16(tag);
+	c.len = cpu_to_le32(len);
+	if (crc_on)
+		c.crc = cpu_to_le32(crc);
+	flip_dma_write(f, q->base + q->tail * sizeof(c), &c, sizeof(c));
+	if (f->trace)
+		flip_trace_rec(f, FLIP_TRACE_COMPL, 0, status, tag, len, NULL, 0);
+	/* release: the entry is visible before the index */
+	smp_wmb();
+	atomic_set(&q->tail, (q->tail + 1) & (f->ring_size - 1));
+}
+
+/*
+ * posted has bit n set for every completion queue that got entries.
+ * With msi-x each of them gets its own vector, which the guest points
+ * at the cpus submitting to it; otherwise they share the isr and line.
+ */
+static void flip_dma_notify(FLIPState *f, uint32_t posted)
+{
+	PCIDevice *dev = flip_pci_dev(f);
+	int i;
+
+	/* a polled queue only gets its tail published */
+	for (i = 0; i < FLIP_CQS; i++)
+		if (f->cq[i].flags & FLIP_CQ_POLLED)
+			posted &= ~(1u << i);
+
+	if (!posted) {
+		flip_update_stats(f);
+		return;
+	}
+
+	smp_mb();
+	if (msix_enabled(dev)) {
+		/* the new tails are in the stats page before the message */
+		flip_update_stats(f);
+		for (i = 0; i < FLIP_CQS; i++) {
+			if (posted & (1u << i)) {
+				f->irq_nr++;
+				msix_notify(dev, i);
+			}
+		}
+	} else {
+		atomic_or(&f->dma_isr, FLIP_ISR_DMA);
+		flip_update_irq(f);
+	}
+}
+
+/* room for a progress completion, the slots reserved through inflight stay free */
+static bool flip_cq_progress_room(FLIPState *f, FLIPCq *c)
+{
+	uint32_t mask = f->ring_size - 1;
+
+	return ((c->tail - atomic_mb_read(&c->head)) & mask) + c->inflight < mask;
+}
+
+/*
+ * post how far the workers got on the descriptors asking for progress:
+ * the end of the jobs finished without a gap from the start.  Those
+ * with every job finished are on done, their final completion follows.
+ */
+static void flip_req_progress(FLIPState *f, uint32_t *posted)
+{
+	FLIPReq *req;
+	uint32_t off;
+
+	QLIST_FOREACH(req, &f->progress, progress_next) {
+		if (!atomic_read(&req->jobs))
+			continue;
+
+		while (req->next_job < req->nr_jobs && atomic_mb_read(&req->job_done[req->next_job]))
+			req->next_job++;
+		off = req->next_job ? req->job_end[req->next_job - 1] : 0;
+
+		/* a later completion reports more, this one can be skipped */
+		if (off <= req->progress || !flip_cq_progress_room(f, &f->cq[req->d.cq]))
+			continue;
+
+		req->progress = off;
+		flip_dma_post(f, req->d.cq, req->d.tag, FLIP_STS_PROGRESS, off, false, 0);
+		*posted |= 1u << req->d.cq;
+	}
+}
+
+/*
+ * post or drop what the workers finished, in the order they finished.
+ * The slots were reserved through the queue's inflight when the
+ * descriptor was fetched.
+ */
+static void flip_dma_complete(FLIPState *f, bool post)
+{
+	QSIMPLEQ_HEAD(, FLIPReq) done = QSIMPLEQ_HEAD_INITIALIZER(done);
+	FLIPReq *req;
+	uint32_t posted = 0;
+
+	qemu_mutex_lock(&f->done_lock);
+	QSIMPLEQ_CONCAT(&done, &f->done);
+	qemu_mutex_unlock(&f->done_lock);
+
+	if (post)
+		flip_req_progress(f, &posted);
+
+	while ((req = QSIMPLEQ_FIRST(&done))) {
+		QSIMPLEQ_REMOVE_HEAD(&done, next);
+		if (req->job_done)
+			QLIST_REMOVE(req, progress_next);
+		f->cq[req->d.cq].inflight--;
+		if (post) {
+			f->fliped_nr += req->d.len;
+			flip_dma_post(f, req->d.cq, req->d.tag, FLIP_STS_OK, req->d.len,
+				      req->d.flags & FLIP_DESC_CRC, ~req->crc);
+			posted |= 1u << req->d.cq;
+		}
+		flip_req_free(f, req, post);
+	}
+
+	if (post)
+		flip_dma_notify(f, posted);
+}
+
+static void flip_dma_done(void *opaque)
+{
+	FLIPState *f = opaque;
+
+	flip_dma_complete(f, f->dma_ctrl & FLIP_CTRL_ENABLE);
+}
+
+/* record a fetched descriptor, with its source data if asked to */
+static void flip_trace_desc(FLIPState *f, int n, FLIPDesc *d)
+{
+	FLIPSgIter it;
+	uint64_t addr;
+	uint32_t done, m;
+	uint8_t *data = NULL;
+
+	if (f->trace_payload && d->len) {
+		data = g_malloc0(d->len);
+		flip_sg_init(&it, d->src, d->len, d->src_nsg, d->flags & FLIP_DESC_SG);
+		for (done = 0; done < d->len; done += m) {
+			m = flip_sg_next(f, &it, &addr, d->len - done);
+			if (!m || flip_dma_read(f, addr, data + done, m))
+				break;
+		}
+	}
+
+	flip_trace_rec(f, FLIP_TRACE_DESC, n, d->flags, d->tag, d->len, data, d->len);
+	g_free(data);
+}
+
+/* queue scheduling */
+
+#define FLIP_NS_PER_SEC 1000000000.0
+
+static void flip_bucket_leak(FLIPBucket *b, int64_t delta_ns)
+{
+	b->level = MAX(b->level - b->avg * delta_ns / FLIP_NS_PER_SEC, 0);
+}
+
+/* ns until the bucket is back within its burst */
+static int64_t flip_bucket_wait(FLIPBucket *b)
+{
+	double max = b->max ? b->max : b->avg / 10.0;
+	double extra;
+
+	if (!b->avg)
+		return 0;
+
+	extra = b->level - max;
+	if (extra <= 0)
+		return 0;
+
+	return extra * FLIP_NS_PER_SEC / b->avg;
+}
+
+/*
+ * next queue to fetch from: high priority queues strictly first, round
+ * robin among equals, throttled queues skipped, as are those in skip
+ * and those partway through a descriptor.  -1 when there is nothing to
+ * do now, *wait is then the ns until a throttled queue may go again, 0
+ * if none is throttled.
+ */
+static int flip_sq_pick(FLIPState *f, int64_t now, int64_t *wait, uint32_t skip)
+{
+	FLIPQueue *q;
+	int64_t w;
+	int prio, i, n;
+
+	*wait = 0;
+
+	for (prio = FLIP_PRIO_HIGH; prio >= FLIP_PRIO_NORMAL; prio--) {
+		for (i = 0; i < FLIP_QUEUES; i++) {
+			n = (f->sq_next + i) % FLIP_QUEUES;
+			q = &f->sq[n];
+			if (q->prio != prio || q->fault || q->cur.busy || (skip & (1u << n))
+			    || q->head == atomic_mb_read(&q->tail))
+				continue;
+
+			flip_bucket_leak(&q->bps, now - q->leak_ns);
+			flip_bucket_leak(&q->iops, now - q->leak_ns);
+			q->leak_ns = now;
+
+			w = MAX(flip_bucket_wait(&q->bps), flip_bucket_wait(&q->iops));
+			if (w) {
+				q->throttled_nr++;
+				*wait = *wait ? MIN(*wait, w) : w;
+				continue;
+			}
+
+			return n;
+		}
+	}
+
+	return -1;
+}
+
+/* throttled queues may go again, or the next step of a descriptor is due */
+static void flip_dma_timer(void *opaque)
+{
+	FLIPState *f = opaque;
+
+	qemu_bh_schedule(f->dma_bh);
+}
+
+/*
+ * next step of the descriptor a queue is partway through: an interval,
+ * then a progress completion.  false while it is not finished.
+ */
+static bool flip_dma_cur_run(FLIPState *f, FLIPQueue *q, uint32_t *posted)
+{
+	FLIPDmaCur *c = &q->cur;
+	FLIPDesc *d = &c->d;
+	bool ok;
+
+	if (!c->busy)
+		return true;
+
+	ok = flip_dma_step(f, c, MIN(d->len, c->done + flip_progress_step(d)));
+	if (ok && c->done < d->len) {
+		if (flip_cq_progress_room(f, &f->cq[d->cq])) {
+			flip_dma_post(f, d->cq, d->tag, FLIP_STS_PROGRESS, c->done, false, 0);
+			*posted |= 1u << d->cq;
+		}
+		return false;
+	}
+
+	c->busy = false;
+	f->cq[d->cq].inflight--;
+	flip_dma_post(f, d->cq, d->tag, ok ? FLIP_STS_OK : FLIP_STS_ERR, c->done,
+		      d->flags & FLIP_DESC_CRC, ~c->crc);
+	*posted |= 1u << d->cq;
+
+	return true;
+}
+
+/* drop the descriptors dma_bh is partway through, the ring goes away */
+static void flip_dma_cur_drop(FLIPState *f)
+{
+	int i;
+
+	for (i = 0; i < FLIP_QUEUES; i++) {
+		if (f->sq[i].cur.busy)
+			f->cq[f->sq[i].cur.d.cq].inflight--;
+		f->sq[i].cur.busy = false;
+	}
+	timer_del(f->cur_timer);
+}
+
+/*
+ * fetch descriptors until the queues are empty or throttled.  A queue
+ * whose descriptor is being stepped, or whose next descriptor has no
+ * room in its cq, is passed over and the others go on.
+ */
+static void flip_dma_run(void *opaque)
+{
+	FLIPState *f = opaque;
+	FLIPDesc d;
+	FLIPReq *req;
+	FLIPQueue *q;
+	FLIPCq *c;
+	GSList *jobs;
+	uint32_t mask = f->ring_size - 1;
+	uint32_t len, crc;
+	uint32_t posted = 0, skip = 0;
+	int st, prio, i;
+	int64_t now, wait = 0;
+	int n = 0;
+	bool utf8, stepping = false;
+
+	if (!(f->dma_ctrl & FLIP_CTRL_ENABLE))
+		return;
+
+	now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+	/* a step of each descriptor partway through, highest priority first */
+	for (prio = FLIP_PRIO_HIGH; prio >= FLIP_PRIO_NORMAL; prio--)
+		for (i = 0; i < FLIP_QUEUES; i++)
+			if (f->sq[i].prio == prio && !flip_dma_cur_run(f, &f->sq[i], &posted))
+				stepping = true;
+
+	/* acquire: descriptors up to each sq tail and cq slots below each cq head */
+	for (;;) {
+		n = flip_sq_pick(f, now, &wait, skip);
+		if (n < 0)
+			break;
+		q = &f->sq[n];
+		/* no tag to complete with: the queue stops until the guest rings it again */
+		if (flip_dma_read(f, q->base + q->head * sizeof(d), &d, sizeof(d))) {
+			q->fault = true;
+			continue;
+		}
+		le64_to_cpus(&d.src);
+		le64_to_cpus(&d.dst);
+		le32_to_cpus(&d.len);
+		le16_to_cpus(&d.flags);
+		le16_to_cpus(&d.tag);
+		le16_to_cpus(&d.src_nsg);
+		le16_to_cpus(&d.dst_nsg);
+		le16_to_cpus(&d.cq);
+		le16_to_cpus(&d.progress);
+
+		/* queues the guest did not set up complete on queue 0 */
+		if (d.cq >= FLIP_CQS || !f->cq[d.cq].base)
+			d.cq = 0;
+		c = &f->cq[d.cq];
+
+		/*
+		 * its completion queue is full counting the descriptors with
+		 * the workers: leave the descriptor for the next run
+		 */
+		if (((c->tail - atomic_mb_read(&c->head)) & mask) + c->inflight >= mask) {
+			f->full_nr++;
+			skip |= 1u << n;
+			continue;
+		}
+
+		atomic_set(&q->head, (q->head + 1) & mask);
+		if (f->trace)
+			flip_trace_desc(f, n, &d);
+
+		q->bps.level += d.len;
+		q->iops.level += 1;
+		f->sq_next = n + 1;
+
+		/* the output length is only known at the end */
+		utf8 = flip_conf_utf8(d.flags & FLIP_DESC_CONF);
+
+		if (f->workers && d.len && !utf8) {
+			jobs = NULL;
+			req = flip_req_prepare(f, &d, &jobs);
+			if (req) {
+				c->inflight++;
+				if (req->job_done)
+					QLIST_INSERT_HEAD(&f->progress, req, progress_next);
+				flip_work_queue(f, jobs, q->prio == FLIP_PRIO_HIGH);
+				continue;
+			}
+		}
+
+		/* more than an interval: in steps, its completion slot reserved */
+		if (flip_progress_step(&d) && d.len > flip_progress_step(&d) && !utf8) {
+			c->inflight++;
+			flip_dma_begin(&q->cur, &d);
+			q->cur.busy = true;
+			stepping = true;
+			continue;
+		}
+
+		len = 0;
+		st = flip_dma_convert(f, &d, &len, &crc);
+		flip_dma_post(f, d.cq, d.tag, st, len, d.flags & FLIP_DESC_CRC, crc);
+		posted |= 1u << d.cq;
+	}
+
+	if (n < 0 && wait)
+		timer_mod(f->qos_timer, now + wait);
+
+	/*
+	 * a bh rescheduled from here runs before the main loop lets go of
+	 * the global lock, a timer does not
+	 */
+	if (stepping)
+		timer_mod(f->cur_timer, now + 1);
+
+	flip_dma_notify(f, posted);
+}
+
+/* restart the buckets after a limit changed */
+static void flip_qos_update(FLIPState *f)
+{
+	int i;
+
+	for (i = 0; i < FLIP_QUEUES; i++) {
+		f->sq[i].bps.level = 0;
+		f->sq[i].iops.level = 0;
+	}
+
+	if (f->dma_bh)
+		qemu_bh_schedule(f->dma_bh);
+}
+
+/* drop the translations overlapping iova to iova | mask */
+static void flip_iotlb_flush(FLIPState *f, uint64_t iova, uint64_t mask)
+{
+	FLIPIotlbEntry *e;
+	int i;
+
+	for (i = 0; i < FLIP_IOTLB_SIZE; i++) {
+		e = &f->iotlb[i];
+		if (e->perm != IOMMU_NONE && e->iova <= (iova | mask) && iova <= (e->iova | e->mask))
+			e->perm = IOMMU_NONE;
+	}
+	f->iotlb_flushes++;
+}
+
+/*
+ * the guest changed a mapping of the vIOMMU.  Accesses from now on
+ * translate again, the stats page is mapped again if it moved.
+ */
+static void flip_iommu_notify(Notifier *n, void *data)
+{
+	FLIPState *f = container_of(n, FLIPState, iommu_notifier);
+	IOMMUTLBEntry *t = data;
+	uint64_t iova = t->iova & ~t->addr_mask;
+
+	flip_iotlb_flush(f, iova, t->addr_mask);
+	if (f->stats_base && f->stats_base <= (iova | t->addr_mask)
+	    && iova < f->stats_base + sizeof(FLIPStats))
+		flip_stats_map(f);
+}
+
+static void flip_dma_reset(FLIPState *f)
+{
+	int i;
+
+	flip_work_drain(f);
+	flip_dma_complete(f, false);
+	flip_dma_cur_drop(f);
+
+	f->dma_ctrl = 0;
+	f->dma_isr = 0;
+	for (i = 0; i < FLIP_QUEUES; i++) {
+		f->sq[i].head = f->sq[i].tail = 0;
+		f->sq[i].fault = false;
+		f->sq[i].prio = FLIP_PRIO_NORMAL;
+		f->sq[i].bps.level = f->sq[i].iops.level = 0;
+	}
+	for (i = 0; i < FLIP_CQS; i++) {
+		f->cq[i].head = f->cq[i].tail = 0;
+		f->cq[i].flags = 0;
+	}
+	f->full_nr = 0;
+	f->irq_nr = 0;
+	f->irq_level = 0;
+	f->stats_base = 0;
+	flip_stats_unmap(f);           /* the page and its reference, flip_reset comes here */
+	timer_del(f->qos_timer);
+	if (f->iommu)
+		flip_iotlb_flush(f, 0, ~0ULL);
+}
+
+static uint64_t flip_sq_read(FLIPState *f, int n, hwaddr reg)
+{
+	FLIPQueue *q = &f->sq[n];
+
+	switch (reg) {
+	case FLIP_SQ_BASE:
+		return (uint32_t)q->base;
+	case FLIP_SQ_BASE + 4:
+		return q->base >> 32;
+	case FLIP_SQ_TAIL:
+		return atomic_read(&q->tail);
+	case FLIP_SQ_HEAD:
+		return atomic_read(&q->head);
+	case FLIP_SQ_PRIO:
+		return q->prio;
+	default:
+		return 0;
+	}
+}
+
+static void flip_sq_write(FLIPState *f, int n, hwaddr reg, uint64_t val)
+{
+	FLIPQueue *q = &f->sq[n];
+
+	switch (reg) {
+	case FLIP_SQ_BASE:
+		q->base = (q->base & ~0xffffffffULL) | (uint32_t)val;
+		break;
+	case FLIP_SQ_BASE + 4:
+		q->base = (q->base & 0xffffffffULL) | (val << 32);
+		break;
+	case FLIP_SQ_TAIL:
+		if (f->dma_ctrl & FLIP_CTRL_ENABLE) {
+			q->fault = false;
+			atomic_mb_set(&q->tail, val & (f->ring_size - 1));
+			qemu_bh_schedule(f->dma_bh);
+		}
+		break;
+	case FLIP_SQ_PRIO:
+		q->prio = val ? FLIP_PRIO_HIGH : FLIP_PRIO_NORMAL;
+		break;
+	default:
+		break;
+	}
+}
+
+static bool flip_cqs_empty(FLIPState *f)
+{
+	int i;
+
+	/* polled queues do not hold the line */
+	for (i = 0; i < FLIP_CQS; i++)
+		if (!(f->cq[i].flags & FLIP_CQ_POLLED)
+		    && atomic_read(&f->cq[i].tail) != atomic_read(&f->cq[i].head))
+			return false;
+
+	return true;
+}
+
+static uint64_t flip_cq_read(FLIPState *f, int n, hwaddr reg)
+{
+	FLIPCq *c = &f->cq[n];
+
+	switch (reg) {
+	case FLIP_CQ_BASE:
+		return (uint32_t)c->base;
+	case FLIP_CQ_BASE + 4:
+		return c->base >> 32;
+	case FLIP_CQ_TAIL:
+		return atomic_read(&c->tail);
+	case FLIP_CQ_HEAD:
+		return atomic_read(&c->head);
+	case FLIP_CQ_FLAGS:
+		return c->flags;
+	default:
+		return 0;
+	}
+}
+
+static void flip_cq_write(FLIPState *f, int n, hwaddr reg, uint64_t val)
+{
+	FLIPCq *c = &f->cq[n];
+
+	switch (reg) {
+	case FLIP_CQ_BASE:
+		c->base = (c->base & ~0xffffffffULL) | (uint32_t)val;
+		break;
+	case FLIP_CQ_BASE + 4:
+		c->base = (c->base & 0xffffffffULL) | (val << 32);
+		break;
+	case FLIP_CQ_HEAD:
+		if (!(f->dma_ctrl & FLIP_CTRL_ENABLE))
+			break;
+		atomic_mb_set(&c->head, val & (f->ring_size - 1));
+		/* everything consumed, no need to read the isr */
+		if (flip_cqs_empty(f)) {
+			atomic_and(&f->dma_isr, ~FLIP_ISR_DMA);
+			smp_mb();
+			/* a completion posted meanwhile keeps the line up */
+			if (!flip_cqs_empty(f))
+				atomic_or(&f->dma_isr, FLIP_ISR_DMA);
+			flip_update_irq(f);
+		}
+		/* room in the cq again, resume a stalled ring */
+		qemu_bh_schedule(f->dma_bh);
+		break;
+	case FLIP_CQ_FLAGS:
+		c->flags = val & FLIP_CQ_POLLED;
+		break;
+	default:
+		break;
+	}
+}
+
+/* bus-master register read function */
+static uint64_t flip_mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+	FLIPState *f = opaque;
+	uint64_t ret = 0;
+
+	/* translation table window, little endian bytes */
+	if (addr >= FLIP_DMA_LUT_WIN && addr < FLIP_DMA_LUT_WIN + FLIP_LUT_LEN)
+		return ldl_le_p(&f->lut[addr - FLIP_DMA_LUT_WIN]);
+
+	if (addr >= FLIP_DMA_QUEUE && addr < FLIP_DMA_QUEUE + FLIP_QUEUES * FLIP_DMA_QUEUE_SIZE)
+		return flip_sq_read(f, (addr - FLIP_DMA_QUEUE) / FLIP_DMA_QUEUE_SIZE,
+				    (addr - FLIP_DMA_QUEUE) % FLIP_DMA_QUEUE_SIZE);
+
+	if (addr >= FLIP_DMA_CQ && addr < FLIP_DMA_CQ + FLIP_CQS * FLIP_DMA_CQ_SIZE)
+		return flip_cq_read(f, (addr - FLIP_DMA_CQ) / FLIP_DMA_CQ_SIZE,
+				    (addr - FLIP_DMA_CQ) % FLIP_DMA_CQ_SIZE);
+
+	switch (addr) {
+	case FLIP_DMA_CTRL:
+		ret = f->dma_ctrl;
+		break;
+	case FLIP_DMA_ISR:
+		ret = atomic_xchg(&f->dma_isr, 0);
+		flip_update_irq(f);
+		break;
+	case FLIP_DMA_RING_SIZE:
+		ret = f->ring_size;
+		break;
+	case FLIP_DMA_SQ_BASE:
+		ret = flip_sq_read(f, 0, FLIP_SQ_BASE);
+		break;
+	case FLIP_DMA_SQ_BASE + 4:
+		ret = flip_sq_read(f, 0, FLIP_SQ_BASE + 4);
+		break;
+	case FLIP_DMA_CQ_BASE:
+		ret = flip_cq_read(f, 0, FLIP_CQ_BASE);
+		break;
+	case FLIP_DMA_CQ_BASE + 4:
+		ret = flip_cq_read(f, 0, FLIP_CQ_BASE + 4);
+		break;
+	case FLIP_DMA_SQ_TAIL:
+		ret = flip_sq_read(f, 0, FLIP_SQ_TAIL);
+		break;
+	case FLIP_DMA_SQ_HEAD:
+		ret = flip_sq_read(f, 0, FLIP_SQ_HEAD);
+		break;
+	case FLIP_DMA_CQ_TAIL:
+		ret = flip_cq_read(f, 0, FLIP_CQ_TAIL);
+		break;
+	case FLIP_DMA_CQ_HEAD:
+		ret = flip_cq_read(f, 0, FLIP_CQ_HEAD);
+		break;
+	case FLIP_DMA_STATS:
+		ret = (uint32_t)f->stats_base;
+		break;
+	case FLIP_DMA_STATS + 4:
+		ret = f->stats_base >> 32;
+		break;
+	case FLIP_DMA_LUT:
+		ret = (uint32_t)f->lut_base;
+		break;
+	case FLIP_DMA_LUT + 4:
+		ret = f->lut_base >> 32;
+		break;
+	case FLIP_DMA_QUEUES:
+		ret = FLIP_QUEUES;
+		break;
+	case FLIP_DMA_CQS:
+		ret = FLIP_CQS;
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/* bus-master register write function */
+static void flip_mmio_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+{
+	FLIPState *f = opaque;
+	int i;
+
+	if (addr >= FLIP_DMA_LUT_WIN && addr < FLIP_DMA_LUT_WIN + FLIP_LUT_LEN) {
+		stl_le_p(&f->lut[addr - FLIP_DMA_LUT_WIN], val);
+		return;
+	}
+
+	if (addr >= FLIP_DMA_QUEUE && addr < FLIP_DMA_QUEUE + FLIP_QUEUES * FLIP_DMA_QUEUE_SIZE) {
+		flip_sq_write(f, (addr - FLIP_DMA_QUEUE) / FLIP_DMA_QUEUE_SIZE,
+			      (addr - FLIP_DMA_QUEUE) % FLIP_DMA_QUEUE_SIZE, val);
+		return;
+	}
+
+	if (addr >= FLIP_DMA_CQ && addr < FLIP_DMA_CQ + FLIP_CQS * FLIP_DMA_CQ_SIZE) {
+		flip_cq_write(f, (addr - FLIP_DMA_CQ) / FLIP_DMA_CQ_SIZE,
+			      (addr - FLIP_DMA_CQ) % FLIP_DMA_CQ_SIZE, val);
+		return;
+	}
+
+	switch (addr) {
+	case FLIP_DMA_CTRL:
+		if ((val & FLIP_CTRL_ENABLE) && !(f->dma_ctrl & FLIP_CTRL_ENABLE)) {
+			/* ring size must be a power of 2 */
+			if (f->ring_size < 2 || f->ring_size > FLIP_RING_MAX
+			    || (f->ring_size & (f->ring_size - 1)))
+				break;
+			/* nothing from the previous ring may be posted into this one */
+			flip_work_drain(f);
+			flip_dma_complete(f, false);
+			flip_dma_cur_drop(f);
+			for (i = 0; i < FLIP_QUEUES; i++) {
+				f->sq[i].head = f->sq[i].tail = 0;
+				f->sq[i].fault = false;
+			}
+			for (i = 0; i < FLIP_CQS; i++)
+				f->cq[i].head = f->cq[i].tail = 0;
+			f->dma_ctrl = val;
+			flip_numa_follow(f);
+			break;
+		}
+		f->dma_ctrl = val;
+		break;
+	case FLIP_DMA_RING_SIZE:
+		if (!(f->dma_ctrl & FLIP_CTRL_ENABLE))
+			f->ring_size = val;
+		break;
+	case FLIP_DMA_SQ_BASE:
+		flip_sq_write(f, 0, FLIP_SQ_BASE, val);
+		break;
+	case FLIP_DMA_SQ_BASE + 4:
+		flip_sq_write(f, 0, FLIP_SQ_BASE + 4, val);
+		break;
+	case FLIP_DMA_CQ_BASE:
+		flip_cq_write(f, 0, FLIP_CQ_BASE, val);
+		break;
+	case FLIP_DMA_CQ_BASE + 4:
+		flip_cq_write(f, 0, FLIP_CQ_BASE + 4, val);
+		break;
+	case FLIP_DMA_SQ_TAIL:
+		flip_sq_write(f, 0, FLIP_SQ_TAIL, val);
+		break;
+	case FLIP_DMA_CQ_HEAD:
+		flip_cq_write(f, 0, FLIP_CQ_HEAD, val);
+		break;
+	case FLIP_DMA_STATS:
+		f->stats_base = (f->stats_base & ~0xffffffffULL) | (uint32_t)val;
+		flip_stats_map(f);
+		break;
+	case FLIP_DMA_STATS + 4:
+		f->stats_base = (f->stats_base & 0xffffffffULL) | (val << 32);
+		flip_stats_map(f);
+		break;
+	case FLIP_DMA_LUT:
+		f->lut_base = (f->lut_base & ~0xffffffffULL) | (uint32_t)val;
+		break;
+	case FLIP_DMA_LUT + 4:
+		f->lut_base = (f->lut_base & 0xffffffffULL) | (val << 32);
+		flip_lut_load(f);
+		break;
+	case FLIP_DMA_SHM_KICK:
+		/* with kvm the ioeventfd takes this write, it never gets here */
+		if (f->shm)
+			event_notifier_set(&f->shm_kick);
+		break;
+	default:
+		break;
+	}
+}
+
+static uint64_t flip_mmio_read_op(void *opaque, hwaddr addr, unsigned size)
+{
+	uint64_t ret = flip_mmio_read(opaque, addr, size);
+
+	flip_trace_access(opaque, FLIP_TRACE_MMIO_READ, addr, size, ret);
+	return ret;
+}
+
+static void flip_mmio_write_op(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+{
+	flip_trace_access(opaque, FLIP_TRACE_MMIO_WRITE, addr, size, val);
+	flip_mmio_write(opaque, addr, val, size);
+}
+
+const MemoryRegionOps flip_mmio_ops = {
+	.read = flip_mmio_read_op,
+	.write = flip_mmio_write_op,
+	.endianness = DEVICE_LITTLE_ENDIAN,
+	.impl.min_access_size = 4,
+	.impl.max_access_size = 4,
+	.valid.min_access_size = 4,
+	.valid.max_access_size = 4,
+};
+
+/*
+ * shared conversion service, property server.  The guest's rings and
+ * data live in a slot of the server's shared memory, mapped as BAR 3;
+ * all the device does is pass doorbells between the two.
+ */
+
+#define FLIP_SHM_RESET_NS  5000000LL          /* wait for the server at reset, under the global lock */
+
+/* the server posted completions into the slot */
+static void flip_shm_done(void *opaque)
+{
+	FLIPState *f = opaque;
+
+	event_notifier_test_and_clear(&f->shm_done);
+	atomic_or(&f->dma_isr, FLIP_ISR_SHM);
+	flip_update_irq(f);
+}
+
+/* the hello and the shared memory, kick and done descriptors */
+static int flip_shm_recv(int sock, FLIPShmHello *h, int *fds)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = h;
+	iov.iov_len = sizeof(*h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do {
+		n = recvmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+	if (n != sizeof(*h) || le32_to_cpu(h->magic) != FLIP_SHM_MAGIC
+	    || le32_to_cpu(h->version) != FLIP_SHM_VERSION) {
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* get a slot from the server and map it, blocking: the server is local */
+static int flip_shm_connect(FLIPState *f)
+{
+	FLIPShmHello h;
+	int fds[3];
+
+	f->shm_sock = unix_connect(f->server, NULL);
+	if (f->shm_sock < 0) {
+		error_report("flip: can not connect to server %s", f->server);
+		return -1;
+	}
+
+	if (flip_shm_recv(f->shm_sock, &h, fds) < 0) {
+		error_report("flip: bad hello from server %s", f->server);
+		goto fail;
+	}
+
+	f->shm_size = le64_to_cpu(h.size);
+	f->shm = mmap(NULL, f->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0],
+		      le64_to_cpu(h.offset));
+	close(fds[0]);
+	if (!is_power_of_2(f->shm_size) || f->shm == MAP_FAILED) {
+		error_report("flip: can not map slot %u of server %s", le32_to_cpu(h.slot),
+			     f->server);
+		if (f->shm != MAP_FAILED)
+			munmap(f->shm, f->shm_size);
+		f->shm = NULL;
+		close(fds[1]);
+		close(fds[2]);
+		goto fail;
+	}
+
+	event_notifier_init_fd(&f->shm_kick, fds[1]);
+	event_notifier_init_fd(&f->shm_done, fds[2]);
+	qemu_set_fd_handler(fds[2], flip_shm_done, NULL, f);
+
+	return 0;
+
+fail:
+	close(f->shm_sock);
+	return -1;
+}
+
+static void flip_shm_disconnect(FLIPState *f)
+{
+	qemu_set_fd_handler(event_notifier_get_fd(&f->shm_done), NULL, NULL, NULL);
+	event_notifier_cleanup(&f->shm_done);
+	event_notifier_cleanup(&f->shm_kick);
+	munmap(f->shm, f->shm_size);
+	f->shm = NULL;
+	/* the server frees the slot */
+	close(f->shm_sock);
+}
+
+/*
+ * the guest starts over on the indices it finds in the slot.  Let the
+ * server take what is still queued, so that it never moves sq_head past
+ * a tail we rewound, and drop what it posted.
+ */
+static void flip_shm_reset(FLIPState *f)
+{
+	FLIPShmRing *r = f->shm;
+	int64_t end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + FLIP_SHM_RESET_NS;
+
+	if (!r)
+		return;
+
+	while (atomic_read(&r->sq_head) != atomic_read(&r->sq_tail)
+	       && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end)
+		g_usleep(100);
+
+	/*
+	 * server gone or stuck: its late completions would land in the next
+	 * boot's ring, fail the slot so the driver does not take it again
+	 */
+	if (atomic_read(&r->sq_head) != atomic_read(&r->sq_tail)) {
+		error_report("flip: server slot %u did not drain at reset, slot failed",
+			     le32_to_cpu(r->slot));
+		atomic_set(&r->magic, 0);
+	}
+
+	atomic_set(&r->sq_tail, atomic_read(&r->sq_head));
+	smp_mb();
+	atomic_set(&r->cq_head, atomic_read(&r->cq_tail));
+}
+
+/* device reset function */
+static void flip_reset(void *opaque)
+{
+	FLIPState *f = opaque;
+	int i;
+
+	/* default upper case */
+	f->conf = FLIP_CONF_UP;
+	f->fliped_nr = 0;
+
+	/* identity table until the guest loads one */
+	for (i = 0; i < FLIP_LUT_LEN; i++)
+		f->lut[i] = i;
+	f->lut_base = 0;
+
+	/* the vcpus are stopped, both sides are quiescent */
+	memset(&f->in, 0, sizeof(f->in));
+	memset(&f->out, 0, sizeof(f->out));
+	timer_del(f->flip_timer);
+
+	flip_dma_reset(f);
+	flip_shm_reset(f);
+
+	qemu_irq_lower(f->irq);
+}
+
+/*
+ * flip convert function, consumer of in and producer of out.  Whatever
+ * the vcpus queued since the last run is converted in one go, a run at
+ * a time where neither fifo wraps.
+ */
+static void flip_callback(void *opaque)
+{
+	FLIPState *f = opaque;
+	uint8_t conf = atomic_read(&f->conf);
+	uint32_t n, run, src, dst;
+
+	n = flip_fifo_used(&f->in);
+	if (!n)
+		return;
+
+	/* out not read away yet, the next FLIP_REG_OUT read kicks us again */
+	n = MIN(n, flip_fifo_room(&f->out));
+	if (!n)
+		return;
+
+	while (n) {
+		src = f->in.head % FLIP_FIFO_LEN;
+		dst = f->out.tail % FLIP_FIFO_LEN;
+		run = MIN(n, MIN(FLIP_FIFO_LEN - src, FLIP_FIFO_LEN - dst));
+
+		flip_convert(f, &f->out.data[dst], &f->in.data[src], run, conf);
+		flip_fifo_pop(&f->in, run);
+		flip_fifo_push(&f->out, run);
+		f->fliped_nr += run;
+		n -= run;
+	}
+
+	/* after convertion, trigger a irq */
+	flip_update_irq(f);
+}
+
+/* instance init function */
+static int flip_pci_init(PCIDevice *dev)
+{
+	PCIFLIPState *pf = DO_UPCAST(PCIFLIPState, dev, dev);
+	FLIPState *f = &pf->state;
+	AddressSpace *as;
+	int i;
+
+	/* connect to INTA pin*/
+	//pf->dev.config[PCI_INTERRUPT_PIN] = 0x01; /* INTA */
+	pci_config_set_interrupt_pin(pf->dev.config, 0x1);
+	//f->irq = pf->dev.irq[0]; /* INTA */
+
+	if (f->node >= 0 && !flip_numa_valid(f->node)) {
+		error_report("flip: no host NUMA node %d", f->node);
+		return -1;
+	}
+
+	/* server mode, before anything needs undoing */
+	if (f->server && flip_shm_connect(f) < 0)
+		return -1;
+
+	f->irq = pci_allocate_irq(dev);
+
+	/* init the timer */
+	f->flip_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *)flip_callback, f);
+	/* bus-master ring processing */
+	f->dma_bh = qemu_bh_new(flip_dma_run, f);
+	/* page aligned, they are moved between nodes */
+	f->dma_buf = qemu_memalign(getpagesize(), FLIP_DMA_CHUNK);
+	f->utf8_buf = qemu_memalign(getpagesize(), FLIP_UTF8_BUF_LEN);
+	f->numa_node = -1;
+	if (f->node >= 0)
+		flip_numa_place(f, f->node);
+
+	/* a vIOMMU in front of the device: keep its translations */
+	as = pci_device_iommu_address_space(dev);
+	if (f->iotlb_on && memory_region_is_iommu(as->root)) {
+		f->iommu = as->root;
+		f->iommu_notifier.notify = flip_iommu_notify;
+		memory_region_register_iommu_notifier(f->iommu, &f->iommu_notifier);
+	}
+	f->qos_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, flip_dma_timer, f);
+	f->cur_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, flip_dma_timer, f);
+	flip_work_init(f);
+	flip_trace_open(f);
+	/* register reset function */
+	qemu_register_reset(flip_reset, f);
+	/* register ioport */
+	memory_region_init_io(&f->io, OBJECT(pf), &flip_io_ops, f, "flip", 16);
+
+	/* register bus-master registers */
+	memory_region_init_io(&f->mmio, OBJECT(pf), &flip_mmio_ops, f, "flip-mmio", FLIP_MMIO_SIZE);
+
+	/* register PCI bar */
+	pci_register_bar(&pf->dev, 0, PCI_BASE_ADDRESS_SPACE_IO, &f->io);
+	pci_register_bar(&pf->dev, 1, PCI_BASE_ADDRESS_SPACE_MEMORY, &f->mmio);
+
+	/* a vector per completion queue, INTx keeps working without */
+	if (msix_init_exclusive_bar(dev, FLIP_CQS, FLIP_MSIX_BAR) == 0) {
+		for (i = 0; i < FLIP_CQS; i++)
+			msix_vector_use(dev, i);
+	}
+
+	/* server mode: the slot as BAR 3, the doorbell straight to the server's eventfd */
+	if (f->shm) {
+		memory_region_init_ram_ptr(&f->shm_bar, OBJECT(pf), "flip-shm", f->shm_size, f->shm);
+		pci_register_bar(&pf->dev, 3, PCI_BASE_ADDRESS_SPACE_MEMORY
+				 | PCI_BASE_ADDRESS_MEM_PREFETCH, &f->shm_bar);
+		if (kvm_enabled())
+			memory_region_add_eventfd(&f->mmio, FLIP_DMA_SHM_KICK, 4, false, 0,
+						  &f->shm_kick);
+		error_setg(&f->shm_blocker, "pci-flip: server mode does not support migration");
+		migrate_add_blocker(f->shm_blocker);
+	}
+
+	return 0;
+
+}
+
+/* instance destroy function */
+static void flip_pci_exit(PCIDevice *dev)
+{
+	PCIFLIPState *pf = DO_UPCAST(PCIFLIPState, dev, dev);
+	FLIPState *f = &pf->state;
+	
+	qemu_unregister_reset(flip_reset, f);
+	flip_work_exit(f);
+	flip_trace_close(f);
+	flip_stats_unmap(f);
+	timer_del(f->qos_timer);
+	timer_free(f->qos_timer);
+	timer_del(f->cur_timer);
+	timer_free(f->cur_timer);
+	qemu_bh_delete(f->dma_bh);
+	qemu_vfree(f->dma_buf);
+	qemu_vfree(f->utf8_buf);
+	if (f->iommu)
+		memory_region_unregister_iommu_notifier(&f->iommu_notifier);
+	msix_uninit_exclusive_bar(dev);
+	if (f->shm) {
+		migrate_del_blocker(f->shm_blocker);
+		error_free(f->shm_blocker);
+		if (kvm_enabled())
+			memory_region_del_eventfd(&f->mmio, FLIP_DMA_SHM_KICK, 4, false, 0,
+						  &f->shm_kick);
+		memory_region_destroy(&f->shm_bar);
+		flip_shm_disconnect(f);
+	}
+	memory_region_destroy(&f->mmio);
+	memory_region_destroy(&f->io);
+	
+}
+
+/* queue limits, QOM properties so that qom-set can change them at run time */
+
+static void flip_get_limit(Object *obj, Visitor *v, void *opaque,
+			   const char *name, Error **errp)
+{
+	visit_type_uint64(v, opaque, name, errp);
+}
+
+static void flip_set_limit(Object *obj, Visitor *v, void *opaque,
+			   const char *name, Error **errp)
+{
+	PCIFLIPState *pf = DO_UPCAST(PCIFLIPState, dev, PCI_DEVICE(obj));
+	Error *local_err = NULL;
+	uint64_t value;
+
+	visit_type_uint64(v, &value, name, &local_err);
+	if (local_err) {
+		error_propagate(errp, local_err);
+		return;
+	}
+
+	*(uint64_t *)opaque = value;
+	flip_qos_update(&pf->state);
+}
+
+static void flip_add_limit(Object *obj, int n, const char *what, uint64_t *field)
+{
+	char *name = g_strdup_printf("q%d-%s", n, what);
+
+	object_property_add(obj, name, "uint64", flip_get_limit, flip_set_limit,
+			    NULL, field, NULL);
+	g_free(name);
+}
+
+/* read only, for qom-get */
+static void flip_add_counter(Object *obj, const char *name, uint64_t *field)
+{
+	object_property_add(obj, name, "uint64", flip_get_limit, NULL, NULL, field, NULL);
+}
+
+/* q<n>-bps, q<n>-bps-max, q<n>-iops, q<n>-iops-max for every queue, and the IOTLB counters */
+static void flip_pci_instance_init(Object *obj)
+{
+	PCIFLIPState *pf = DO_UPCAST(PCIFLIPState, dev, PCI_DEVICE(obj));
+	FLIPQueue *q;
+	int i;
+
+	for (i = 0; i < FLIP_QUEUES; i++) {
+		q = &pf->state.sq[i];
+		flip_add_limit(obj, i, "bps", &q->bps.avg);
+		flip_add_limit(obj, i, "bps-max", &q->bps.max);
+		flip_add_limit(obj, i, "iops", &q->iops.avg);
+		flip_add_limit(obj, i, "iops-max", &q->iops.max);
+	}
+
+	flip_add_counter(obj, "iotlb-hits", &pf->state.iotlb_hits);
+	flip_add_counter(obj, "iotlb-misses", &pf->state.iotlb_misses);
+	flip_add_counter(obj, "iotlb-flushes", &pf->state.iotlb_flushes);
+	flip_add_counter(obj, "in-dropped", &pf->state.in_dropped);
+}
+
+static Property flip_properties[] = {
+	DEFINE_PROP_UINT32("workers", PCIFLIPState, state.workers, 0),
+	DEFINE_PROP_STRING("trace", PCIFLIPState, state.trace_path),
+	DEFINE_PROP_BOOL("trace-payload", PCIFLIPState, state.trace_payload, false),
+	DEFINE_PROP_STRING("server", PCIFLIPState, state.server),
+	DEFINE_PROP_BOOL("iotlb", PCIFLIPState, state.iotlb_on, true),
+	DEFINE_PROP_INT32("node", PCIFLIPState, state.node, -1),
+	DEFINE_PROP_END_OF_LIST(),
+};
+
 /* class init function */
 static void flip_pci_class_initfn(ObjectClass *klass, void *data)
 {
@@ -261,10 +2415,11 @@ static void flip_pci_class_initfn(ObjectClass *klass, void *data)
 	pc->exit = flip_pci_exit;                       /* instance destroy */
 	pc->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;  /* set vendor id */
 	pc->device_id = PCI_FLIP_DEVICE_ID;             /* set device id */
-	pc->revision = 1;                               /* reversion */
+	pc->revision = 11;
 	pc->class_id = PCI_CLASS_SYSTEM_OTHER;          /* class code */
 
 	dc->desc = "simple character flip device";      /* device description */
+	dc->props = flip_properties;                    /* workers=N, trace=file, server=socket, iotlb=off, node=N */
 }
 
 /* TypeInfo */
@@ -272,6 +2427,7 @@ static const TypeInfo flip_pci_info = {
 	.name           = "pci-flip",
 	.parent         = TYPE_PCI_DEVICE,
 	.instance_size  = sizeof(PCIFLIPState),
+	.instance_init  = flip_pci_instance_init,
 	.class_init     = flip_pci_class_initfn,
 };
 
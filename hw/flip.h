@@ -11,27 +11,328 @@
 #include "hw/pci/pci.h"
 #include "sysemu/sysemu.h"
 #include "exec/memory.h"
+#include "sysemu/dma.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "flip-conv.h"
+#include "flip-trace.h"
+#include "flip-shm.h"
+#include "qemu/event_notifier.h"
+
+/*
+ * PCI revision, what each one added:
+ *  2  bus-master
+ *  3  the translation table
+ *  4  submission queues
+ *  5  server mode
+ *  6  completion queues
+ *  7  the deep port fifo
+ *  8  progress
+ *  9  polled completion queues
+ * 10  UTF-8 modes
+ * 11  the host node in the stats page
+ */
 
 #define FLIP_REG_LEN   4       /* 32 bits register */
 
-typedef struct FLIPState{
+#define FLIP_MMIO_SIZE     0x1000  /* bus-master register BAR */
+#define FLIP_RING_MAX      1024    /* max descriptors in a ring */
+#define FLIP_DMA_CHUNK     65536   /* bytes per conversion step */
+#define FLIP_UTF8_IN       (FLIP_DMA_CHUNK + FLIP_UTF8_SEQ)  /* a step and the sequence carried over */
+#define FLIP_WORKERS_MAX   64      /* upper bound of the workers property */
+#define FLIP_WORK_CHUNK    (256 << 10)  /* large descriptors are split in jobs of this size */
+#define FLIP_QUEUES        4       /* submission queues */
+#define FLIP_CQS           16      /* completion queues, msi-x vector n for queue n */
+#define FLIP_MSIX_BAR      4
+#define FLIP_IOTLB_SIZE    256     /* device IOTLB entries, direct mapped by IOVA page */
+#define FLIP_IOTLB_SHIFT   12      /* the index takes the IOVA from this bit */
+
+/* bus-master descriptor, little endian in guest memory */
+typedef struct FLIPDesc {
+	uint64_t src;          /* source address, sg table if FLIP_DESC_SG */
+	uint64_t dst;          /* destination address, sg table if FLIP_DESC_SG, unused if FLIP_DESC_INPLACE */
+	uint32_t len;          /* bytes to convert */
+	uint16_t flags;        /* conversion mode and FLIP_DESC_* flags */
+	uint16_t tag;          /* echoed back in the completion */
+	uint16_t src_nsg;      /* sg entries at src */
+	uint16_t dst_nsg;      /* sg entries at dst */
+	uint16_t cq;           /* completion queue to post to */
+	uint16_t progress;     /* KiB between FLIP_STS_PROGRESS completions, 0 for none */
+} FLIPDesc;
+
+/* scatter-gather entry */
+typedef struct FLIPSge {
+	uint64_t addr;
+	uint32_t len;
+	uint32_t rsvd;
+} FLIPSge;
+
+/* statistics page, written by the device into guest memory */
+typedef struct FLIPStats {
+	uint32_t sq_head;      /* next descriptor the device fetches */
+	uint32_t cq_tail;      /* next completion the device fills */
+	uint32_t state;        /* same as FLIP_REG_STATE */
+	uint32_t node;         /* host NUMA node + 1 of the workers and buffers, 0 unknown */
+	uint64_t fliped_nr;    /* total characters fliped */
+	uint64_t full_nr;      /* times a queue was found full */
+	uint64_t irq_nr;       /* interrupts raised */
+	uint32_t cqn_tail[FLIP_CQS];  /* cq_tail of every completion queue */
+} FLIPStats;
+
+/* completion entry */
+typedef struct FLIPCompl {
+	uint16_t tag;          /* tag of the finished descriptor */
+	uint16_t status;       /* FLIP_STS_* */
+	uint32_t len;          /* bytes written to dst, converted so far for FLIP_STS_PROGRESS */
+	uint32_t crc;          /* crc32c of the output if FLIP_DESC_CRC */
+	uint32_t rsvd;
+} FLIPCompl;
+
+typedef struct FLIPState FLIPState;
+
+/* a guest range mapped for a descriptor handed to the workers */
+typedef struct FLIPMap {
+	void *p;
+	uint32_t len;
+	DMADirection dir;
+} FLIPMap;
+
+/* a descriptor in the hands of the workers, freed by the completion bh */
+typedef struct FLIPReq {
+	FLIPDesc d;
+	int jobs;              /* jobs not finished yet, atomic */
+	uint32_t crc;          /* running crc, FLIP_DESC_CRC descriptors are one job */
+	uint8_t lut[FLIP_LUT_LEN];  /* table at fetch time, FLIP_CONF_LUT only */
+	FLIPMap *maps;
+	int nr_maps;
+	QSIMPLEQ_ENTRY(FLIPReq) next;  /* done list */
+
+	/* progress completions, only for a descriptor cut into several jobs */
+	int nr_jobs;
+	uint32_t *job_end;     /* output offset at the end of each job */
+	int *job_done;         /* set by the worker, atomic */
+	int next_job;          /* first job not seen finished, bh side */
+	uint32_t progress;     /* offset last posted */
+	QLIST_ENTRY(FLIPReq) progress_next;  /* on FLIPState.progress while running */
+} FLIPReq;
+
+/* contiguous piece of a job, both sides already mapped */
+typedef struct FLIPPiece {
+	const uint8_t *src;
+	uint8_t *dst;
+	uint32_t len;
+} FLIPPiece;
+
+/* unit of work, at most FLIP_WORK_CHUNK bytes of one descriptor */
+typedef struct FLIPJob {
+	FLIPReq *req;
+	int idx;               /* in the descriptor, for progress */
+	FLIPPiece *pieces;
+	int nr_pieces;
+	uint32_t len;
+	QTAILQ_ENTRY(FLIPJob) next;
+} FLIPJob;
+
+/*
+ * Each worker owns two queues, both first in first out.  Small
+ * descriptors go on small, which is taken first, so a huge request does
+ * not hold back small ones behind it, chunks of large ones on jobs.  An
+ * idle worker steals the oldest small job of another, or the newest
+ * chunk, the one its owner gets to last.
+ */
+typedef struct FLIPWorker {
+	FLIPState *f;
+	QemuThread thread;
+	QemuMutex lock;        /* protects small and jobs */
+	QTAILQ_HEAD(, FLIPJob) small;
+	QTAILQ_HEAD(FLIPJobList, FLIPJob) jobs;
+	int queued;            /* jobs on both, atomic, a hint for thieves */
+} FLIPWorker;
+
+/*
+ * leaky bucket as in QEMU's block throttling: every descriptor adds to
+ * level, which drains at avg per second.  A queue is held back while
+ * level is above max, the burst allowance.
+ */
+typedef struct FLIPBucket {
+	uint64_t avg;          /* bytes or ops per second, 0 is unlimited */
+	uint64_t max;          /* burst, avg / 10 when 0 */
+	double level;
+} FLIPBucket;
+
+/* walks the src or dst side of a descriptor, linear or scatter-gather */
+typedef struct FLIPSgIter {
+	uint64_t table;        /* sg table address, 0 for a linear buffer */
+	uint16_t nsg;          /* entries left in the table */
+	uint64_t addr;         /* current segment */
+	uint32_t left;         /* bytes left in the current segment */
+} FLIPSgIter;
+
+/*
+ * a descriptor dma_bh converts in steps.  One asking for progress gets
+ * an interval per run, so the global lock is dropped in between.  Its
+ * queue waits for it, the other queues go on.
+ */
+typedef struct FLIPDmaCur {
+	bool busy;
+	FLIPDesc d;
+	FLIPSgIter src, dst;
+	uint32_t done;         /* bytes converted */
+	uint32_t crc;          /* running, FLIP_DESC_CRC */
+} FLIPDmaCur;
+
+/*
+ * a vIOMMU translation the device keeps, as an ATS device would.  Valid
+ * unless perm is IOMMU_NONE, dropped when the IOMMU notifies a change.
+ */
+typedef struct FLIPIotlbEntry {
+	uint64_t iova;         /* start of the mapping */
+	uint64_t addr;         /* where it starts in iotlb_as */
+	uint64_t mask;         /* size of the mapping - 1 */
+	IOMMUAccessFlags perm;
+} FLIPIotlbEntry;
+
+/* completion queue, set up by the guest like the submission queues */
+typedef struct FLIPCq {
+	uint64_t base;         /* ring address */
+	uint32_t head;         /* next completion the guest will consume, vcpu side */
+	uint32_t tail;         /* next completion slot to fill, conversion side */
+	uint32_t inflight;     /* slots reserved by descriptors with the workers, bh side */
+	uint32_t flags;        /* FLIP_CQ_* */
+} FLIPCq;
+
+/* submission queue, limits are QOM properties q<n>-bps and so on */
+typedef struct FLIPQueue {
+	uint64_t base;         /* ring address */
+	uint32_t head;         /* next descriptor to fetch, conversion side */
+	uint32_t tail;         /* doorbell, vcpu side */
+	uint32_t prio;         /* FLIP_PRIO_*, set by the guest */
+	FLIPBucket bps;
+	FLIPBucket iops;
+	int64_t leak_ns;       /* last time the buckets drained */
+	uint64_t throttled_nr; /* times the queue was held back */
+	FLIPDmaCur cur;        /* descriptor dma_bh is partway through */
+	bool fault;            /* a descriptor could not be fetched, until the next doorbell */
+} FLIPQueue;
+
+#define FLIP_FIFO_LEN  (16 << 10)    /* bytes per port fifo, power of 2, takes a page of rep outsl */
+
+/*
+ * single-producer/single-consumer byte fifo.  head is written only by
+ * the consumer and tail only by the producer, both run free and the
+ * slot is index % FLIP_FIFO_LEN.  Data is published with a release
+ * store of tail and freed with a release store of head.
+ */
+typedef struct FLIPFifo {
+	uint32_t head;         /* consumer index */
+	uint32_t tail;         /* producer index */
+	uint8_t data[FLIP_FIFO_LEN];
+} FLIPFifo;
+
+/*
+ * Port registers are dispatched on the vcpu threads, conversion runs
+ * in the flip_timer callback.  in is produced by the vcpu side and
+ * consumed by the conversion side, out the other way round, so no lock
+ * is needed.  Port accesses are serialized by the global lock, which
+ * keeps the vcpu side a single producer/consumer however many vcpus
+ * hammer the device.
+ */
+struct FLIPState {
 	uint8_t conf;          /* configuration reg */
-	uint8_t state;         /* state reg */
 	uint64_t fliped_nr;    /* total character fliped */
 
-	uint8_t in_nr;         /* bytes count of input reg */
-	uint8_t out_nr;        /* bytes count of output reg */
-
-	uint8_t in[FLIP_REG_LEN];   /* input reg */
-	uint8_t out[FLIP_REG_LEN];  /* output reg */
+	FLIPFifo in;           /* input reg, vcpu -> conversion */
+	uint64_t in_dropped;   /* bytes written with in full, QOM property in-dropped */
+	FLIPFifo out;          /* output reg, conversion -> vcpu */
 
 	MemoryRegion io;       /* ioport used */
 	qemu_irq irq;          /* irq used */
 
-	QemuMutex lock;        /* write lock */
-
 	struct QEMUTimer *flip_timer;   /* dispatch timer */
-}FLIPState;
+
+	/* bus-master interface */
+	MemoryRegion mmio;     /* register BAR */
+	uint32_t dma_ctrl;     /* control reg */
+	uint32_t dma_isr;      /* interrupt status, read to clear */
+	uint32_t ring_size;    /* descriptors per ring */
+	FLIPQueue sq[FLIP_QUEUES];  /* submission queues, 0 is the original one */
+	uint32_t sq_next;      /* round robin among queues of equal priority */
+	struct QEMUTimer *qos_timer;  /* resumes throttled queues */
+	FLIPCq cq[FLIP_CQS];   /* completion queues, 0 is the original one */
+	uint8_t *dma_buf;      /* bounce buffer for what is not RAM, FLIP_DMA_CHUNK bytes */
+	uint8_t *utf8_buf;     /* FLIP_CONF_UTF8_* input, FLIP_UTF8_IN bytes, then its output */
+	QEMUBH *dma_bh;        /* ring processing */
+	struct QEMUTimer *cur_timer;  /* next steps of FLIPQueue.cur, once the vcpus had the lock */
+
+	/*
+	 * vIOMMU, property iotlb.  With it every dma of the device is
+	 * translated through the IOTLB, under the global lock: ring and sg
+	 * accesses, and the mappings the workers convert in.
+	 */
+	bool iotlb_on;         /* cache translations, off for IOMMUs that do not notify */
+	MemoryRegion *iommu;   /* NULL without a vIOMMU or with iotlb off */
+	AddressSpace *iotlb_as;  /* where translated addresses live */
+	Notifier iommu_notifier;
+	FLIPIotlbEntry iotlb[FLIP_IOTLB_SIZE];
+	uint64_t iotlb_hits;   /* QOM properties iotlb-hits and so on */
+	uint64_t iotlb_misses;
+	uint64_t iotlb_flushes;
+
+	/* statistics page */
+	uint64_t stats_base;   /* guest address, 0 when not registered */
+	FLIPStats *stats;      /* mapping of stats_base */
+	uint64_t full_nr;      /* times a queue was found full */
+	uint64_t irq_nr;       /* interrupts raised */
+	int irq_level;         /* current level of the irq line */
+
+	/* FLIP_CONF_LUT translation table */
+	uint8_t lut[FLIP_LUT_LEN];
+	uint64_t lut_base;     /* guest address of the last dma load */
+
+	/*
+	 * worker pool, property workers.  Guest memory is mapped and
+	 * completions are posted by bhs under the global lock, workers
+	 * only convert, so they complete out of order matched by tag.
+	 */
+	uint32_t workers;      /* threads, 0 converts in dma_bh */
+	FLIPWorker *worker;
+	uint32_t work_next;    /* round robin for new jobs */
+	QemuMutex work_lock;   /* protects the fields below, sleeping workers */
+	QemuCond work_cond;    /* jobs queued or stop */
+	QemuCond idle_cond;    /* work_busy dropped to 0 */
+	int work_pending;      /* jobs queued, not taken */
+	int work_busy;         /* jobs queued or running */
+	bool work_stop;
+	QemuMutex done_lock;   /* protects done */
+	QSIMPLEQ_HEAD(, FLIPReq) done;
+	QEMUBH *done_bh;       /* posts completions of finished descriptors */
+	QLIST_HEAD(, FLIPReq) progress;  /* with the workers, asking for progress */
+
+	/*
+	 * NUMA placement, property node.  -1 follows the host node of the
+	 * guest RAM holding submission ring 0, looked up when the rings are
+	 * enabled.  Workers move themselves before their next job.
+	 */
+	int32_t node;          /* host node to place on, -1 to follow the rings */
+	int numa_node;         /* where the workers and buffers are, -1 not placed */
+	int numa_gen;          /* bumped on every move, atomic */
+
+	/* workload capture, properties trace and trace-payload */
+	char *trace_path;      /* file to record into, NULL for none */
+	bool trace_payload;    /* also record descriptor source data */
+	FILE *trace;
+	int64_t trace_start;   /* realtime ns of the header */
+
+	/* shared conversion service, property server */
+	char *server;          /* unix socket of tools/flip_server, NULL converts here */
+	int shm_sock;          /* closing it frees the slot */
+	void *shm;             /* our slot, FLIPShmRing first */
+	uint64_t shm_size;
+	MemoryRegion shm_bar;  /* BAR 3 */
+	EventNotifier shm_kick;  /* to the server */
+	EventNotifier shm_done;  /* from the server */
+	Error *shm_blocker;    /* the slot can not move with us */
+};
 
 typedef struct PCIFLIPState {
 	PCIDevice dev;         /* inherits from PCIDevice */
@@ -39,5 +340,6 @@ typedef struct PCIFLIPState {
 }PCIFLIPState;
 
 extern const MemoryRegionOps flip_io_ops; /* io read / write functions */
+extern const MemoryRegionOps flip_mmio_ops; /* bus-master register functions */
 
 #endif
@@ -0,0 +1,328 @@
+#!/usr/bin/env python3
+#
+# flip_perf.py: headless end to end benchmark of the pci-flip device
+#
+# Builds a tiny initramfs holding guest/flip_pci.ko, a static flip_bench
+# and guest/flip_perf_init.c as /init, boots it with -device pci-flip,
+# without network or disk, and runs flip_bench over a matrix of request
+# sizes and queue depths.  Results go to a JSON file, and are checked
+# against a baseline when one is given or stored:
+#
+#   flip_perf.py --qemu ~/qemu/build/x86_64-softmmu/qemu-system-x86_64
+#   flip_perf.py --save-baseline        # keep this run as the baseline
+#   flip_perf.py                        # exits 1 on a regression
+#
+# The guest kernel defaults to the host's, flip_pci.ko is built against
+# --kdir, which must match it.  The kernel needs the 8250 console,
+# initramfs and devtmpfs built in, as distribution kernels have.
+# KVM is used when /dev/kvm is usable, TCG otherwise.
+#
+# --numa L,R runs the matrix twice under numactl, with the vCPUs and
+# guest RAM on host node L: once with the device on node=L, local, once
+# on node=R, remote, and shows the bandwidth of both.  Placement moves
+# the workers, so give --device-opts workers=N.  A one node host can be
+# booted with numa=fake=2 to try it.
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+
+TOP = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+GUEST = os.path.join(TOP, 'guest')
+BASELINE = os.path.join(TOP, 'tools', 'flip_perf_baseline.json')
+
+# flip_bench's table, see run() in guest/flip_bench.c
+COLUMNS = ('size', 'reqs', 'us_per_req', 'mbps', 'p50_us', 'p99_us', 'pool_ns', 'sg_ns', 'cpu')
+
+# compared against the baseline, True when higher is better
+METRICS = {'mbps': True, 'p50_us': False, 'p99_us': False}
+
+
+def die(msg):
+	print('flip_perf: ' + msg, file=sys.stderr)
+	sys.exit(2)
+
+
+def run(cmd, **kw):
+	print('+ ' + ' '.join(cmd))
+	if subprocess.call(cmd, **kw):
+		die('%s failed' % cmd[0])
+
+
+def build(args, work):
+	ko = args.module
+	if not ko:
+		run(['make', '-C', args.kdir, 'M=' + GUEST, 'modules'])
+		ko = os.path.join(GUEST, 'flip_pci.ko')
+
+	# static, the initramfs has no libc
+	bench = os.path.join(work, 'flip_bench')
+	init = os.path.join(work, 'init')
+	run(['gcc', '-O2', '-static', os.path.join(GUEST, 'flip_bench.c'),
+	     os.path.join(GUEST, 'libflipd.c'), '-o', bench, '-lpthread'])
+	run(['gcc', '-O2', '-static', os.path.join(GUEST, 'flip_perf_init.c'), '-o', init])
+
+	return ko, bench, init
+
+
+def cpio_entry(name, mode, data=b'', rdev=(0, 0)):
+	name = name.encode() + b'\0'
+	hdr = '070701' + ''.join('%08x' % v for v in (
+		0, mode, 0, 0, 1, 0, len(data), 0, 0, rdev[0], rdev[1], len(name), 0))
+	out = hdr.encode() + name
+	out += b'\0' * (-len(out) % 4)
+	out += data
+	out += b'\0' * (-len(out) % 4)
+	return out
+
+
+def initramfs(path, files):
+	with open(path, 'wb') as f:
+		for d in ('dev', 'proc', 'sys'):
+			f.write(cpio_entry(d, 0o040755))
+		# the kernel opens it for init before devtmpfs is mounted
+		f.write(cpio_entry('dev/console', 0o020600, rdev=(5, 1)))
+		for name, src, perm in files:
+			with open(src, 'rb') as s:
+				f.write(cpio_entry(name, 0o100000 | perm, s.read()))
+		f.write(cpio_entry('TRAILER!!!', 0))
+
+
+def accel(args):
+	if args.accel != 'auto':
+		return args.accel
+	return 'kvm' if os.access('/dev/kvm', os.R_OK | os.W_OK) else 'tcg'
+
+
+def boot(args, initrd, acc, device_opts, prefix=()):
+	append = ['console=ttyS0', 'quiet', 'panic=-1',
+		  'flipperf.sizes=' + args.sizes, 'flipperf.depths=' + args.depths,
+		  'flipperf.iters=%d' % args.iters, 'flipperf.dir=%d' % args.dir]
+	if args.bench_opts:
+		append.append('flipperf.extra=' + args.bench_opts.replace(' ', ':'))
+	if args.append:
+		append.append(args.append)
+
+	device = 'pci-flip' + (',' + device_opts if device_opts else '')
+	cmd = list(prefix) + [args.qemu, '-machine', 'accel=' + acc, '-smp', str(args.smp), '-m', str(args.mem),
+	       '-nographic', '-no-reboot', '-net', 'none',
+	       '-kernel', args.kernel, '-initrd', initrd, '-append', ' '.join(append),
+	       '-device', device] + shlex.split(args.qemu_opts)
+	if acc == 'kvm':
+		cmd[len(prefix) + 3:len(prefix) + 3] = ['-cpu', 'host']
+
+	print('+ ' + ' '.join(cmd))
+	try:
+		p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+				   stdin=subprocess.DEVNULL, timeout=args.timeout)
+	except subprocess.TimeoutExpired:
+		die('guest did not finish within %d s' % args.timeout)
+
+	return p.stdout.decode(errors='replace').replace('\r', '')
+
+
+def parse(console):
+	results, depth, ended = [], None, False
+
+	for line in console.splitlines():
+		m = re.match(r'@@flip-perf (\S+)', line)
+		if m:
+			if m.group(1).startswith('depth='):
+				depth = int(m.group(1)[6:])
+			elif m.group(1) == 'end':
+				ended = True
+			elif m.group(1) == 'error:':
+				die(line)
+			continue
+
+		f = line.split()
+		if depth is None or len(f) != len(COLUMNS) or not f[0].isdigit():
+			continue
+		r = {'depth': depth}
+		for k, v in zip(COLUMNS, f):
+			r[k] = None if v == '-' else float(v) if '.' in v else int(v)
+		results.append(r)
+
+	if not ended or not results:
+		sys.stdout.write(console)
+		die('no results from the guest')
+
+	return results
+
+
+def host_node(console):
+	m = re.search(r'^@@flip-perf host_node=(-?\d+)', console, re.M)
+	return int(m.group(1)) if m else None
+
+
+def numa_runs(args, initrd, acc):
+	try:
+		local, remote = (int(n) for n in args.numa.split(','))
+	except ValueError:
+		die('--numa wants two host nodes, e.g. 0,1')
+	if 'workers=' not in args.device_opts:
+		die('--numa needs workers=N in --device-opts, placement moves the workers')
+	numactl = shutil.which('numactl') or die('numactl not found')
+	prefix = [numactl, '--cpunodebind=%d' % local, '--membind=%d' % local]
+	runs = {}
+
+	for name, node in (('local', local), ('remote', remote)):
+		opts = ','.join(o for o in (args.device_opts, 'node=%d' % node) if o)
+		console = boot(args, initrd, acc, opts, prefix)
+		runs[name] = {'node': node, 'host_node': host_node(console),
+			      'results': parse(console)}
+		if runs[name]['host_node'] != node:
+			print('warning: %s run converted on node %s, asked for %d'
+			      % (name, runs[name]['host_node'], node))
+
+	return runs
+
+
+def numa_show(runs):
+	remote = {(r['size'], r['depth']): r for r in runs['remote']['results']}
+
+	print('guest on node %d, device on node %d (local) and %d (remote)'
+	      % (runs['local']['node'], runs['local']['node'], runs['remote']['node']))
+	print('%10s %6s %12s %12s %8s' % ('size', 'depth', 'local_mbps', 'remote_mbps', 'change'))
+	for r in runs['local']['results']:
+		b = remote.get((r['size'], r['depth']))
+		if not b or not r['mbps']:
+			continue
+		print('%10d %6d %12.2f %12.2f %+7.1f%%'
+		      % (r['size'], r['depth'], r['mbps'], b['mbps'],
+			 (b['mbps'] - r['mbps']) * 100.0 / r['mbps']))
+
+
+def compare(base, cur, threshold):
+	ref = {(r['size'], r['depth']): r for r in base['results']}
+	bad = 0
+
+	for k in ('accel', 'qemu', 'kernel', 'smp', 'numa'):
+		if base['meta'].get(k) != cur['meta'].get(k):
+			print('warning: %s differs from the baseline: %s, was %s'
+			      % (k, cur['meta'].get(k), base['meta'].get(k)))
+
+	print('%10s %6s %8s %12s %12s %8s' % ('size', 'depth', 'metric', 'baseline', 'now', 'change'))
+	for r in cur['results']:
+		b = ref.get((r['size'], r['depth']))
+		if not b:
+			continue
+		for m, higher in METRICS.items():
+			if not b.get(m) or r.get(m) is None:
+				continue
+			change = (r[m] - b[m]) * 100.0 / b[m]
+			worse = -change if higher else change
+			flag = ' REGRESSION' if worse > threshold else ''
+			bad += bool(flag)
+			print('%10d %6d %8s %12.2f %12.2f %+7.1f%%%s'
+			      % (r['size'], r['depth'], m, b[m], r[m], change, flag))
+
+	return bad
+
+
+def main():
+	rel = platform.release()
+	ap = argparse.ArgumentParser(description='headless flip benchmark runner')
+	ap.add_argument('--qemu', default=shutil.which('qemu-system-x86_64')
+			or os.path.expanduser('~/qemu/build/x86_64-softmmu/qemu-system-x86_64'))
+	ap.add_argument('--kernel', default='/boot/vmlinuz-' + rel, help='guest kernel image')
+	ap.add_argument('--kdir', default='/lib/modules/%s/build' % rel,
+			help='kernel tree to build flip_pci.ko against')
+	ap.add_argument('--module', help='prebuilt flip_pci.ko, skips the module build')
+	ap.add_argument('--accel', choices=('auto', 'kvm', 'tcg'), default='auto')
+	ap.add_argument('--smp', type=int, default=2)
+	ap.add_argument('--mem', type=int, default=512, help='guest MiB')
+	ap.add_argument('--sizes', default='64,4096,65536,1048576')
+	ap.add_argument('--depths', default='1,8,32', help='writes in flight, flip_bench -q')
+	ap.add_argument('--iters', type=int, default=500, help='requests per size and depth')
+	ap.add_argument('--dir', type=int, default=0, help='conversion mode, flip_bench -d')
+	ap.add_argument('--device-opts', default='', help='pci-flip properties, e.g. workers=4')
+	ap.add_argument('--bench-opts', default='', help='more flip_bench options, e.g. "-c -v"')
+	ap.add_argument('--qemu-opts', default='',
+			help='more qemu options, e.g. "-M q35 -device intel-iommu"')
+	ap.add_argument('--append', default='', help='more kernel options, e.g. intel_iommu=on')
+	ap.add_argument('--numa', metavar='L,R',
+			help='guest on host node L, compare the device on node L and node R')
+	ap.add_argument('--timeout', type=int, default=1800, help='seconds the guest may take')
+	ap.add_argument('--out', default='flip_perf.json')
+	ap.add_argument('--baseline', default=BASELINE)
+	ap.add_argument('--save-baseline', action='store_true', help='store this run as the baseline')
+	ap.add_argument('--threshold', type=float, default=10.0,
+			help='percent a metric may get worse before it is a regression')
+	args = ap.parse_args()
+
+	for path in (args.qemu, args.kernel):
+		if not os.path.exists(path):
+			die('%s not found' % path)
+	acc = accel(args)
+
+	work = tempfile.mkdtemp(prefix='flip_perf.')
+	try:
+		ko, bench, init = build(args, work)
+		initrd = os.path.join(work, 'initramfs.cpio')
+		initramfs(initrd, [('init', init, 0o755), ('flip_bench', bench, 0o755),
+				   ('flip_pci.ko', ko, 0o644)])
+		if args.numa:
+			runs = numa_runs(args, initrd, acc)
+		else:
+			console = boot(args, initrd, acc, args.device_opts)
+	finally:
+		shutil.rmtree(work)
+
+	cur = {
+		'meta': {
+			'date': datetime.datetime.now().isoformat(timespec='seconds'),
+			'host': platform.node(),
+			'accel': acc,
+			'qemu': os.path.abspath(args.qemu),
+			'kernel': os.path.abspath(args.kernel),
+			'smp': args.smp,
+			'iters': args.iters,
+			'dir': args.dir,
+			'device_opts': args.device_opts,
+			'qemu_opts': args.qemu_opts,
+			'bench_opts': args.bench_opts,
+		},
+	}
+	if args.numa:
+		# the local run is the one compared against the baseline
+		numa_show(runs)
+		cur['meta']['numa'] = args.numa
+		cur['results'] = runs['local']['results']
+		cur['numa'] = runs
+	else:
+		cur['meta']['host_node'] = host_node(console)
+		cur['results'] = parse(console)
+
+	with open(args.out, 'w') as f:
+		json.dump(cur, f, indent=1)
+	print('results in %s' % args.out)
+
+	if args.save_baseline:
+		with open(args.baseline, 'w') as f:
+			json.dump(cur, f, indent=1)
+		print('baseline stored in %s' % args.baseline)
+		return 0
+
+	if not os.path.exists(args.baseline):
+		print('no baseline at %s, --save-baseline stores one' % args.baseline)
+		return 0
+
+	with open(args.baseline) as f:
+		base = json.load(f)
+	bad = compare(base, cur, args.threshold)
+	print('%d regression%s beyond %.0f%%' % (bad, '' if bad == 1 else 's', args.threshold))
+
+	return 1 if bad else 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,273 @@
+/*
+ * replay a pci-flip workload trace against the conversion engine
+ *
+ * The device records a trace with -device pci-flip,trace=file and
+ * optionally trace-payload=on.  This runs every recorded descriptor and
+ * port word through hw/flip-conv.c, with no guest and no QEMU, and
+ * reports throughput and latency next to what the device saw.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+
+#include "flip-conv.h"
+#include "flip-trace.h"
+
+/* same as hw/flip.c */
+#define FLIP_REG_CONF      0x0
+#define FLIP_REG_IN        0x2
+#define FLIP_DMA_LUT_WIN   0x100
+#define FLIP_DESC_CONF     0xf
+#define FLIP_DESC_CRC      (0x1 << 5)
+#define FLIP_STS_PROGRESS  0x2
+
+#define FLIP_TAGS          65536
+
+/* growable list of latencies in ns */
+struct lat {
+	long long *v;
+	size_t n, max;
+};
+
+static void lat_add(struct lat *l, long long ns)
+{
+	if (l->n == l->max) {
+		l->max = l->max ? l->max * 2 : 1024;
+		l->v = realloc(l->v, l->max * sizeof(*l->v));
+		if (!l->v) {
+			printf("out of memory!\n");
+			exit(1);
+		}
+	}
+	l->v[l->n++] = ns;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void lat_print(const char *what, struct lat *l)
+{
+	if (!l->n) {
+		printf("%-18s -\n", what);
+		return;
+	}
+
+	qsort(l->v, l->n, sizeof(*l->v), cmp_ll);
+	printf("%-18s p50 %10.2f us  p99 %10.2f us  max %10.2f us\n", what,
+	       l->v[l->n / 2] / 1000.0, l->v[(l->n - 1) * 99 / 100] / 1000.0,
+	       l->v[l->n - 1] / 1000.0);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* buffers sized to the largest descriptor so far */
+static uint8_t *in_buf, *out_buf;
+static size_t buf_len;
+
+static void buf_reserve(size_t len)
+{
+	size_t i;
+
+	if (len <= buf_len)
+		return;
+
+	in_buf = realloc(in_buf, len);
+	out_buf = realloc(out_buf, len * FLIP_UTF8_GROWTH);
+	if (!in_buf || !out_buf) {
+		printf("out of memory!\n");
+		exit(1);
+	}
+
+	/* stand-in data for traces without payloads */
+	for (i = buf_len; i < len; i++)
+		in_buf[i] = "aBcDeFgHiJkLmNoPqRsTuVwXyZ0123456789 "[i % 37];
+	buf_len = len;
+}
+
+static void usage(void)
+{
+	printf("usage: flip_replay [-t] [-x speed] [-r repeat] trace\n");
+	printf("       -t: keep the recorded arrival times, latency includes waiting\n");
+	printf("           for the engine; default replays back to back\n");
+	printf("       -x: with -t, run the clock this many times faster\n");
+	printf("       -r: replay the trace this many times\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	static uint64_t fetch_ns[FLIP_TAGS];   /* recorded fetch time by tag */
+	uint8_t lut[FLIP_LUT_LEN];
+	struct lat replay = { 0 }, recorded = { 0 };
+	FLIPTraceHeader h;
+	FLIPTraceRec r;
+	FILE *fp;
+	long long start, arrive, t0, t1, busy = 0, last_ns = 0;
+	unsigned long long descs = 0, bytes = 0, port_bytes = 0, exits = 0;
+	double speed = 1.0;
+	int timed = 0, repeat = 1, conf = FLIP_CONF_UP;
+	uint32_t crc, w;
+	size_t n;
+	int opt, i, pass;
+
+	while ((opt = getopt(argc, argv, "tx:r:h")) != -1) {
+		switch (opt) {
+		case 't':
+			timed = 1;
+			break;
+		case 'x':
+			speed = atof(optarg);
+			if (speed <= 0)
+				usage();
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc)
+		usage();
+
+	fp = fopen(argv[optind], "rb");
+	if (!fp) {
+		printf("can not open '%s'!\n", argv[optind]);
+		exit(1);
+	}
+
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, FLIP_TRACE_MAGIC, 8)
+	    || le32toh(h.version) != FLIP_TRACE_VERSION) {
+		printf("'%s' is not a flip trace!\n", argv[optind]);
+		exit(1);
+	}
+
+	printf("trace: %s, %s\n", argv[optind],
+	       le32toh(h.flags) & FLIP_TRACE_F_PAYLOAD ? "with payloads" : "sizes only");
+
+	for (pass = 0; pass < repeat; pass++) {
+		fseek(fp, sizeof(h), SEEK_SET);
+		for (i = 0; i < FLIP_LUT_LEN; i++)
+			lut[i] = i;
+		conf = FLIP_CONF_UP;
+		start = now_ns();
+
+		while (fread(&r, sizeof(r), 1, fp) == 1) {
+			r.ns = le64toh(r.ns);
+			r.flags = le16toh(r.flags);
+			r.len = le32toh(r.len);
+			r.addr = le64toh(r.addr);
+			r.val = le64toh(r.val);
+			last_ns = r.ns;
+
+			switch (r.type) {
+			case FLIP_TRACE_PIO_WRITE:
+				exits++;
+				r.addr &= 0xf;
+				if (r.addr == FLIP_REG_CONF) {
+					conf = r.val & 0xff;
+				} else if (r.addr == FLIP_REG_IN) {
+					/* a port word goes through the engine like the timer does it */
+					w = htole32(r.val);
+					flip_conv((uint8_t *)&w, (uint8_t *)&w, r.size, conf, lut);
+					port_bytes += r.size;
+				}
+				break;
+			case FLIP_TRACE_PIO_READ:
+			case FLIP_TRACE_MMIO_READ:
+				exits++;
+				break;
+			case FLIP_TRACE_MMIO_WRITE:
+				exits++;
+				if (r.addr >= FLIP_DMA_LUT_WIN && r.addr + 4 <= FLIP_DMA_LUT_WIN + FLIP_LUT_LEN) {
+					w = htole32(r.val);
+					memcpy(&lut[r.addr - FLIP_DMA_LUT_WIN], &w, 4);
+				}
+				break;
+			case FLIP_TRACE_LUT:
+				if (r.len == FLIP_LUT_LEN && fread(lut, FLIP_LUT_LEN, 1, fp) == 1)
+					r.len = 0;
+				break;
+			case FLIP_TRACE_DESC:
+				buf_reserve(r.val);
+				if (r.len) {
+					if (r.len != r.val || fread(in_buf, r.len, 1, fp) != 1) {
+						printf("truncated payload at %llu ns\n", (unsigned long long)r.ns);
+						exit(1);
+					}
+					r.len = 0;
+				}
+				fetch_ns[r.addr % FLIP_TAGS] = r.ns;
+
+				arrive = start + (long long)(r.ns / speed);
+				if (timed)
+					while (now_ns() < arrive)
+						;
+
+				t0 = now_ns();
+				if (flip_conf_utf8(r.flags & FLIP_DESC_CONF)) {
+					n = flip_conv_utf8(out_buf, in_buf, r.val, r.flags & FLIP_DESC_CONF, 1, NULL);
+					if (r.flags & FLIP_DESC_CRC)
+						crc = ~flip_crc32c(~0, out_buf, n);
+				} else if (r.flags & FLIP_DESC_CRC)
+					crc = ~flip_conv_crc(out_buf, in_buf, r.val, r.flags & FLIP_DESC_CONF,
+							     lut, ~0);
+				else
+					flip_conv(out_buf, in_buf, r.val, r.flags & FLIP_DESC_CONF, lut);
+				t1 = now_ns();
+				(void)crc;
+
+				busy += t1 - t0;
+				lat_add(&replay, timed ? t1 - arrive : t1 - t0);
+				descs++;
+				bytes += r.val;
+				break;
+			case FLIP_TRACE_COMPL:
+				/* only the final completion ends the descriptor */
+				if (pass == 0 && r.flags != FLIP_STS_PROGRESS)
+					lat_add(&recorded, r.ns - fetch_ns[r.addr % FLIP_TAGS]);
+				break;
+			default:
+				break;
+			}
+
+			/* skip payloads we did not consume */
+			if (r.len)
+				fseek(fp, r.len, SEEK_CUR);
+		}
+	}
+
+	fclose(fp);
+
+	printf("recorded span      %.3f s\n", last_ns / 1e9);
+	printf("descriptors        %llu, %llu bytes\n", descs, bytes);
+	printf("port bytes         %llu\n", port_bytes);
+	printf("register accesses  %llu, %.2f per descriptor\n", exits,
+	       descs ? (double)exits / descs : 0.0);
+	printf("engine             %.2f MB/s, %.2f us per descriptor\n",
+	       busy ? bytes * 1000.0 / busy : 0.0, descs ? busy / 1000.0 / descs : 0.0);
+	lat_print(timed ? "replay latency" : "replay service", &replay);
+	lat_print("recorded latency", &recorded);
+
+	free(in_buf);
+	free(out_buf);
+	free(replay.v);
+	free(recorded.v);
+	return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * shared conversion service for pci-flip devices in server mode
+ *
+ * One process converts for every VM on the host.  It owns a shared
+ * memory region (memfd, or a file with -m) cut into slots; each device
+ * that connects to the socket gets a slot, which its guest sees as
+ * BAR 3, and a pair of eventfds.  Work from all VMs is taken in
+ * batches, so one wakeup serves many doorbells and the conversion code
+ * stays hot on one pinned cpu.
+ *
+ *   flip_server [-s slot] [-n vms] [-m file] [-c cpu] [-b batch] [-p us] socket
+ *   qemu ... -device pci-flip,server=socket
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "flip-conv.h"
+#include "flip-shm.h"
+
+/* same as hw/flip.c */
+#define FLIP_DESC_CONF     0xf
+#define FLIP_DESC_CRC      (0x1 << 5)
+#define FLIP_STS_OK        0x0
+#define FLIP_STS_ERR       0x1
+
+#define FLIP_SHM_SQ_OFF    4096                /* rings on the second page */
+#define FLIP_SHM_DATA_OFF  8192                /* data from the third, room for 128 entries */
+
+#define EV_LISTEN          (~0ULL)
+#define EV_SOCK            (1ULL << 32)        /* or'ed into the slot number */
+
+/* a connected device */
+struct vm {
+	int sock;              /* -1 while the slot is free */
+	int kick;              /* eventfd, device -> us */
+	int done;              /* eventfd, us -> device */
+	uint8_t *base;         /* slot */
+	FLIPShmRing *r;
+	uint32_t entries, nbufs, buf_size;
+	uint32_t sq_head, cq_tail;  /* our copies of what only we write */
+	int posted;            /* completions this round */
+};
+
+struct job {
+	struct vm *vm;
+	FLIPShmDesc d;
+};
+
+static struct vm *vms;
+static int nr_vms = 8;
+static size_t slot_size = 4 << 20;
+static uint8_t *shm;
+static int shm_fd;
+static struct job *jobs;
+static int batch = 64;
+static long poll_us;
+static unsigned long long rounds, round_descs;
+static volatile sig_atomic_t stop;
+
+static uint32_t rd32(uint32_t *p)
+{
+	return le32toh(__atomic_load_n(p, __ATOMIC_ACQUIRE));
+}
+
+static void wr32(uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, htole32(v), __ATOMIC_RELEASE);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	printf("usage: flip_server [-s slot] [-n vms] [-m file] [-c cpu] [-b batch] [-p us] socket\n");
+	printf("       -s: bytes per vm slot, power of 2, default 4M\n");
+	printf("       -n: vm slots, default 8\n");
+	printf("       -m: back the region with this file instead of a memfd\n");
+	printf("       -c: pin to this cpu\n");
+	printf("       -b: descriptors per batch over all vms, default 64\n");
+	printf("       -p: keep polling this long after the rings run dry\n");
+	exit(0);
+}
+
+/* fresh geometry and indices for a new device */
+static void slot_init(struct vm *vm, int slot)
+{
+	FLIPShmRing *r = vm->r;
+	int i;
+
+	vm->buf_size = FLIP_SHM_BUF;
+	vm->nbufs = (slot_size - FLIP_SHM_DATA_OFF) / vm->buf_size;
+	if (vm->nbufs > FLIP_SHM_MAX_BUFS)
+		vm->nbufs = FLIP_SHM_MAX_BUFS;
+	for (vm->entries = 2; vm->entries <= vm->nbufs; vm->entries <<= 1)
+		;
+	vm->sq_head = vm->cq_tail = 0;
+
+	memset(r, 0, sizeof(*r));
+	r->magic = htole32(FLIP_SHM_MAGIC);
+	r->version = htole32(FLIP_SHM_VERSION);
+	r->entries = htole32(vm->entries);
+	r->nbufs = htole32(vm->nbufs);
+	r->buf_size = htole32(vm->buf_size);
+	r->sq_off = htole32(FLIP_SHM_SQ_OFF);
+	r->cq_off = htole32(FLIP_SHM_SQ_OFF + vm->entries * sizeof(FLIPShmDesc));
+	r->data_off = htole32(FLIP_SHM_DATA_OFF);
+	r->slot = htole32(slot);
+	for (i = 0; i < FLIP_LUT_LEN; i++)
+		r->lut[i] = i;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static int send_hello(int sock, int slot, int *fds)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	FLIPShmHello h;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = htole32(FLIP_SHM_MAGIC);
+	h.version = htole32(FLIP_SHM_VERSION);
+	h.slot = htole32(slot);
+	h.offset = htole64((uint64_t)slot * slot_size);
+	h.size = htole64(slot_size);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &h;
+	iov.iov_len = sizeof(h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(h) ? 0 : -1;
+}
+
+static void vm_drop(int ep, int slot)
+{
+	struct vm *vm = &vms[slot];
+
+	epoll_ctl(ep, EPOLL_CTL_DEL, vm->sock, NULL);
+	epoll_ctl(ep, EPOLL_CTL_DEL, vm->kick, NULL);
+	close(vm->sock);
+	close(vm->kick);
+	close(vm->done);
+	vm->sock = -1;
+	printf("slot %d: disconnected, %llu descriptors, %llu bytes\n", slot,
+	       (unsigned long long)le64toh(vm->r->descs), (unsigned long long)le64toh(vm->r->bytes));
+}
+
+static void vm_accept(int ep, int lsock)
+{
+	struct epoll_event ev;
+	struct vm *vm;
+	int sock, slot, fds[3];
+
+	sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	for (slot = 0; slot < nr_vms && vms[slot].sock >= 0; slot++)
+		;
+	if (slot == nr_vms) {
+		printf("no free slot, connection refused\n");
+		close(sock);
+		return;
+	}
+
+	vm = &vms[slot];
+	/* the fds of the slot's last VM are closed, do not close them again on failure */
+	vm->kick = vm->done = -1;
+	vm->kick = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	vm->done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (vm->kick < 0 || vm->done < 0)
+		goto fail;
+
+	slot_init(vm, slot);
+
+	fds[0] = shm_fd;
+	fds[1] = vm->kick;
+	fds[2] = vm->done;
+	if (send_hello(sock, slot, fds) < 0)
+		goto fail;
+
+	vm->sock = sock;
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_SOCK | slot;
+	epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+	ev.data.u64 = slot;
+	epoll_ctl(ep, EPOLL_CTL_ADD, vm->kick, &ev);
+
+	printf("slot %d: connected, %u buffers of %u bytes\n", slot, vm->nbufs, vm->buf_size);
+	return;
+
+fail:
+	if (vm->kick >= 0)
+		close(vm->kick);
+	if (vm->done >= 0)
+		close(vm->done);
+	vm->kick = vm->done = -1;
+	close(sock);
+}
+
+/* take up to quota descriptors a completion can be posted for */
+static int vm_gather(struct vm *vm, struct job *j, int quota)
+{
+	FLIPShmDesc *sq = (FLIPShmDesc *)(vm->base + FLIP_SHM_SQ_OFF);
+	uint32_t tail = rd32(&vm->r->sq_tail) & (vm->entries - 1);
+	uint32_t room = vm->entries - 1
+			- ((vm->cq_tail - rd32(&vm->r->cq_head)) & (vm->entries - 1));
+	int n = 0;
+
+	while (n < quota && vm->sq_head != tail && room--) {
+		j[n].vm = vm;
+		j[n].d = sq[vm->sq_head];
+		vm->sq_head = (vm->sq_head + 1) & (vm->entries - 1);
+		n++;
+	}
+
+	if (n)
+		wr32(&vm->r->sq_head, vm->sq_head);
+
+	return n;
+}
+
+static void job_run(struct job *j)
+{
+	struct vm *vm = j->vm;
+	/* never trust the geometry in the slot, the guest can write it */
+	FLIPShmCompl *cq = (FLIPShmCompl *)(vm->base + FLIP_SHM_SQ_OFF
+					    + vm->entries * sizeof(FLIPShmDesc));
+	FLIPShmCompl *c = &cq[vm->cq_tail];
+	uint32_t buf = le32toh(j->d.buf), len = le32toh(j->d.len);
+	uint16_t flags = le16toh(j->d.flags);
+	uint8_t lut[FLIP_LUT_LEN];
+	uint8_t *p;
+	uint32_t crc = 0;
+
+	c->tag = j->d.tag;
+	c->status = htole16(FLIP_STS_OK);
+	c->len = htole32(len);
+
+	if (buf >= vm->nbufs || len > vm->buf_size) {
+		c->status = htole16(FLIP_STS_ERR);
+		c->len = 0;
+	} else {
+		/* the guest may rewrite the table under us, convert with one version */
+		memcpy(lut, vm->r->lut, sizeof(lut));
+		p = vm->base + FLIP_SHM_DATA_OFF + (size_t)buf * vm->buf_size;
+		if (flags & FLIP_DESC_CRC)
+			crc = ~flip_conv_crc(p, p, len, flags & FLIP_DESC_CONF, lut, ~0);
+		else
+			flip_conv(p, p, len, flags & FLIP_DESC_CONF, lut);
+		vm->r->descs = htole64(le64toh(vm->r->descs) + 1);
+		vm->r->bytes = htole64(le64toh(vm->r->bytes) + len);
+	}
+	c->crc = htole32(crc);
+
+	vm->cq_tail = (vm->cq_tail + 1) & (vm->entries - 1);
+	vm->posted++;
+}
+
+/* one batch over all vms, returns the descriptors done */
+static int server_round(void)
+{
+	static int rr;
+	int active = 0, quota, n = 0, i, slot;
+	uint64_t one = 1;
+
+	for (i = 0; i < nr_vms; i++)
+		active += vms[i].sock >= 0;
+	if (!active)
+		return 0;
+
+	/* a fair share each, in turn so nobody is always first */
+	quota = batch / active > 0 ? batch / active : 1;
+	for (i = 0; i < nr_vms && n < batch; i++) {
+		slot = (rr + i) % nr_vms;
+		if (vms[slot].sock >= 0)
+			n += vm_gather(&vms[slot], jobs + n, quota < batch - n ? quota : batch - n);
+	}
+	rr = (rr + 1) % nr_vms;
+
+	for (i = 0; i < n; i++)
+		job_run(&jobs[i]);
+
+	/* publish and ring each vm once */
+	for (i = 0; i < nr_vms; i++) {
+		if (!vms[i].posted)
+			continue;
+		wr32(&vms[i].r->cq_tail, vms[i].cq_tail);
+		vms[i].r->batches = htole64(le64toh(vms[i].r->batches) + 1);
+		if (write(vms[i].done, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			printf("slot %d: can not signal done\n", i);
+		vms[i].posted = 0;
+	}
+
+	if (n) {
+		rounds++;
+		round_descs += n;
+	}
+
+	return n;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int shm_open_region(const char *path, size_t size)
+{
+	int fd;
+
+	if (path)
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	else
+		fd = memfd_create("flip-shm", MFD_CLOEXEC);
+
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		printf("can not create the shared memory!\n");
+		exit(1);
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev, evs[64];
+	struct sockaddr_un sa;
+	const char *file = NULL;
+	cpu_set_t cpus;
+	long long idle;
+	uint64_t cnt;
+	int lsock, ep, opt, n, i, cpu = -1, slot;
+
+	while ((opt = getopt(argc, argv, "s:n:m:c:b:p:h")) != -1) {
+		switch (opt) {
+		case 's':
+			slot_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_vms = atoi(optarg);
+			break;
+		case 'm':
+			file = optarg;
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'p':
+			poll_us = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc || nr_vms < 1 || batch < 1 || (slot_size & (slot_size - 1))
+	    || slot_size < FLIP_SHM_DATA_OFF + FLIP_SHM_BUF)
+		usage();
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			printf("can not pin to cpu %d\n", cpu);
+	}
+
+	shm_fd = shm_open_region(file, slot_size * nr_vms);
+	shm = mmap(NULL, slot_size * nr_vms, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (shm == MAP_FAILED) {
+		printf("can not map the shared memory!\n");
+		exit(1);
+	}
+
+	vms = calloc(nr_vms, sizeof(*vms));
+	jobs = calloc(batch, sizeof(*jobs));
+	if (!vms || !jobs) {
+		printf("out of memory!\n");
+		exit(1);
+	}
+	for (i = 0; i < nr_vms; i++) {
+		vms[i].sock = -1;
+		vms[i].base = shm + (size_t)i * slot_size;
+		vms[i].r = (FLIPShmRing *)vms[i].base;
+	}
+
+	lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", argv[optind]);
+	unlink(sa.sun_path);
+	if (lsock < 0 || bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) < 0
+	    || listen(lsock, nr_vms) < 0) {
+		printf("can not listen on '%s'!\n", argv[optind]);
+		exit(1);
+	}
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_LISTEN;
+	epoll_ctl(ep, EPOLL_CTL_ADD, lsock, &ev);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	printf("flip server on %s, %d slots of %zu bytes\n", argv[optind], nr_vms, slot_size);
+
+	while (!stop) {
+		n = epoll_wait(ep, evs, 64, -1);
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.u64 == EV_LISTEN) {
+				vm_accept(ep, lsock);
+				continue;
+			}
+			/* one batch can hold a hangup and a kick for the same slot */
+			slot = evs[i].data.u64 & ~EV_SOCK;
+			if (vms[slot].sock < 0)
+				continue;
+			if (evs[i].data.u64 & EV_SOCK) {
+				/* the device never sends anything, readable means gone */
+				vm_drop(ep, slot);
+			} else {
+				if (read(vms[slot].kick, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+					vm_drop(ep, slot);
+			}
+		}
+
+		/* until every ring is dry, then a while longer if asked to */
+		idle = now_ns() + poll_us * 1000;
+		while (!stop) {
+			if (server_round())
+				idle = now_ns() + poll_us * 1000;
+			else if (now_ns() >= idle)
+				break;
+		}
+	}
+
+	printf("%llu batches, %.2f descriptors per batch\n", rounds,
+	       rounds ? (double)round_descs / rounds : 0.0);
+	for (i = 0; i < nr_vms; i++)
+		if (vms[i].sock >= 0)
+			printf("slot %d: %llu descriptors, %llu bytes, %llu batches\n", i,
+			       (unsigned long long)le64toh(vms[i].r->descs),
+			       (unsigned long long)le64toh(vms[i].r->bytes),
+			       (unsigned long long)le64toh(vms[i].r->batches));
+
+	unlink(sa.sun_path);
+	return 0;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+#
+# generate hw/flip-case.h, the unicode case tables of the UTF-8 modes
+#
+# usage: gen_case_table.py > ../hw/flip-case.h
+#
+# Python's str.upper()/lower() apply UnicodeData.txt and the
+# unconditional part of SpecialCasing.txt, which is what the device
+# does, so the tables follow the Unicode version of the interpreter.
+#
+# A code point mapping to one code point goes into a range: a run of
+# code points with the same delta, stride 1, or every other one, stride
+# 2, as the pairs of Latin Extended-A.  One expanding to several, like
+# U+00DF to "SS", goes into the special table as UTF-8.
+
+import sys
+import unicodedata
+
+GROWTH = 3      # FLIP_UTF8_GROWTH, output bytes per input byte at most
+LEN_MAX = 0xffff
+
+
+def mappings(upper):
+	single, special = {}, {}
+
+	for cp in range(0x80, 0x110000):
+		if 0xd800 <= cp <= 0xdfff:
+			continue
+		c = chr(cp)
+		m = c.upper() if upper else c.lower()
+		if m == c:
+			continue
+		out = m.encode('utf-8')
+		if len(out) > GROWTH * len(c.encode('utf-8')):
+			sys.exit('U+%04X grows more than %d times' % (cp, GROWTH))
+		if len(m) == 1:
+			single[cp] = ord(m) - cp
+		else:
+			special[cp] = out
+
+	return single, special
+
+
+def ranges(single):
+	out = []
+	cps = sorted(single)
+	i = 0
+
+	while i < len(cps):
+		first, delta = cps[i], single[cps[i]]
+		n, stride = 1, 1
+		if i + 1 < len(cps) and single[cps[i + 1]] == delta and cps[i + 1] - first in (1, 2):
+			stride = cps[i + 1] - first
+			while (i + n < len(cps) and n < LEN_MAX and cps[i + n] == first + n * stride
+			       and single[cps[i + n]] == delta):
+				n += 1
+		out.append((first, n, stride, delta))
+		i += n
+
+	return out
+
+
+def emit(name, upper):
+	single, special = mappings(upper)
+
+	print('static const FLIPCaseRange flip_case_%s_ranges[] = {' % name)
+	for first, n, stride, delta in ranges(single):
+		print('\t{ 0x%05x, %5d, %d, %7d },' % (first, n, stride, delta))
+	print('};\n')
+
+	print('static const FLIPCaseSpecial flip_case_%s_special[] = {' % name)
+	for cp in sorted(special):
+		s = ''.join('\\x%02x' % b for b in special[cp])
+		print('\t{ 0x%05x, %d, "%s" },' % (cp, len(special[cp]), s))
+	print('};\n')
+
+
+print('''/*
+ * unicode case tables of the UTF-8 modes, Unicode %s
+ *
+ * generated by tools/gen_case_table.py, do not edit
+ */
+
+#ifndef HW_FLIP_CASE_H
+#define HW_FLIP_CASE_H
+
+/* code points first, first + stride, ... len of them map to cp + delta */
+typedef struct FLIPCaseRange {
+	uint32_t first;
+	uint16_t len;
+	uint8_t stride;
+	int32_t delta;
+} FLIPCaseRange;
+
+/* a code point whose mapping is several code points, as UTF-8 */
+typedef struct FLIPCaseSpecial {
+	uint32_t cp;
+	uint8_t len;
+	char out[3 * 4];
+} FLIPCaseSpecial;
+''' % unicodedata.unidata_version)
+
+emit('upper', True)
+emit('lower', False)
+
+print('#endif')